@@ -27,9 +27,108 @@
 
 #include "DeckLinkAPI.h"
 
+struct PlayItem;
+struct FrameQueue;
+
+static const int kMaxMirrors = 8;
+
+// Generated signal, pip and drop flag a frame every second to check the lip sync
 enum OutputSignal {
-	kOutputSignalPip		= 0,
-	kOutputSignalDrop		= 1
+	kOutputSignalPip		= 0,	// black and silence, bars and tone on the flagged frame
+	kOutputSignalDrop		= 1,	// bars and tone, black and silence on the flagged frame
+	kOutputSignalPattern	= 2		// a test pattern and a steady tone
+};
+
+
+// Video frame backed by memory the caller keeps alive, e.g. a file mapping
+class MappedVideoFrame : public IDeckLinkVideoFrame
+{
+public:
+	MappedVideoFrame (void *data, long width, long height, long rowBytes, BMDPixelFormat pixelFormat)
+		: m_refCount(1), m_data(data), m_width(width), m_height(height), m_rowBytes(rowBytes), m_pixelFormat(pixelFormat),
+		  m_mutex(NULL), m_released(NULL) {}
+
+	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID iid, LPVOID *ppv)	{return E_NOINTERFACE;}
+	virtual ULONG STDMETHODCALLTYPE		AddRef ()									{return __sync_add_and_fetch(&m_refCount, 1);}
+	virtual ULONG STDMETHODCALLTYPE		Release ()
+	{
+		ULONG refCount = __sync_sub_and_fetch(&m_refCount, 1);
+		if (!refCount) {
+			delete this;
+		} else if (refCount == 1 && m_released) {
+			pthread_mutex_lock(m_mutex);
+			pthread_cond_broadcast(m_released);
+			pthread_mutex_unlock(m_mutex);
+		}
+		return refCount;
+	}
+
+	virtual long STDMETHODCALLTYPE				GetWidth ()			{return m_width;}
+	virtual long STDMETHODCALLTYPE				GetHeight ()		{return m_height;}
+	virtual long STDMETHODCALLTYPE				GetRowBytes ()		{return m_rowBytes;}
+	virtual BMDPixelFormat STDMETHODCALLTYPE	GetPixelFormat ()	{return m_pixelFormat;}
+	virtual BMDFrameFlags STDMETHODCALLTYPE		GetFlags ()			{return bmdFrameFlagDefault;}
+	virtual HRESULT STDMETHODCALLTYPE			GetBytes (void **buffer)	{*buffer = m_data; return S_OK;}
+	virtual HRESULT STDMETHODCALLTYPE			GetTimecode (BMDTimecodeFormat format, IDeckLinkTimecode **timecode)	{*timecode = NULL; return S_FALSE;}
+	virtual HRESULT STDMETHODCALLTYPE			GetAncillaryData (IDeckLinkVideoFrameAncillary **ancillary)			{*ancillary = NULL; return S_FALSE;}
+
+	// someone besides the owner still holds the frame
+	bool										Shared ()			{return __sync_add_and_fetch(&m_refCount, 0) > 1;}
+	// signal released once only the owner holds the frame again
+	void										NotifyRelease (pthread_mutex_t *mutex, pthread_cond_t *released)	{m_mutex = mutex; m_released = released;}
+
+private:
+	virtual ~MappedVideoFrame () {}
+
+	ULONG							m_refCount;
+	void*							m_data;
+	long							m_width;
+	long							m_height;
+	long							m_rowBytes;
+	BMDPixelFormat					m_pixelFormat;
+	pthread_mutex_t*				m_mutex;
+	pthread_cond_t*					m_released;
+};
+
+
+// Additional output playing the frames decoded for the main one, delayed
+class MirrorOutput : public IDeckLinkVideoOutputCallback
+{
+public:
+	MirrorOutput (IDeckLinkOutput *output, int delay);
+	~MirrorOutput ();
+
+	bool			Init ();
+	bool			Start (BMDDisplayMode mode, BMDTimeValue frameDuration, BMDTimeScale timeScale, int preroll);
+	void			StartPlayback (bool onBoundary);
+	void			Stop ();
+	void			Abort ();
+	void			Finish ();
+	int				Queue (IDeckLinkVideoFrame *frame, int64_t pts, int64_t duration);
+
+	unsigned long	Scheduled () const	{return m_scheduled;}
+	unsigned long	Late () const		{return m_late;}
+	bool			Failed () const		{return __atomic_load_n(&m_failed, __ATOMIC_ACQUIRE);}
+
+	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID iid, LPVOID *ppv)	{return E_NOINTERFACE;}
+	virtual ULONG STDMETHODCALLTYPE		AddRef ()									{return 1;}
+	virtual ULONG STDMETHODCALLTYPE		Release ()									{return 1;}
+
+	virtual HRESULT STDMETHODCALLTYPE	ScheduledFrameCompleted (IDeckLinkVideoFrame* completedFrame, BMDOutputFrameCompletionResult result);
+	virtual HRESULT STDMETHODCALLTYPE	ScheduledPlaybackHasStopped ()				{return S_OK;}
+
+private:
+	void			ScheduleNextFrame ();
+
+	IDeckLinkOutput*				m_output;
+	struct FrameQueue*				m_queue;
+	int								m_delay;
+	bool							m_running;
+	int								m_failed;
+	BMDTimeValue					m_frameDuration;
+	BMDTimeScale					m_frameTimescale;
+	unsigned long					m_scheduled;
+	unsigned long					m_late;
 };
 
 
@@ -45,15 +144,62 @@ protected:
 
 	unsigned long					m_frameWidth;
 	unsigned long					m_frameHeight;
+	unsigned long					m_rowBytes;
 	BMDTimeValue					m_frameDuration;
 	BMDTimeScale					m_frameTimescale;
 	unsigned long					m_framesPerSecond;
 	unsigned long					m_totalFramesScheduled;
+	unsigned long					m_lateFrames;
+	int								m_preroll;
+	int								m_framesInFlight;
+	bool							m_videoDone;
+	bool							m_audioPrerolled;	// under sleepMutex
+	pthread_cond_t					m_prerollCond;
+	unsigned long					m_framesOnTime;
+	BMDTimeValue					m_leadMin;
+	unsigned long					m_displayedLate;
+	unsigned long					m_dropped;
+
+	MirrorOutput*					m_mirrors[kMaxMirrors];
+	int								m_nbMirrors;
+
+	IDeckLinkVideoFrame*			m_liveLast;
+	int64_t							m_liveSlot;
+	int64_t							m_liveOffset;
+	unsigned long					m_liveRepeated;
+	unsigned long					m_liveDropped;
+
+	pthread_t						m_decodeThread;
+	bool							m_decoding;
+	int64_t							m_decodeTime;
+	int64_t							m_decodeTimeAvg;
+	int64_t							m_decodeTimeMax;
+	unsigned long					m_framesDecoded;
+	unsigned long					m_cueSkipped;
+	unsigned long					m_lastDecodeWarning;
+	struct DecklinkWatchdog*		m_watchdog;
+
+	// Cadence, the last two decoded frames and the next output slot
+	IDeckLinkMutableVideoFrame*		m_cadence[2];
+	int64_t							m_cadenceStart[2];
+	int64_t							m_cadenceEnd;
+	int64_t							m_cadenceSlot;
+	IDeckLinkVideoFrame*			m_cadenceCached;
+	bool							m_interlaced;
+	bool							m_lowerFieldFirst;
 
 	OutputSignal					m_outputSignal;
+	IDeckLinkMutableVideoFrame*		m_barsFrame;
+	IDeckLinkMutableVideoFrame*		m_blackFrame;
 	void*							m_audioBuffer;
 	unsigned long					m_audioBufferSampleLength;
 	unsigned long					m_audioBufferOffset;
+	BMDTimeValue					m_audioBufferTime;
+	struct PlayItem*				m_audioItem;
+	int								m_audioNextItem;
+	bool							m_audioCycleDone;
+	int64_t							m_audioReplayPos;
+	int64_t							m_audioReplayPass;
 	unsigned long					m_audioChannelCount;
 	BMDAudioSampleRate				m_audioSampleRate;
 	unsigned long					m_audioSampleDepth;
@@ -64,7 +210,43 @@ protected:
 	void			StartRunning (int videomode);
 	void			StopRunning ();
 	void			ScheduleNextFrame (bool prerolling);
+	int				NextLiveFrame (IDeckLinkVideoFrame **frame, int64_t *pts, int64_t *duration, bool prerolling);
+	void			StartPlayback ();
+	void			StartOnFrameBoundary ();
+	bool			OpenMirrors ();
+	int				QueueFrame (IDeckLinkVideoFrame *frame, int64_t pts, int64_t duration);
+	int				CopyFrame (IDeckLinkVideoFrame **frame);
+	int				BlendOverlay (IDeckLinkVideoFrame **frame, int64_t time);
+	void			BlendLiveOverlay (IDeckLinkVideoFrame *frame, int64_t time);
+	void			FinishFrames ();
+	void			UpdatePreroll (BMDOutputFrameCompletionResult result);
 	void			WriteNextAudioSamples ();
+	void			DecodeAudioPacket (AVPacket *pkt);
+	void			AppendAudioFrame (AVFrame *frame);
+	void			ScheduleAudioBuffer ();
+	void			ReplayCachedAudio ();
+	void			WriteGeneratedAudio ();
+	void			GenerateAudio (unsigned long samples);
+
+	// Video decoding thread, feeds the frame queue in presentation order
+	static void*	DecodeThread (void *priv);
+	void			DecodeVideo ();
+	void			UpdateDecodeStats ();
+	void			ReplayCachedVideo ();
+	int				PutCadenced (IDeckLinkMutableVideoFrame *frame, int64_t start, int64_t end);
+	int				FlushCadence ();
+	int				EmitSlot (int64_t slot);
+	IDeckLinkMutableVideoFrame*	PickField (int64_t time);
+	void			ResetCadence ();
+
+	// Signal generator, feeds the frame queue with the pattern frames
+	static void*	GeneratorThread (void *priv);
+	void			GenerateVideo ();
+	IDeckLinkVideoFrame*	NextGeneratedFrame (int64_t number);
+
+	// Raw playout, hands the mapped file pages to the output as they are
+	static void*	RawVideoThread (void *priv);
+	void			ReadRawVideo ();
 
 	IDeckLinkDisplayMode *GetDisplayModeByIndex(int selectedIndex);
 
@@ -84,6 +266,6 @@ public:
 };
 
 
-void	FillSine (void* audioBuffer, unsigned long samplesToWrite, unsigned long channels, unsigned long sampleDepth);
+void	FillSine (void* audioBuffer, unsigned long samplesToWrite, unsigned long channels, unsigned long sampleDepth, int64_t timestamp);
 void	FillColourBars (IDeckLinkVideoFrame* theFrame);
 void	FillBlack (IDeckLinkVideoFrame* theFrame);
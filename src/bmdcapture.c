@@ -21,12 +21,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <libavformat/avformat.h>
 #include "decklink_capture.h"
+#include "decklink_export.h"
+#include "decklink_framebus.h"
+#include "decklink_log.h"
+#include "decklink_probe.h"
+#include "decklink_rtp.h"
+#include "decklink_sched.h"
+#include "decklink_trace.h"
 
 static int verbose           = 0;
 static int max_frames        = -1;
@@ -35,6 +44,15 @@ static uint64_t memory_limit = 1024 * 1024 * 1024; // 1GByte(~50 sec)
 
 static enum PixelFormat pix_fmt = PIX_FMT_UYVY422;
 
+static DecklinkFramebus *bus = NULL;
+static DecklinkExport *export = NULL;
+static int bus_slots         = 8;
+static int export_buffers    = 8;
+static int export_held       = 4;
+
+static DecklinkRtp *rtp      = NULL;
+static volatile int rtp_running;
+
 typedef struct AVPacketQueue {
     AVPacketList *first_pkt, *last_pkt;
     int nb_packets;
@@ -46,6 +64,14 @@ typedef struct AVPacketQueue {
 
 static AVPacketQueue queue;
 
+AVStream *audio_st, *video_st;
+
+// the video packets carry the frame number as pts
+static int64_t packet_frame(const AVPacket *pkt)
+{
+    return pkt->stream_index == video_st->index ? pkt->pts : -1;
+}
+
 static void avpacket_queue_init(AVPacketQueue *q)
 {
     memset(q, 0, sizeof(AVPacketQueue));
@@ -105,6 +131,8 @@ static int avpacket_queue_put(AVPacketQueue *q, AVPacket *pkt)
     q->last_pkt = pkt1;
     q->nb_packets++;
     q->size += pkt1->pkt.size + sizeof(*pkt1);
+    BMD_PROBE(bmdcapture, queue_put, packet_frame(pkt), pkt->pts,
+              q->nb_packets);
 
     pthread_cond_signal(&q->cond);
 
@@ -129,6 +157,8 @@ static int avpacket_queue_get(AVPacketQueue *q, AVPacket *pkt, int block)
             q->nb_packets--;
             q->size -= pkt1->pkt.size + sizeof(*pkt1);
             *pkt     = pkt1->pkt;
+            BMD_PROBE(bmdcapture, queue_get, packet_frame(pkt), pkt->pts,
+                      q->nb_packets);
             av_free(pkt1);
             ret = 1;
             break;
@@ -155,7 +185,6 @@ static unsigned long long avpacket_queue_size(AVPacketQueue *q)
 AVFrame *picture;
 AVOutputFormat *fmt = NULL;
 AVFormatContext *oc;
-AVStream *audio_st, *video_st;
 
 static AVStream *add_audio_stream(DecklinkConf *conf, AVFormatContext *oc,
                                   enum AVCodecID codec_id)
@@ -256,11 +285,11 @@ static int video_callback(void *priv, uint8_t *frame,
     c = video_st->codec;
     if (verbose && frame_count++ % 25 == 0) {
         uint64_t qsize = avpacket_queue_size(&queue);
-        fprintf(stderr,
-                "Frame received (#%lu) - Valid (%dB) - QSize %f\n",
-                frame_count,
-                stride * height,
-                (double)qsize / 1024 / 1024);
+        decklink_log(DECKLINK_LOG_INFO,
+                     "Frame received (#%lu) - Valid (%dB) - QSize %f",
+                     (unsigned long)frame_count,
+                     stride * height,
+                     (double)qsize / 1024 / 1024);
     }
     avpicture_fill((AVPicture *)picture, (uint8_t *)frame,
                    pix_fmt,
@@ -275,6 +304,16 @@ static int video_callback(void *priv, uint8_t *frame,
     pkt.size         = stride * height;
     c->frame_number++;
     avpacket_queue_put(&queue, &pkt);
+    decklink_trace_mark(DECKLINK_TRACE_ENQUEUE, pkt.pts);
+
+    if (bus)
+        decklink_framebus_publish(bus, frame, width, height, stride,
+                                  ((DecklinkConf *)priv)->pixel_format,
+                                  timestamp, duration);
+    if (export)
+        decklink_export_publish(export, frame, width, height, stride,
+                                ((DecklinkConf *)priv)->pixel_format,
+                                timestamp, duration);
 
     return 0;
 }
@@ -311,7 +350,17 @@ static void *push_packet(void *ctx)
     int ret;
 
     while (avpacket_queue_get(&queue, &pkt, 1)) {
+        int64_t frame = packet_frame(&pkt);
+
+        if (frame >= 0)
+            decklink_trace_mark(DECKLINK_TRACE_DEQUEUE, frame);
+        BMD_PROBE(bmdcapture, write_start, frame_count, pkt.pts,
+                  queue.nb_packets);
+        decklink_trace_begin(DECKLINK_TRACE_WRITE, frame);
         av_interleaved_write_frame(s, &pkt);
+        decklink_trace_end(DECKLINK_TRACE_WRITE, -1);
+        BMD_PROBE(bmdcapture, write_end, frame_count, pkt.pts,
+                  queue.nb_packets);
         if (max_frames && frame_count > max_frames) {
             av_log(NULL, AV_LOG_INFO, "Frame limit reached\n");
             pthread_cond_signal(&cond);
@@ -325,16 +374,79 @@ static void *push_packet(void *ctx)
     return NULL;
 }
 
+/* RTP goes out from the export buffers, paced away from the capture
+ * thread. A buffer is not reused before it is released, the packets
+ * point straight in it while they are sent. */
+static void *send_rtp(void *priv)
+{
+    DecklinkExportReader *reader = priv;
+    DecklinkExportFrame frame;
+    int ret;
+
+    while (rtp_running) {
+        ret = decklink_export_next(reader, &frame, 100);
+        if (ret < 0)
+            break;
+        if (!ret)
+            continue;
+
+        decklink_rtp_send(rtp, frame.data, frame.stride, frame.timestamp,
+                          frame.duration);
+        decklink_export_release(reader, &frame);
+    }
+
+    return NULL;
+}
+
+// from the watchdog thread, the queue lock may be what is stuck
+static void capture_stalled(void *priv, const DecklinkStall *stall)
+{
+    if (!stall->recovered)
+        decklink_log(DECKLINK_LOG_WARNING,
+                     "Queue: %d packets, %f MB", queue.nb_packets,
+                     (double)queue.size / 1024 / 1024);
+}
+
+// the writer and the sender follow the library threads
+static void sched_thread(pthread_t thread, const char *name, DecklinkConf *c)
+{
+    int ret;
+
+    if (!c->sched_policy && !c->cpus)
+        return;
+
+    ret = decklink_sched_thread(thread, c->sched_policy, c->sched_priority,
+                                c->cpus);
+    if (ret < 0)
+        fprintf(stderr, "Cannot set the %s thread scheduling: %s\n",
+                name, strerror(-ret));
+}
+
+static void dump_trace(int signum)
+{
+    decklink_trace_request();
+}
+
 int main(int argc, char *argv[])
 {
     int ret = 1;
     int ch, i;
     char *filename = NULL;
+    char *bus_path = NULL;
+    char *export_path = NULL;
+    char *trace_path = NULL;
+    char *rtp_host = NULL, *rtp_port = NULL;
+    char rtp_path[64];
+    DecklinkExportReader *rtp_reader = NULL;
+    pthread_t rtp_th;
+    int frame_size;
     pthread_mutex_t mux;
 
     DecklinkConf c  = { .video_cb = video_callback,
-                        .audio_cb = audio_callback };
-    DecklinkCapture *capture;
+                        .audio_cb = audio_callback,
+                        .stall_cb = capture_stalled };
+    DecklinkCapture *capture = NULL;
+    DecklinkCaptureStats stats;
     pthread_t th;
 
     pthread_mutex_init(&mux, NULL);
@@ -342,7 +454,7 @@ int main(int argc, char *argv[])
     av_register_all();
 
     // Parse command line options
-    while ((ch = getopt(argc, argv, "?hvc:s:f:a:m:n:p:M:F:C:A:V:")) != -1) {
+    while ((ch = getopt(argc, argv, "?hvc:s:f:a:m:n:p:M:F:C:A:V:B:N:E:b:H:R:e:w:Q:U:K")) != -1) {
         switch (ch) {
         case 'v':
             verbose = 1;
@@ -401,6 +513,52 @@ int main(int argc, char *argv[])
         case 'C':
             c.instance = atoi(optarg);
             break;
+        case 'B':
+            bus_path = optarg;
+            break;
+        case 'N':
+            bus_slots = atoi(optarg);
+            break;
+        case 'E':
+            export_path = optarg;
+            break;
+        case 'b':
+            export_buffers = atoi(optarg);
+            break;
+        case 'H':
+            export_held = atoi(optarg);
+            break;
+        case 'e':
+            trace_path = optarg;
+            break;
+        case 'w':
+            c.watchdog      = atoi(optarg);
+            c.watchdog_dump = 1;
+            break;
+        case 'Q':
+            if (decklink_sched_parse(optarg, &c.sched_policy,
+                                     &c.sched_priority) < 0) {
+                fprintf(stderr,
+                        "Invalid argument: scheduling must be fifo:<prio> or rr:<prio>\n");
+                goto bail;
+            }
+            break;
+        case 'U':
+            c.cpus = optarg;
+            break;
+        case 'K':
+            c.lock_memory = 1;
+            break;
+        case 'R':
+            rtp_host = optarg;
+            rtp_port = strrchr(optarg, ':');
+            if (!rtp_port) {
+                fprintf(stderr,
+                        "Invalid argument: RTP destination must be host:port\n");
+                goto bail;
+            }
+            *rtp_port++ = '\0';
+            break;
         case '?':
         case 'h':
             exit(0);
@@ -411,6 +569,15 @@ int main(int argc, char *argv[])
 
     capture = decklink_capture_alloc(&c);
 
+    // SIGUSR1 dumps the events so far, the rest is dumped at the end
+    if (trace_path) {
+        if (decklink_trace_start(trace_path, 4096) < 0) {
+            fprintf(stderr, "Could not trace to '%s'\n", trace_path);
+            goto bail;
+        }
+        signal(SIGUSR1, dump_trace);
+    }
+
     if (!filename) {
         fprintf(stderr,
                 "Missing argument: Please specify output path using -f\n");
@@ -447,6 +614,48 @@ int main(int argc, char *argv[])
     video_st = add_video_stream(&c, oc, fmt->video_codec);
     audio_st = add_audio_stream(&c, oc, fmt->audio_codec);
 
+    // v210 packs 6 pixels in 16 bytes, lines padded to 128 bytes
+    frame_size = (c.pixel_format ? (c.width + 47) / 48 * 128
+                                 : c.width * 2) * c.height;
+
+    if (bus_path) {
+        bus = decklink_framebus_alloc(bus_path, bus_slots, frame_size);
+        if (!bus) {
+            fprintf(stderr, "Could not create the frame bus at '%s'\n",
+                    bus_path);
+            goto bail;
+        }
+    }
+
+    // without -E the RTP sender gets an export of its own
+    if (rtp_host && !export_path) {
+        snprintf(rtp_path, sizeof(rtp_path), "/tmp/bmdcapture-rtp.%d",
+                 (int)getpid());
+        export_path = rtp_path;
+    }
+
+    if (export_path) {
+        export = decklink_export_alloc(export_path, export_buffers, frame_size,
+                                       export_held);
+        if (!export) {
+            fprintf(stderr, "Could not export the frames at '%s'\n",
+                    export_path);
+            goto bail;
+        }
+    }
+
+    if (rtp_host) {
+        rtp = decklink_rtp_alloc(rtp_host, atoi(rtp_port),
+                                 c.width, c.height, c.pixel_format,
+                                 c.tb_den, 0, 1);
+        rtp_reader = decklink_export_connect(export_path);
+        if (!rtp || !rtp_reader) {
+            fprintf(stderr, "Could not send RTP to %s:%s\n",
+                    rtp_host, rtp_port);
+            goto bail;
+        }
+    }
+
     if (!(fmt->flags & AVFMT_NOFILE)) {
         if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
             fprintf(stderr, "Could not open '%s'\n", oc->filename);
@@ -460,6 +669,16 @@ int main(int argc, char *argv[])
 
     if (pthread_create(&th, NULL, push_packet, oc))
         goto bail;
+    sched_thread(th, "writer", &c);
+
+    if (rtp) {
+        rtp_running = 1;
+        if (pthread_create(&rtp_th, NULL, send_rtp, rtp_reader)) {
+            rtp_running = 0;
+            goto bail;
+        }
+        sched_thread(rtp_th, "RTP", &c);
+    }
 
     decklink_capture_start(capture);
 
@@ -470,10 +689,30 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Stopping Capture\n");
 
     decklink_capture_stop(capture);
+    decklink_capture_stats(capture, &stats);
+    if (c.watchdog)
+        fprintf(stderr, "Capture stalled %lu times\n",
+                (unsigned long)stats.stalls);
+    if (verbose)
+        fprintf(stderr, "%lu frames, the callback ran %.3f ms after the "
+                "capture on average, %.3f ms at worst\n",
+                (unsigned long)stats.frames, stats.callback_late / 1e6,
+                stats.callback_max / 1e6);
     ret = 0;
 
 bail:
+    if (rtp_running) {
+        rtp_running = 0;
+        pthread_join(rtp_th, NULL);
+    }
+    decklink_export_disconnect(rtp_reader);
+    decklink_rtp_free(rtp);
     decklink_capture_free(capture);
+    decklink_framebus_free(bus);
+    decklink_export_free(export);
+    if (trace_path)
+        decklink_trace_stop();
+    decklink_log_flush();
 
     if (oc != NULL) {
         av_write_trailer(oc);
@@ -40,6 +40,7 @@
 #include "Capture.h"
 extern "C" {
 #include "libavformat/avformat.h"
+#include "decklink_log.h"
 }
 
 pthread_mutex_t sleepMutex;
@@ -334,10 +335,13 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
     // Handle Video Frame
     if (videoFrame) {
         if (videoFrame->GetFlags() & bmdFrameHasNoInputSource) {
-            fprintf(
-                stderr,
-                "Frame received (#%lu) - No input signal detected - Frames dropped %u - Total dropped %u\n",
-                frameCount, ++dropped, ++totaldropped);
+            ++dropped;
+            ++totaldropped;
+            decklink_log_ratelimit(1000, DECKLINK_LOG_WARNING,
+                                   "Frame received (#%lu) - No input signal "
+                                   "detected - Frames dropped %u - "
+                                   "Total dropped %u",
+                                   frameCount, dropped, totaldropped);
             return S_OK;
         } else {
             AVPacket pkt;
@@ -346,11 +350,11 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
             c = video_st->codec;
             if (g_verbose && frameCount % 25 == 0) {
                 unsigned long long qsize = avpacket_queue_size(&queue);
-                fprintf(stderr,
-                        "Frame received (#%lu) - Valid (%liB) - QSize %f\n",
-                        frameCount,
-                        videoFrame->GetRowBytes() * videoFrame->GetHeight(),
-                        (double)qsize / 1024 / 1024);
+                decklink_log(DECKLINK_LOG_INFO,
+                             "Frame received (#%lu) - Valid (%liB) - QSize %f",
+                             frameCount,
+                             videoFrame->GetRowBytes() * videoFrame->GetHeight(),
+                             (double)qsize / 1024 / 1024);
             }
             videoFrame->GetBytes(&frameBytes);
             avpicture_fill((AVPicture *)picture, (uint8_t *)frameBytes,
@@ -874,6 +878,8 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Stopping Capture\n");
 
 bail:
+    decklink_log_flush();
+
     if (displayModeIterator != NULL) {
         displayModeIterator->Release();
         displayModeIterator = NULL;
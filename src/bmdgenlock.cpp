@@ -16,42 +16,349 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
  */
 
-#include <DeckLinkAPIDispatch.cpp>
-#include "DeckLinkAPI.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+
+extern "C" {
+#include "decklink_reference.h"
+}
+
+#define MAX_CARDS 64
+#define NO_OFFSET 1024 // out of range, the card keeps its offset
 
 int usage(int status);
-int kbhit(void);
+int getkey(void);
+
+static volatile sig_atomic_t running = 1;
+
+static void sigfunc(int signum)
+{
+    running = 0;
+}
+
+typedef struct Card {
+    DecklinkReference *ref;
+    int index;
+    int offset;     // to apply at startup
+    int status;     // the last one logged
+    pthread_t thread;
+    bool threaded;
+} Card;
+
+/* wall clock with milliseconds, for the log */
+static void log_time(char *buf, int size)
+{
+    struct timeval tv;
+    struct tm tm;
+    int len;
+
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tm);
+    len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03d", (int)(tv.tv_usec / 1000));
+}
+
+static const char *status_name(int status)
+{
+    switch (status) {
+    case DECKLINK_REFERENCE_NONE:     return "NO REF IN";
+    case DECKLINK_REFERENCE_UNLOCKED: return "UNLOCKED";
+    case DECKLINK_REFERENCE_LOCKED:   return "LOCKED";
+    default:                          return "ERROR";
+    }
+}
+
+static void *apply_offset(void *priv)
+{
+    Card *card = (Card *)priv;
+    char now[32];
+
+    if (decklink_reference_set_offset(card->ref, card->offset) < 0) {
+        log_time(now, sizeof(now));
+        fprintf(stderr, "%s card %d #OFFSETERROR %d\n", now, card->index,
+                card->offset);
+    }
+
+    return NULL;
+}
+
+/* "<card> <offset>" per line, # starts a comment */
+static int load_offsets(const char *file, Card *cards)
+{
+    FILE *f = fopen(file, "r");
+    char line[256];
+    int index, offset;
+
+    if (!f) {
+        fprintf(stderr, "#ERROR: Cannot open %s\n", file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%d %d", &index, &offset) != 2)
+            continue;
+        if (index < 0 || index >= MAX_CARDS ||
+            offset < -511 || offset > 511) {
+            fprintf(stderr, "#OUT OF RANGE: %s", line);
+            continue;
+        }
+        cards[index].offset = offset;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+/* Watch the reference of every card and log when the lock changes.
+ * The stored offsets go to all the cards at once, then a single thread
+ * wakes up every interval and polls them. */
+static int daemon_mode(const char *offsets, int interval)
+{
+    Card cards[MAX_CARDS];
+    struct timespec next;
+    int nb_cards = 0;
+    char now[32];
+
+    for (int i = 0; i < MAX_CARDS; i++) {
+        cards[i].index    = i;
+        cards[i].offset   = NO_OFFSET;
+        cards[i].status   = -2; // anything, the first poll is logged
+        cards[i].threaded = false;
+    }
+
+    if (offsets && load_offsets(offsets, cards) < 0)
+        return 1;
+
+    while (nb_cards < MAX_CARDS &&
+           (cards[nb_cards].ref = decklink_reference_alloc(nb_cards)))
+        nb_cards++;
+
+    if (!nb_cards) {
+        fprintf(stderr, "#NO CARD\n");
+        return 1;
+    }
+
+    for (int i = 0; i < nb_cards; i++) {
+        if (cards[i].offset == NO_OFFSET)
+            continue;
+        cards[i].threaded = !pthread_create(&cards[i].thread, NULL,
+                                            apply_offset, &cards[i]);
+        if (!cards[i].threaded)
+            apply_offset(&cards[i]);
+    }
+    for (int i = 0; i < nb_cards; i++)
+        if (cards[i].threaded)
+            pthread_join(cards[i].thread, NULL);
+
+    log_time(now, sizeof(now));
+    fprintf(stderr, "%s watching %d cards\n", now, nb_cards);
+
+    signal(SIGINT, sigfunc);
+    signal(SIGTERM, sigfunc);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (running) {
+        for (int i = 0; i < nb_cards; i++) {
+            int status = decklink_reference_status(cards[i].ref);
+
+            if (status == cards[i].status)
+                continue;
+            log_time(now, sizeof(now));
+            fprintf(stderr, "%s card %d %s\n", now, i, status_name(status));
+            cards[i].status = status;
+        }
+
+        next.tv_nsec += interval * 1000000L;
+        next.tv_sec  += next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    for (int i = 0; i < nb_cards; i++)
+        decklink_reference_free(cards[i].ref);
+
+    return 0;
+}
+
+/* Automatic calibration: the output phase is measured against a signal
+ * locked to the reference on the card input while the offset is bisected
+ * until the phase crosses the target. The measurement is a callback, so
+ * the search can run against a simulated card as well. */
+typedef int (*MeasureFunc)(void *priv, int offset, int64_t *phase,
+                           int64_t *period);
+
+typedef struct Calibration {
+    DecklinkReference *ref;
+    int video_mode;
+    int nb_frames;
+} Calibration;
+
+static int measure_card(void *priv, int offset, int64_t *phase,
+                        int64_t *period)
+{
+    Calibration *c = (Calibration *)priv;
+
+    if (decklink_reference_set_offset(c->ref, offset) < 0)
+        return -1;
+
+    return decklink_reference_measure(c->ref, c->video_mode, c->nb_frames,
+                                      phase, period);
+}
+
+/* A card whose output moves 37 ns, a 27 MHz pixel, per offset step, with
+ * a few ns of jitter on every sample. The jitter comes from a fixed seed,
+ * the same phase always calibrates the same way. */
+typedef struct SimulatedCard {
+    int64_t phase;      // at offset 0
+    int64_t period;
+    int nb_frames;
+    unsigned int seed;
+} SimulatedCard;
+
+static int measure_simulated(void *priv, int offset, int64_t *phase,
+                             int64_t *period)
+{
+    SimulatedCard *s = (SimulatedCard *)priv;
+    int64_t sum = 0;
+
+    for (int i = 0; i < s->nb_frames; i++)
+        sum += rand_r(&s->seed) % 11 - 5;
+
+    *period = s->period;
+    *phase  = ((s->phase + offset * 37 + sum / s->nb_frames) % s->period +
+               s->period) % s->period;
+
+    return 0;
+}
+
+/* signed distance to the target, the phase wraps around the period */
+static int64_t phase_error(int64_t phase, int64_t target, int64_t period)
+{
+    return ((phase - target) % period + period + period / 2) % period -
+           period / 2;
+}
+
+static int measure_error(MeasureFunc measure, void *priv, int offset,
+                         int64_t target, int64_t *error, int64_t *period)
+{
+    int64_t phase;
+
+    if (measure(priv, offset, &phase, period) < 0) {
+        fprintf(stderr, "#MEASURE ERROR at offset %d\n", offset);
+        return -1;
+    }
+
+    *error = phase_error(phase, target, *period);
+    fprintf(stderr, "offset %4d phase %9lld ns error %7lld ns\n",
+            offset, (long long)phase, (long long)*error);
+
+    return 0;
+}
+
+static int calibrate(MeasureFunc measure, void *priv, int64_t target,
+                     int *best)
+{
+    int lo = -511, hi = 511;
+    int64_t err_lo, err_hi, err, period;
+
+    if (measure_error(measure, priv, lo, target, &err_lo, &period) < 0 ||
+        measure_error(measure, priv, hi, target, &err_hi, &period) < 0)
+        return -1;
+
+    // out of reach, get as close as the range allows. The error also
+    // changes sign half a period away from the target, where it wraps.
+    if ((err_lo < 0) == (err_hi < 0) ||
+        llabs(err_lo) + llabs(err_hi) > period / 2) {
+        *best = llabs(err_lo) < llabs(err_hi) ? lo : hi;
+        fprintf(stderr, "#OUT OF RANGE: the target cannot be reached\n");
+        return 0;
+    }
+
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (measure_error(measure, priv, mid, target, &err, &period) < 0)
+            return -1;
+        if ((err < 0) == (err_lo < 0)) {
+            lo     = mid;
+            err_lo = err;
+        } else {
+            hi     = mid;
+            err_hi = err;
+        }
+    }
+
+    *best = llabs(err_lo) <= llabs(err_hi) ? lo : hi;
+
+    return 0;
+}
+
+/* Replace or add the line of the card in the offsets file */
+static int store_offset(const char *file, int card, int offset)
+{
+    char tmp[1024], line[256];
+    FILE *in, *out;
+    int index, value;
+    bool stored = false;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    out = fopen(tmp, "w");
+    if (!out)
+        return -1;
+
+    in = fopen(file, "r");
+    while (in && fgets(line, sizeof(line), in)) {
+        if (line[0] != '#' && sscanf(line, "%d %d", &index, &value) == 2 &&
+            index == card) {
+            if (stored)
+                continue;
+            snprintf(line, sizeof(line), "%d %d\n", card, offset);
+            stored = true;
+        }
+        fputs(line, out);
+    }
+    if (in)
+        fclose(in);
+    if (!stored)
+        fprintf(out, "%d %d\n", card, offset);
+
+    if (fclose(out) || rename(tmp, file)) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
 
 int	main (int argc, char** argv)
 {
-    IDeckLinkIterator       *deckLinkIterator;
-    IDeckLink               *deckLink;
-    IDeckLinkConfiguration  *deckLinkConfiguration;
-    IDeckLinkOutput         *deckLinkOutput;
-    BMDReferenceStatus      referenceStatus;
-    HRESULT                 result;
-    int                     offset = 0, camera = 0, i=0;
+    DecklinkReference       *ref = NULL;
+    int                     status;
+    int                     offset = 0, camera = 0;
     int                     ch;
     int                     exitStatus = 1;
+    int                     interval = 100;
     bool                    interactive = false;
-    char                    key;
-
-    // Create an IDeckLinkIterator object to enumerate all DeckLink cards in the system
-    deckLinkIterator = CreateDeckLinkIteratorInstance();
-    if (deckLinkIterator == NULL)
-    {
-		fprintf(stderr, "#NO DRIVER\n");
-		return 1;
-    }
+    bool                    watch = false;
+    const char              *offsets = NULL;
+    bool                    automatic = false;
+    bool                    simulate = false;
+    int64_t                 target = 0;
+    SimulatedCard           simulated = { 0, 40000000, 50, 1 };
+    Calibration             calibration = { NULL, 0, 50 };
+    int                     key = 0;
 
     // Parse command line options
     if (argc < 2) usage(0);
-    while ((ch = getopt(argc, argv, "?hC:IO:")) != -1)
+    while ((ch = getopt(argc, argv, "?hC:IO:DF:i:AT:m:S:")) != -1)
     {
         switch (ch)
         {
@@ -64,6 +371,30 @@ int	main (int argc, char** argv)
             case 'I':
             	interactive = true;
             	break;
+            case 'D':
+                watch = true;
+                break;
+            case 'F':
+                offsets = optarg;
+                break;
+            case 'A':
+                automatic = true;
+                break;
+            case 'T':
+                target = strtoll(optarg, NULL, 10);
+                break;
+            case 'm':
+                calibration.video_mode = atoi(optarg);
+                break;
+            case 'S':
+                automatic = simulate = true;
+                simulated.phase = strtoll(optarg, NULL, 10);
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                if (interval <= 0)
+                    usage(1);
+                break;
             case '?':
             case 'h':
                 usage(0);
@@ -71,43 +402,61 @@ int	main (int argc, char** argv)
         }
     }
 
-    /* Connect to the first DeckLink instance */
-    do {
-    	result = deckLinkIterator->Next(&deckLink);
-    } while(i++<camera);
+    if (watch)
+        return daemon_mode(offsets, interval);
 
-    if (result != S_OK)
+    if (simulate) {
+        if (calibrate(measure_simulated, &simulated, target, &offset) < 0)
+            return 1;
+        fprintf(stderr, "CALIBRATED %d\n", offset);
+        return 0;
+    }
+
+    ref = decklink_reference_alloc(camera);
+    if (!ref)
     {
         fprintf(stderr, "#NO CARD\n");
         goto bail;
     }
 
-    if (deckLink->QueryInterface(IID_IDeckLinkOutput, (void**)&deckLinkOutput) != S_OK)
-        goto bail;
+    status = decklink_reference_status(ref);
+    if (status == DECKLINK_REFERENCE_NONE){
+    	fprintf(stderr, "#NO REF IN Input on card = %d\n", camera);
+    	goto bail;
+    }
 
-    result = deckLink->QueryInterface(IID_IDeckLinkConfiguration, (void**)&deckLinkConfiguration);
-    if (result != S_OK)
-    {
-        fprintf(stderr, "#ERROR: Could not obtain the IDeckLinkConfiguration interface - result = %08x\n", result);
+    if (automatic){
+        if (status != DECKLINK_REFERENCE_LOCKED){
+            fprintf(stderr, "#REF IN Input UNLOCKED SOURCE on card = %d\n", camera);
+            goto bail;
+        }
+        calibration.ref = ref;
+        if (calibrate(measure_card, &calibration, target, &offset) < 0 ||
+            decklink_reference_set_offset(ref, offset) < 0){
+            fprintf(stderr, "#CALIBRATION ERROR\n");
+            goto bail;
+        }
+        if (decklink_reference_save(ref) < 0)
+            fprintf(stderr, "#ERROR: Cannot store the offset in the preferences\n");
+        if (offsets && store_offset(offsets, camera, offset) < 0)
+            fprintf(stderr, "#ERROR: Cannot store the offset in %s\n", offsets);
+        fprintf(stderr, "CALIBRATED %d\n", offset);
+        exitStatus = 0;
         goto bail;
     }
 
     // Here is the code for the interactive mode (it assumes REF IN locked)
     if (interactive){
-        result=deckLinkOutput->GetReferenceStatus(&referenceStatus);
-        if (referenceStatus & bmdReferenceNotSupportedByHardware){
-        	fprintf(stderr, "#NO REF IN Input on card = %d\n", camera);
-        	goto bail;
-        }
-    	if(referenceStatus & bmdReferenceLocked){
+    	if(status == DECKLINK_REFERENCE_LOCKED){
     		// Now we can start to adjust the time offset to the reference source
-    		while(key != 'q'){
+    		while(key != 'q' && key != EOF){
     			if (offset <= -511) offset = -511;
     			if (offset >= 511) offset = 511;
-    			result=deckLinkConfiguration->SetInt(bmdDeckLinkConfigReferenceInputTimingOffset, (int64_t) offset);
-    			if (result != S_OK) fprintf(stderr, "Card:%d Offset:%d ERROR          \r",camera,offset);
-    			else                fprintf(stderr, "Card:%d Offset:%d OK             \r",camera,offset);
-    			while(!kbhit());key=getchar();
+    			if (decklink_reference_set_offset(ref, offset) < 0)
+    			    fprintf(stderr, "Card:%d Offset:%d ERROR          \r",camera,offset);
+    			else
+    			    fprintf(stderr, "Card:%d Offset:%d OK             \r",camera,offset);
+    			key=getkey();
     			if(key == '+') offset++;
     			else if(key == '-') offset--;
     		}
@@ -119,36 +468,22 @@ int	main (int argc, char** argv)
     }
 
     // Here is the code to make the stuff
-    result=deckLinkOutput->GetReferenceStatus(&referenceStatus);
-    if (referenceStatus & bmdReferenceNotSupportedByHardware){
-    	fprintf(stderr, "#NO REF IN Input on card = %d\n", camera);
-    	goto bail;
+    if(status == DECKLINK_REFERENCE_LOCKED) fprintf(stderr, "LOCKED ");
+    else fprintf(stderr, "UNLOCKED ");
+    if ((offset >= -511) && (offset <= 511)){
+    	if (decklink_reference_set_offset(ref, offset) < 0) fprintf(stderr, "#OFFSETERROR\n");
+    	else{
+    		fprintf(stderr, "%d\n",offset);
+    		exitStatus = 0;
+    	}
     }
     else{
-    	if(referenceStatus & bmdReferenceLocked) fprintf(stderr, "LOCKED ");
-    	else fprintf(stderr, "UNLOCKED ");
-        if ((offset >= -511) && (offset <= 511)){
-        	result=deckLinkConfiguration->SetInt(bmdDeckLinkConfigReferenceInputTimingOffset, (int64_t) offset);
-        	if (result != S_OK) fprintf(stderr, "#OFFSETERROR\n");
-        	else{
-        		fprintf(stderr, "%d\n",offset);
-        		exitStatus = 0;
-        	}
-        }
-        else{
-        	fprintf(stderr, "#OUT OF RANGE: Timing offset value is out of range: from -511 to 511\n");
-        	goto bail;
-        }
+    	fprintf(stderr, "#OUT OF RANGE: Timing offset value is out of range: from -511 to 511\n");
+    	goto bail;
     }
 
 bail:
-    if (deckLink != NULL)
-    {
-        deckLink->Release();
-        deckLink = NULL;
-    }
-
-    if (deckLinkIterator != NULL) deckLinkIterator->Release();
+    decklink_reference_free(ref);
 
     return exitStatus;
 
@@ -162,6 +497,14 @@ int usage(int status)
         "    -C <num>                 number of card to be used (default = 0)\n"
     	"    -O <ref_in_time_offset>  reference input time offset (default = 0) (min = -511 ; max = 511)\n"
        	"    -I                       interactive mode (press keys: + = increase offset, - = decrease offset, q = exit once fixed\n"
+        "    -D                       daemon mode, log the lock changes of every card\n"
+        "    -F <file>                offsets, \"<card> <offset>\" per line, applied by -D and updated by -A\n"
+        "    -i <ms>                  with -D, how often the cards are polled (default = 100)\n"
+        "    -A                       find the offset putting the output at the target phase,\n"
+        "                             the card input needs a signal locked to the reference\n"
+        "    -T <ns>                  with -A, output phase after the input signal (default = 0)\n"
+        "    -m <mode>                with -A, video mode of the input signal and the output (default = 0)\n"
+        "    -S <ns>                  with -A, calibrate a simulated card having this phase at offset 0\n"
         "\n"
         "Stablish the reference input timing offset eg:\n"
         "\n"
@@ -171,30 +514,20 @@ int usage(int status)
     exit(status);
 }
 
-int kbhit(void)
+/* Wait for a single key press, without echo or line buffering */
+int getkey(void)
 {
     struct termios oldt, newt;
     int ch;
-    int oldf;
 
     tcgetattr(STDIN_FILENO, &oldt);
     newt = oldt;
     newt.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-    oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
     ch = getchar();
 
     tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-    fcntl(STDIN_FILENO, F_SETFL, oldf);
-
-    if(ch != EOF)
-    {
-		ungetc(ch, stdin);
-		return 1;
-    }
 
-    return 0;
+    return ch;
 }
-
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
 #include <string.h>
 #include <libgen.h>
 #include <signal.h>
@@ -37,26 +38,37 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/time.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
 #include "libswscale/swscale.h"
+#include "decklink_generator.h"
+#include "decklink_log.h"
+#include "decklink_sched.h"
+#include "decklink_trace.h"
+#include "decklink_watchdog.h"
+#include "live_source.h"
 }
 
-#include <DeckLinkAPIDispatch.cpp>
 #include <DeckLinkAPI.h>
 #include "compat.h"
+#include "decklink_probe.h"
 #include "Play.h"
 
 pthread_mutex_t sleepMutex;
 pthread_cond_t sleepCond;
 IDeckLinkConfiguration *deckLinkConfiguration;
 
-AVFormatContext *ic;
 AVFrame *avframe;
+AVFrame *audioframe;
 AVStream *audio_st = NULL;
 AVStream *video_st = NULL;
 
@@ -64,13 +76,58 @@ static enum PixelFormat pix_fmt = PIX_FMT_UYVY422;
 static BMDPixelFormat pix       = bmdFormat8BitYUV;
 
 int buffer    = 2000 * 1000;
+int threads   = 0;
+int thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+int raw_playout = 0;
+int loop        = 0;
+int64_t cache_budget = 512 * 1024 * 1024;
+enum FitMode {
+    FIT_STRETCH,   // fill the output, ignoring the aspect ratio
+    FIT_LETTERBOX, // show the whole picture, black bars around it
+    FIT_CROP,      // fill the output, cutting the overflow
+};
+int fit_mode    = FIT_LETTERBOX;
+int mirror_card[kMaxMirrors];
+int mirror_delay[kMaxMirrors];
+int nb_mirrors  = 0;
+int live          = 0;
+int jitter_frames = 2;
+int generate      = 0;
+const char *cue_point = NULL;
+int cue_wait          = 0;
+int64_t cue_time;
+const char *trace_file = NULL;
+int watchdog          = 0;
+int sched_policy      = DECKLINK_SCHED_OTHER;
+int sched_priority    = 0;
+const char *sched_cpus = NULL;
+int lock_memory       = 0;
+OutputSignal output_signal     = kOutputSignalPattern;
+DecklinkPattern signal_pattern = DECKLINK_PATTERN_BARS;
+int min_preroll = 2;
+int max_preroll = 10;
 
-const unsigned long kAudioWaterlevel = 48000 / 4;      /* small */
+unsigned long audio_waterlevel = 48000 / 4;      /* small */
+int audio_channels = -1;    // of the output once set up, 0 without audio
+const int kFrameQueueSize             = 16;
+
+typedef struct PacketList {
+    AVPacket pkt;
+    int64_t duration;       // AV_TIME_BASE
+    uint64_t serial;        // packets put in the queue before this one
+    struct PacketList *next;
+} PacketList;
+
+/* The reader stays at most that far ahead of the decoders */
+static const uint64_t kMaxQueuePackets = 1000;
+int64_t max_queue_duration;
 
 typedef struct PacketQueue {
-    AVPacketList *first_pkt, *last_pkt;
+    PacketList *first_pkt, *last_pkt;
     uint64_t nb_packets;
     int size;
+    int64_t duration;       // AV_TIME_BASE, of the packets queued
+    uint64_t serial;        // packets put so far, the probes frame number
     int abort_request;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
@@ -78,9 +135,8 @@ typedef struct PacketQueue {
 
 PacketQueue audioqueue;
 PacketQueue videoqueue;
-struct SwsContext *sws;
 
-static int packet_queue_put(PacketQueue *q, AVPacket *pkt);
+static int packet_queue_put(PacketQueue *q, AVPacket *pkt, int64_t duration);
 
 static void packet_queue_init(PacketQueue *q)
 {
@@ -92,7 +148,7 @@ static void packet_queue_init(PacketQueue *q)
 
 static void packet_queue_flush(PacketQueue *q)
 {
-    AVPacketList *pkt, *pkt1;
+    PacketList *pkt, *pkt1;
 
     pthread_mutex_lock(&q->mutex);
     for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
@@ -104,33 +160,47 @@ static void packet_queue_flush(PacketQueue *q)
     q->first_pkt  = NULL;
     q->nb_packets = 0;
     q->size       = 0;
+    q->duration   = 0;
+    pthread_cond_broadcast(&q->cond);
     pthread_mutex_unlock(&q->mutex);
 }
 
-static void packet_queue_end(PacketQueue *q)
+static void packet_queue_abort(PacketQueue *q)
 {
-    packet_queue_flush(q);
     pthread_mutex_lock(&q->mutex);
     q->abort_request = -1;
-    pthread_cond_signal(&q->cond);
+    pthread_cond_broadcast(&q->cond);
     pthread_mutex_unlock(&q->mutex);
+}
+
+/* No more packets will be put, the readers get -1 once it is drained. */
+static void packet_queue_finish(PacketQueue *q)
+{
+    packet_queue_abort(q);
+}
+
+static void packet_queue_end(PacketQueue *q)
+{
+    packet_queue_flush(q);
+    packet_queue_abort(q);
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->cond);
 }
 
-static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+static int packet_queue_put(PacketQueue *q, AVPacket *pkt, int64_t duration)
 {
-    AVPacketList *pkt1;
+    PacketList *pkt1;
 
     /* duplicate the packet */
     if (av_dup_packet(pkt) < 0)
         return -1;
 
-    pkt1 = (AVPacketList *)av_malloc(sizeof(AVPacketList));
+    pkt1 = (PacketList *)av_malloc(sizeof(PacketList));
     if (!pkt1)
         return -1;
-    pkt1->pkt  = *pkt;
-    pkt1->next = NULL;
+    pkt1->pkt      = *pkt;
+    pkt1->duration = duration;
+    pkt1->next     = NULL;
 
     pthread_mutex_lock(&q->mutex);
 
@@ -141,12 +211,17 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
         q->last_pkt->next = pkt1;
     q->last_pkt = pkt1;
     q->nb_packets++;
+    pkt1->serial = q->serial++;
+    BMD_PROBE(bmdplay, packet_queue_put, pkt1->serial, pkt->pts,
+              q->nb_packets);
     if (q->nb_packets > 5000)
-        fprintf(stderr, "%ld storing %p, %s\n",
-                q->nb_packets,
-                q,
-                q == &videoqueue ? "videoqueue" : "audioqueue");
-    q->size += pkt1->pkt.size + sizeof(*pkt1);
+        decklink_log_ratelimit(1000, DECKLINK_LOG_WARNING,
+                               "%ld storing %p, %s",
+                               (long)q->nb_packets,
+                               q,
+                               q == &videoqueue ? "videoqueue" : "audioqueue");
+    q->size     += pkt1->pkt.size + sizeof(*pkt1);
+    q->duration += duration;
 
     pthread_cond_signal(&q->cond);
 
@@ -156,7 +231,7 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 
 static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
 {
-    AVPacketList *pkt1;
+    PacketList *pkt1;
     int ret;
 
     pthread_mutex_lock(&q->mutex);
@@ -168,24 +243,30 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
             if (!q->first_pkt)
                 q->last_pkt = NULL;
             q->nb_packets--;
+            BMD_PROBE(bmdplay, packet_queue_get, pkt1->serial,
+                      pkt1->pkt.pts, q->nb_packets);
             if (q->nb_packets > 5000)
-                fprintf(stderr, "pulling %ld from %p %s\n",
-                        q->nb_packets,
-                        q,
-                        q == &videoqueue ? "videoqueue" : "audioqueue");
-            q->size -= pkt1->pkt.size + sizeof(*pkt1);
-            *pkt     = pkt1->pkt;
+                decklink_log_ratelimit(1000, DECKLINK_LOG_WARNING,
+                                       "pulling %ld from %p %s",
+                                       (long)q->nb_packets,
+                                       q,
+                                       q == &videoqueue ? "videoqueue"
+                                                        : "audioqueue");
+            q->size     -= pkt1->pkt.size + sizeof(*pkt1);
+            q->duration -= pkt1->duration;
+            *pkt         = pkt1->pkt;
             av_free(pkt1);
+            // the reader might be waiting for room
+            pthread_cond_broadcast(&q->cond);
             ret = 1;
             break;
+        } else if (q->abort_request) {
+            ret = -1;
+            break;
         } else if (!block) {
             ret = 0;
             break;
         } else {
-            if (q->abort_request) {
-                ret = -1;
-                break;
-            }
             pthread_cond_wait(&q->cond, &q->mutex);
         }
     }
@@ -193,591 +274,3991 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
     return ret;
 }
 
-int64_t first_audio_pts = AV_NOPTS_VALUE;
-int64_t first_video_pts = AV_NOPTS_VALUE;
-int64_t first_pts       = AV_NOPTS_VALUE;
-int fill_me             = 1;
-
-void *fill_queues(void *unused)
+/* Block while the queue holds too many packets or too long a stretch,
+ * -1 once it is aborted. */
+static int packet_queue_wait_room(PacketQueue *q)
 {
-    AVPacket pkt;
-    AVStream *st;
-    int once = 0;
+    int ret;
 
-    while (fill_me) {
-        int err = av_read_frame(ic, &pkt);
-        if (err) {
-            return NULL;
-        }
-        if (videoqueue.nb_packets > 1000) {
-            if (!once++)
-                fprintf(stderr, "Queue size %d problems ahead\n",
-                        videoqueue.size);
-        }
-        st = ic->streams[pkt.stream_index];
-        switch (st->codec->codec_type) {
-        case AVMEDIA_TYPE_VIDEO:
-            if (pkt.pts != AV_NOPTS_VALUE) {
-                if (first_pts == AV_NOPTS_VALUE) {
-                    first_pts       = first_video_pts = pkt.pts;
-                    first_audio_pts =
-                        av_rescale_q(pkt.pts, video_st->time_base,
-                                     audio_st->time_base);
-                }
-                pkt.pts -= first_video_pts;
-            }
-            packet_queue_put(&videoqueue, &pkt);
-            break;
-        case AVMEDIA_TYPE_AUDIO:
-            if (pkt.pts != AV_NOPTS_VALUE) {
-                if (first_pts == AV_NOPTS_VALUE) {
-                    first_pts       = first_audio_pts = pkt.pts;
-                    first_video_pts =
-                        av_rescale_q(pkt.pts, audio_st->time_base,
-                                     video_st->time_base);
-                }
-                pkt.pts -= first_audio_pts;
-            }
-            packet_queue_put(&audioqueue, &pkt);
-            break;
-        }
-/*	    while (videoqueue.nb_packets>10)
- *              usleep(30); */
-        //fprintf(stderr, "V %d A %d\n", videoqueue.nb_packets, audioqueue.nb_packets); //----->
-    }
-    return NULL;
+    pthread_mutex_lock(&q->mutex);
+    while (!q->abort_request && q->first_pkt &&
+           (q->nb_packets >= kMaxQueuePackets ||
+            q->duration >= max_queue_duration))
+        pthread_cond_wait(&q->cond, &q->mutex);
+    ret = q->abort_request ? -1 : 0;
+    pthread_mutex_unlock(&q->mutex);
+
+    return ret;
 }
 
-void sigfunc(int signum)
+/* Decoded and converted frames, in presentation order, waiting to be
+ * scheduled. The decoder thread fills it, the DeckLink callback drains it. */
+typedef struct FrameQueue {
+    IDeckLinkVideoFrame **frames;
+    int64_t *pts;
+    int64_t *duration;
+    int size;
+    int rindex, windex;
+    int nb_frames;
+    int abort_request;
+    int finished;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} FrameQueue;
+
+FrameQueue framequeue;
+
+static int frame_queue_init(FrameQueue *q, int size)
 {
-    pthread_cond_signal(&sleepCond);
+    memset(q, 0, sizeof(FrameQueue));
+    q->frames   = (IDeckLinkVideoFrame **)av_mallocz(size * sizeof(*q->frames));
+    q->pts      = (int64_t *)av_mallocz(size * sizeof(*q->pts));
+    q->duration = (int64_t *)av_mallocz(size * sizeof(*q->duration));
+    if (!q->frames || !q->pts || !q->duration)
+        return -1;
+    q->size = size;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    return 0;
 }
 
-void print_output_modes(IDeckLink *deckLink)
+static void frame_queue_abort(FrameQueue *q)
 {
-    IDeckLinkOutput *deckLinkOutput                   = NULL;
-    IDeckLinkDisplayModeIterator *displayModeIterator = NULL;
-    IDeckLinkDisplayMode *displayMode                 = NULL;
-    HRESULT result;
-    int displayModeCount = 0;
+    pthread_mutex_lock(&q->mutex);
+    q->abort_request = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
 
-    // Query the DeckLink for its configuration interface
-    result = deckLink->QueryInterface(IID_IDeckLinkOutput,
-                                      (void **)&deckLinkOutput);
-    if (result != S_OK) {
-        fprintf(
-            stderr,
-            "Could not obtain the IDeckLinkOutput interface - result = %08x\n",
-            result);
-        goto bail;
-    }
+/* No more frames will be put, let the readers drain it and stop. */
+static void frame_queue_finish(FrameQueue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->finished = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
 
-    // Obtain an IDeckLinkDisplayModeIterator to enumerate the display modes supported on output
-    result = deckLinkOutput->GetDisplayModeIterator(&displayModeIterator);
-    if (result != S_OK) {
-        fprintf(
-            stderr,
-            "Could not obtain the video output display mode iterator - result = %08x\n",
-            result);
-        goto bail;
+static void frame_queue_end(FrameQueue *q)
+{
+    frame_queue_abort(q);
+    while (q->nb_frames--) {
+        q->frames[q->rindex]->Release();
+        q->rindex = (q->rindex + 1) % q->size;
     }
+    av_freep(&q->frames);
+    av_freep(&q->pts);
+    av_freep(&q->duration);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+}
 
-    // List all supported output display modes
-    printf("Supported video output display modes and pixel formats:\n");
-    while (displayModeIterator->Next(&displayMode) == S_OK) {
-        BMDProbeString str;
+/* Takes ownership of the frame reference, blocks while the queue is full.
+ * Without block a frame that does not fit is dropped and 1 returned. */
+static int frame_queue_put(FrameQueue *q, IDeckLinkVideoFrame *frame,
+                           int64_t pts, int64_t duration, int block)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (block && q->nb_frames == q->size && !q->abort_request)
+        pthread_cond_wait(&q->cond, &q->mutex);
 
-        result = displayMode->GetName(&str);
-        if (result == S_OK) {
-            char modeName[64];
-            int modeWidth;
-            int modeHeight;
-            BMDTimeValue frameRateDuration;
-            BMDTimeScale frameRateScale;
-            int pixelFormatIndex = 0;                                                         // index into the gKnownPixelFormats / gKnownFormatNames arrays
-            BMDDisplayModeSupport displayModeSupport;
-            // Obtain the display mode's properties
-            modeWidth  = displayMode->GetWidth();
-            modeHeight = displayMode->GetHeight();
-            displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
-            printf("        %2d:   %-20s \t %d x %d \t %7g FPS\n",
-                   displayModeCount++, ToStr(str), modeWidth, modeHeight,
-                   (double)frameRateScale / (double)frameRateDuration);
+    if (q->abort_request) {
+        pthread_mutex_unlock(&q->mutex);
+        frame->Release();
+        return -1;
+    }
 
-            FreeStr(str);
-        }
-        // Release the IDeckLinkDisplayMode object to prevent a leak
-        displayMode->Release();
+    if (q->nb_frames == q->size) {
+        pthread_mutex_unlock(&q->mutex);
+        frame->Release();
+        return 1;
     }
-//	printf("\n");
-bail:
-    // Ensure that the interfaces we obtained are released to prevent a memory leak
-    if (displayModeIterator != NULL)
-        displayModeIterator->Release();
-    if (deckLinkOutput != NULL)
-        deckLinkOutput->Release();
+
+    q->frames[q->windex]   = frame;
+    q->pts[q->windex]      = pts;
+    q->duration[q->windex] = duration;
+    q->windex = (q->windex + 1) % q->size;
+    q->nb_frames++;
+    BMD_PROBE(bmdplay, frame_queue_put, duration ? pts / duration : -1, pts,
+              q->nb_frames);
+    decklink_trace_mark(DECKLINK_TRACE_ENQUEUE, duration ? pts / duration : -1);
+
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
 }
 
-int usage(int status)
+static int frame_queue_get(FrameQueue *q, IDeckLinkVideoFrame **frame,
+                           int64_t *pts, int64_t *duration, int block)
 {
-    HRESULT result;
-    IDeckLinkIterator *deckLinkIterator;
-    IDeckLink *deckLink;
-    int numDevices = 0;
+    int ret;
 
-    fprintf(stderr,
-            "Usage: bmdplay -m <mode id> [OPTIONS]\n"
-            "\n"
-            "    -m <mode id>:\n"
-            );
+    pthread_mutex_lock(&q->mutex);
 
-    // Create an IDeckLinkIterator object to enumerate all DeckLink cards in the system
-    deckLinkIterator = CreateDeckLinkIteratorInstance();
-    if (deckLinkIterator == NULL) {
-        fprintf(
-            stderr,
-            "A DeckLink iterator could not be created.  The DeckLink drivers may not be installed.\n");
-        return 1;
+    for (;; ) {
+        if (q->abort_request) {
+            ret = -1;
+            break;
+        } else if (q->nb_frames) {
+            *frame    = q->frames[q->rindex];
+            *pts      = q->pts[q->rindex];
+            *duration = q->duration[q->rindex];
+            q->rindex = (q->rindex + 1) % q->size;
+            q->nb_frames--;
+            BMD_PROBE(bmdplay, frame_queue_get,
+                      *duration ? *pts / *duration : -1, *pts,
+                      q->nb_frames);
+            decklink_trace_mark(DECKLINK_TRACE_DEQUEUE,
+                                *duration ? *pts / *duration : -1);
+            pthread_cond_broadcast(&q->cond);
+            ret = 1;
+            break;
+        } else if (q->finished) {
+            ret = -1;
+            break;
+        } else if (!block) {
+            ret = 0;
+            break;
+        } else {
+            pthread_cond_wait(&q->cond, &q->mutex);
+        }
     }
+    pthread_mutex_unlock(&q->mutex);
+    return ret;
+}
 
-    // Enumerate all cards in this system
-    while (deckLinkIterator->Next(&deckLink) == S_OK) {
-        BMDProbeString str;
+/* Wait until n frames are queued or no more will come. */
+static void frame_queue_wait(FrameQueue *q, int n)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->nb_frames < FFMIN(n, q->size) &&
+           !q->abort_request && !q->finished)
+        pthread_cond_wait(&q->cond, &q->mutex);
+    pthread_mutex_unlock(&q->mutex);
+}
 
-        // Increment the total number of DeckLink cards found
-        numDevices++;
-        if (numDevices > 1)
-            printf("\n\n");
+static int frame_queue_count(FrameQueue *q)
+{
+    int count;
+    pthread_mutex_lock(&q->mutex);
+    count = q->nb_frames;
+    pthread_mutex_unlock(&q->mutex);
+    return count;
+}
 
-        // *** Print the model name of the DeckLink card
-        result = deckLink->GetModelName(&str);
-        if (result == S_OK) {
-            printf("-> %s (-C %d )\n\n",
-                   ToStr(str),
-                   numDevices - 1);
-            FreeStr(str);
-        }
+/* The reader and the decoder feed the card, they run as asked on the
+ * command line. */
+static void sched_thread(pthread_t thread, const char *name)
+{
+    int ret;
 
-        print_output_modes(deckLink);
-        // Release the IDeckLink instance when we've finished with it to prevent leaks
-        deckLink->Release();
-    }
-    deckLinkIterator->Release();
+    if (!sched_policy && !sched_cpus)
+        return;
 
-    // If no DeckLink cards were found in the system, inform the user
-    if (numDevices == 0)
-        printf("No Blackmagic Design devices were found.\n");
-    printf("\n");
+    ret = decklink_sched_thread(thread, sched_policy, sched_priority,
+                                sched_cpus);
+    if (ret < 0)
+        fprintf(stderr, "Cannot set the %s thread scheduling: %s\n",
+                name, strerror(-ret));
+}
 
-    fprintf(
-        stderr,
-        "    -f <filename>        Filename raw video will be written to\n"
-        "    -C <num>             Card number to be used\n"
-        "    -b <num>             Milliseconds of pre-buffering before playback (default = 2000 ms)\n"
-        "    -p <pixel>           PixelFormat Depth (8 or 10 - default is 8)\n"
-        "    -O <output>          Output connection:\n"
-        "                         1: Composite video + analog audio\n"
-        "                         2: Components video + analog audio\n"
-        "                         3: HDMI video + audio\n"
-        "                         4: SDI video + audio\n\n");
+/* From the watchdog, a stuck thread may hold the queue locks so the
+ * depths are read without them. */
+static void dump_queues(void *opaque)
+{
+    decklink_log(DECKLINK_LOG_WARNING,
+                 "Queues: %ld video packets, %ld audio packets, %d frames",
+                 (long)videoqueue.nb_packets, (long)audioqueue.nb_packets,
+                 framequeue.nb_frames);
+}
 
-    return status;
+/* Fetch one sample as signed 32bit, left aligned. */
+static inline int32_t audio_sample_s32(const uint8_t *src, int idx,
+                                       enum AVSampleFormat fmt)
+{
+    float f;
+    double d;
+
+    switch (fmt) {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_U8P:
+        return (int32_t)(src[idx] - 0x80) << 24;
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S16P:
+        return (int32_t)((const int16_t *)src)[idx] << 16;
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_S32P:
+        return ((const int32_t *)src)[idx];
+    case AV_SAMPLE_FMT_FLT:
+    case AV_SAMPLE_FMT_FLTP:
+        f = ((const float *)src)[idx];
+        if (f >= 1.0f)
+            return INT_MAX;
+        if (f <= -1.0f)
+            return INT_MIN;
+        return (int32_t)(f * 2147483648.0f);
+    case AV_SAMPLE_FMT_DBL:
+    case AV_SAMPLE_FMT_DBLP:
+        d = ((const double *)src)[idx];
+        if (d >= 1.0)
+            return INT_MAX;
+        if (d <= -1.0)
+            return INT_MIN;
+        return (int32_t)(d * 2147483648.0);
+    default:
+        return 0;
+    }
 }
 
-int main(int argc, char *argv[])
+/**
+ * Convert a decoded audio frame to the interleaved s16/s32 layout the
+ * output expects, channels not present in the source are left silent.
+ */
+static void convert_audio(uint8_t *dst, int depth, int out_channels,
+                          AVFrame *frame, int channels,
+                          enum AVSampleFormat fmt)
 {
-    Player generator;
-    int ch, ret;
-    int videomode  = 2;
-    int connection = 0;
-    int camera     = 0;
-    char *filename = NULL;
+    int planar = av_sample_fmt_is_planar(fmt);
+    int16_t *dst16 = (int16_t *)dst;
+    int32_t *dst32 = (int32_t *)dst;
 
-    while ((ch = getopt(argc, argv, "?hs:f:a:m:n:F:C:O:b:p:")) != -1) {
-        switch (ch) {
-        case 'p':
-            switch (atoi(optarg)) {
-            case  8:
-                pix     = bmdFormat8BitYUV;
-                pix_fmt = PIX_FMT_UYVY422;
-                break;
-            case 10:
-                pix     = bmdFormat10BitYUV;
-                pix_fmt = PIX_FMT_YUV422P10;
-                break;
-            default:
-                fprintf(
-                    stderr,
-                    "Invalid argument: Pixel Format Depth must be either 8 bits or 10 bits\n");
-                return usage(1);
+    for (int i = 0; i < frame->nb_samples; i++) {
+        for (int ch = 0; ch < out_channels; ch++) {
+            int32_t v = 0;
+
+            if (ch < channels) {
+                if (planar)
+                    v = audio_sample_s32(frame->extended_data[ch], i, fmt);
+                else
+                    v = audio_sample_s32(frame->extended_data[0],
+                                         i * channels + ch, fmt);
             }
-            break;
-        case 'f':
-            filename = strdup(optarg);
-            break;
-        case 'm':
-            videomode = atoi(optarg);
-            break;
-        case 'O':
-            connection = atoi(optarg);
-            break;
-        case 'C':
-            camera = atoi(optarg);
-            break;
-        case 'b':
-            buffer = atoi(optarg) * 1000;
-            break;
-        case '?':
-        case 'h':
-            return usage(0);
+
+            if (depth == 16)
+                *dst16++ = v >> 16;
+            else
+                *dst32++ = v;
         }
     }
+}
 
-    if (!filename)
-        return usage(1);
+/* Raw playout: the file is mapped and its uncompressed frames are
+ * handed to the output as they are, without demuxing or decoding. */
+typedef struct RawIndex {
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    int64_t *offsets;   // NULL for headerless files with fixed stride
+    int nb_frames;
+    int frame_size;
+} RawIndex;
 
-    av_register_all();
-    ic = avformat_alloc_context();
+RawIndex raw_index = { -1 };
 
-    avformat_open_input(&ic, filename, NULL, NULL);
-    avformat_find_stream_info(ic, NULL);
+/* The index is only trusted for the file it was built from, the size
+ * and the modification time are checked. */
+static int raw_index_load(RawIndex *idx, const char *path,
+                          const struct stat *st)
+{
+    FILE *f = fopen(path, "r");
+    long long offset, size, mtime;
+    int nb_frames, frame_size;
 
-    for (int i = 0; i < ic->nb_streams; i++) {
-        AVStream *st          = ic->streams[i];
-        AVCodecContext *avctx = st->codec;
+    if (!f)
+        return -1;
+
+    if (fscanf(f, "bmdindex %d %d %lld %lld\n", &frame_size, &nb_frames,
+               &size, &mtime) != 4 ||
+        frame_size <= 0 || nb_frames <= 0)
+        goto fail;
+
+    if (size != (long long)st->st_size || mtime != (long long)st->st_mtime) {
+        fprintf(stderr, "Stale index %s, rebuilding it\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    idx->offsets = (int64_t *)av_malloc(nb_frames * sizeof(*idx->offsets));
+    if (!idx->offsets)
+        goto fail;
+
+    for (int i = 0; i < nb_frames; i++) {
+        if (fscanf(f, "%lld\n", &offset) != 1 || offset < 0 ||
+            offset + frame_size > (long long)idx->map_size)
+            goto fail;
+        idx->offsets[i] = offset;
+    }
+
+    idx->nb_frames  = nb_frames;
+    idx->frame_size = frame_size;
+    fclose(f);
+    return 0;
+
+fail:
+    fprintf(stderr, "Invalid index %s, ignoring it\n", path);
+    av_freep(&idx->offsets);
+    fclose(f);
+    return -1;
+}
+
+static void raw_index_save(RawIndex *idx, const char *path,
+                           const struct stat *st)
+{
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        fprintf(stderr, "Cannot write the index %s\n", path);
+        return;
+    }
+
+    fprintf(f, "bmdindex %d %d %lld %lld\n", idx->frame_size, idx->nb_frames,
+            (long long)st->st_size, (long long)st->st_mtime);
+    for (int i = 0; i < idx->nb_frames; i++)
+        fprintf(f, "%lld\n", (long long)idx->offsets[i]);
+    fclose(f);
+}
+
+/* Find where the payload of each video packet lies in the mapping by
+ * demuxing once, the match is verified against the packet data. */
+static int raw_index_build(RawIndex *idx, const char *filename)
+{
+    AVFormatContext *fc = NULL;
+    AVPacket pkt;
+    int video = -1, allocated = 0, ret = 0;
+
+    if (avformat_open_input(&fc, filename, NULL, NULL) < 0)
+        return -1;
+
+    for (unsigned i = 0; i < fc->nb_streams; i++) {
+        AVCodecContext *avctx = fc->streams[i]->codec;
+        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO)
+            video = i;
+        else
+            fc->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    if (video < 0 ||
+        (fc->streams[video]->codec->codec_id != AV_CODEC_ID_RAWVIDEO &&
+         fc->streams[video]->codec->codec_id != AV_CODEC_ID_V210)) {
+        avformat_close_input(&fc);
+        return -1;
+    }
+
+    while (!ret && av_read_frame(fc, &pkt) >= 0) {
+        int64_t pos = pkt.pos;
+
+        if (pkt.stream_index == video) {
+            if (idx->frame_size && pkt.size != idx->frame_size)
+                ret = -1;
+            else if (pos < 0 || pos + pkt.size > (int64_t)idx->map_size ||
+                     memcmp(idx->map + pos, pkt.data, pkt.size))
+                ret = -1;
+            else if (idx->nb_frames == allocated) {
+                int64_t *offsets;
+                allocated = FFMAX(2 * allocated, 256);
+                offsets   = (int64_t *)av_realloc(idx->offsets,
+                                                  allocated * sizeof(*offsets));
+                if (!offsets)
+                    ret = -1;
+                else
+                    idx->offsets = offsets;
+            }
+
+            if (!ret) {
+                idx->frame_size = pkt.size;
+                idx->offsets[idx->nb_frames++] = pos;
+            }
+        }
+        av_free_packet(&pkt);
+    }
+
+    avformat_close_input(&fc);
+
+    if (ret < 0 || !idx->nb_frames) {
+        av_freep(&idx->offsets);
+        idx->nb_frames  = 0;
+        idx->frame_size = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int raw_index_open(RawIndex *idx, const char *filename)
+{
+    char path[1024];
+    struct stat st;
+
+    idx->fd = open(filename, O_RDONLY);
+    if (idx->fd < 0 || fstat(idx->fd, &st) < 0 || !st.st_size) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+
+    idx->map_size = st.st_size;
+    idx->map      = (uint8_t *)mmap(NULL, idx->map_size, PROT_READ,
+                                    MAP_SHARED, idx->fd, 0);
+    if (idx->map == MAP_FAILED) {
+        idx->map = NULL;
+        fprintf(stderr, "Cannot map %s\n", filename);
+        return -1;
+    }
+
+    madvise(idx->map, idx->map_size, MADV_SEQUENTIAL);
+
+    snprintf(path, sizeof(path), "%s.idx", filename);
+
+    if (!raw_index_load(idx, path, &st))
+        return 0;
+
+    if (!raw_index_build(idx, filename)) {
+        raw_index_save(idx, path, &st);
+        return 0;
+    }
+
+    // headerless file, the stride is known once the output mode is
+    fprintf(stderr, "No index for %s, assuming a headerless raw file\n",
+            filename);
+    return 0;
+}
+
+static void raw_index_close(RawIndex *idx)
+{
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    if (idx->fd >= 0)
+        close(idx->fd);
+    av_freep(&idx->offsets);
+}
+
+static inline uint8_t *raw_index_frame(RawIndex *idx, int n)
+{
+    if (idx->offsets)
+        return idx->map + idx->offsets[n];
+    return idx->map + (size_t)n * idx->frame_size;
+}
+
+static void raw_index_prefetch(RawIndex *idx, int n)
+{
+    long page    = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)raw_index_frame(idx, n) & ~(page - 1);
+    uintptr_t end   = (uintptr_t)raw_index_frame(idx, n) + idx->frame_size;
+
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+static int row_bytes(BMDPixelFormat format, int width)
+{
+    switch (format) {
+    case bmdFormat10BitYUV:
+        return ((width + 47) / 48) * 128;
+    default:
+        return width * 2;
+    }
+}
+
+static const AVRational time_base_q = { 1, AV_TIME_BASE };
+
+int fill_me = 1;
+
+/* Signal generator, the moving patterns are drawn in a pool of frames
+ * and each one only gets the changes since it was last used. The
+ * frames stay valid until the output is stopped. */
+typedef struct PatternPool {
+    DecklinkGenerator *gen;
+    MappedVideoFrame **frames;
+    uint8_t **data;
+    int64_t *drawn;
+    int nb_frames;
+    int row_bytes;
+    pthread_mutex_t mutex;  // signalled as the frames come back
+    pthread_cond_t released;
+} PatternPool;
+
+PatternPool pattern_pool;
+
+static void pattern_pool_close(PatternPool *p)
+{
+    for (int i = 0; i < p->nb_frames; i++) {
+        if (p->frames[i])
+            p->frames[i]->Release();
+        av_free(p->data[i]);
+    }
+    av_freep(&p->frames);
+    av_freep(&p->data);
+    av_freep(&p->drawn);
+    if (p->gen) {
+        pthread_mutex_destroy(&p->mutex);
+        pthread_cond_destroy(&p->released);
+    }
+    decklink_generator_free(p->gen);
+    p->gen       = NULL;
+    p->nb_frames = 0;
+}
+
+static int pattern_pool_open(PatternPool *p, DecklinkPattern pattern,
+                             int nb_frames, long width, long height,
+                             long rowBytes, BMDPixelFormat format)
+{
+    p->gen = decklink_generator_alloc(width, height,
+                                      format == bmdFormat10BitYUV, pattern);
+    p->frames    = (MappedVideoFrame **)av_mallocz(nb_frames * sizeof(*p->frames));
+    p->data      = (uint8_t **)av_mallocz(nb_frames * sizeof(*p->data));
+    p->drawn     = (int64_t *)av_mallocz(nb_frames * sizeof(*p->drawn));
+    p->row_bytes = rowBytes;
+    if (p->gen) {
+        pthread_mutex_init(&p->mutex, NULL);
+        pthread_cond_init(&p->released, NULL);
+    }
+    if (!p->gen || !p->frames || !p->data || !p->drawn)
+        goto fail;
+
+    for (; p->nb_frames < nb_frames; p->nb_frames++) {
+        int i = p->nb_frames;
+
+        p->data[i] = (uint8_t *)av_malloc(rowBytes * height);
+        if (!p->data[i])
+            goto fail;
+        p->frames[i] = new MappedVideoFrame(p->data[i], width, height,
+                                            rowBytes, format);
+        p->frames[i]->NotifyRelease(&p->mutex, &p->released);
+        p->drawn[i]  = -1;
+    }
+
+    return 0;
+fail:
+    pattern_pool_close(p);
+    return -1;
+}
+
+/* A frame of the pool nobody else holds, brought to the frame number */
+static MappedVideoFrame *pattern_pool_get(PatternPool *p, int64_t number)
+{
+    pthread_mutex_lock(&p->mutex);
+    while (fill_me) {
+        for (int i = 0; i < p->nb_frames; i++) {
+            if (p->frames[i]->Shared())
+                continue;
+            pthread_mutex_unlock(&p->mutex);
+
+            decklink_generator_draw(p->gen, p->data[i], p->row_bytes,
+                                    p->drawn[i], number);
+            p->drawn[i] = number;
+            return p->frames[i];
+        }
+        // every frame is queued or on a card
+        pthread_cond_wait(&p->released, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+/* fill_me is already cleared */
+static void pattern_pool_abort(PatternPool *p)
+{
+    if (!p->gen)
+        return;
+
+    pthread_mutex_lock(&p->mutex);
+    pthread_cond_broadcast(&p->released);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+static void fill_pattern(IDeckLinkVideoFrame *frame, DecklinkPattern pattern)
+{
+    DecklinkGenerator *gen;
+    void *data;
+
+    gen = decklink_generator_alloc(frame->GetWidth(), frame->GetHeight(),
+                                   frame->GetPixelFormat() == bmdFormat10BitYUV,
+                                   pattern);
+    if (!gen)
+        return;
+
+    frame->GetBytes(&data);
+    decklink_generator_draw(gen, (uint8_t *)data, frame->GetRowBytes(), -1, 0);
+    decklink_generator_free(gen);
+}
+
+void FillColourBars(IDeckLinkVideoFrame *theFrame)
+{
+    fill_pattern(theFrame, DECKLINK_PATTERN_BARS);
+}
+
+void FillBlack(IDeckLinkVideoFrame *theFrame)
+{
+    fill_pattern(theFrame, DECKLINK_PATTERN_BLACK);
+}
+
+/* The phase follows the timestamp, in 1/48000 units */
+void FillSine(void *audioBuffer, unsigned long samplesToWrite,
+              unsigned long channels, unsigned long sampleDepth,
+              int64_t timestamp)
+{
+    decklink_generator_tone((uint8_t *)audioBuffer, samplesToWrite, channels,
+                            sampleDepth, timestamp);
+}
+
+enum CacheState {
+    CACHE_OFF,
+    CACHE_FILLING,
+    CACHE_READY
+};
+
+/* Loop mode: the first pass over the playlist is kept in memory as
+ * output frames and converted audio. If it fits the budget the next
+ * passes are replayed from memory and nothing is decoded anymore,
+ * otherwise it is dropped and every pass is decoded again. */
+typedef struct ClipCache {
+    int state;
+    int64_t budget;
+    int64_t used;
+    IDeckLinkVideoFrame **frames;
+    int64_t *pts;           // output timescale
+    int64_t *duration;
+    int nb_frames;
+    int allocated;
+    int64_t length;         // output timescale, one pass
+    uint8_t *audio;
+    int64_t audio_time;     // 48kHz, first cached sample
+    int64_t audio_samples;
+    int64_t audio_allocated;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ClipCache;
+
+ClipCache clip_cache;
+
+static void clip_cache_init(ClipCache *c, int64_t budget, int enabled)
+{
+    memset(c, 0, sizeof(ClipCache));
+    c->budget = budget;
+    c->state  = enabled && budget > 0 ? CACHE_FILLING : CACHE_OFF;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+}
+
+static void clip_cache_release(ClipCache *c)
+{
+    for (int i = 0; i < c->nb_frames; i++)
+        c->frames[i]->Release();
+    av_freep(&c->frames);
+    av_freep(&c->pts);
+    av_freep(&c->duration);
+    av_freep(&c->audio);
+    c->nb_frames     = 0;
+    c->allocated     = 0;
+    c->audio_samples = 0;
+    c->used          = 0;
+}
+
+/* Called with the mutex held */
+static void clip_cache_drop(ClipCache *c)
+{
+    fprintf(stderr, "The clip does not fit in %d MB, decoding every loop\n",
+            (int)(c->budget >> 20));
+    clip_cache_release(c);
+    c->state = CACHE_OFF;
+    pthread_cond_broadcast(&c->cond);
+}
+
+/* Keeps a reference to the frame, fails once the budget is exceeded */
+static int clip_cache_add_frame(ClipCache *c, IDeckLinkVideoFrame *frame,
+                                int64_t pts, int64_t duration, int size)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    if (c->state != CACHE_FILLING) {
+        ret = -1;
+    } else if (c->used + size > c->budget) {
+        clip_cache_drop(c);
+        ret = -1;
+    } else if (c->nb_frames == c->allocated) {
+        int allocated = FFMAX(2 * c->allocated, 64);
+        IDeckLinkVideoFrame **frames;
+        int64_t *p, *d;
+
+        frames = (IDeckLinkVideoFrame **)av_realloc(c->frames,
+                                                    allocated * sizeof(*frames));
+        if (frames)
+            c->frames = frames;
+        p = (int64_t *)av_realloc(c->pts, allocated * sizeof(*p));
+        if (p)
+            c->pts = p;
+        d = (int64_t *)av_realloc(c->duration, allocated * sizeof(*d));
+        if (d)
+            c->duration = d;
+
+        if (!frames || !p || !d) {
+            clip_cache_drop(c);
+            ret = -1;
+        } else {
+            c->allocated = allocated;
+        }
+    }
+
+    if (!ret) {
+        frame->AddRef();
+        c->frames[c->nb_frames]   = frame;
+        c->pts[c->nb_frames]      = pts;
+        c->duration[c->nb_frames] = duration;
+        c->nb_frames++;
+        c->used  += size;
+        c->length = pts + duration;
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+    return ret;
+}
+
+static int clip_cache_add_audio(ClipCache *c, const uint8_t *data,
+                                int nb_samples, int64_t time, int sample_size)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    if (c->state == CACHE_OFF) {
+        ret = -1;
+    } else if (c->state == CACHE_FILLING &&
+               c->used + nb_samples * sample_size > c->budget) {
+        clip_cache_drop(c);
+        ret = -1;
+    } else {
+        if (c->audio_samples + nb_samples > c->audio_allocated) {
+            int64_t allocated = FFMAX(2 * c->audio_allocated,
+                                      c->audio_samples + nb_samples);
+            uint8_t *audio    = (uint8_t *)av_realloc(c->audio,
+                                                      allocated * sample_size);
+            if (!audio) {
+                pthread_mutex_unlock(&c->mutex);
+                return -1;
+            }
+            c->audio           = audio;
+            c->audio_allocated = allocated;
+        }
+
+        if (!c->audio_samples)
+            c->audio_time = time;
+
+        memcpy(c->audio + c->audio_samples * sample_size, data,
+               nb_samples * sample_size);
+        c->audio_samples += nb_samples;
+        c->used          += nb_samples * sample_size;
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+    return ret;
+}
+
+/* The first pass has been decoded, returns the resulting state */
+static int clip_cache_complete(ClipCache *c)
+{
+    int state;
+
+    pthread_mutex_lock(&c->mutex);
+    if (c->state == CACHE_FILLING) {
+        if (c->nb_frames) {
+            c->state = CACHE_READY;
+            fprintf(stderr, "Looping %d frames from memory (%d MB)\n",
+                    c->nb_frames, (int)(c->used >> 20));
+        } else {
+            clip_cache_release(c);
+            c->state = CACHE_OFF;
+        }
+        pthread_cond_broadcast(&c->cond);
+    }
+    state = c->state;
+    pthread_mutex_unlock(&c->mutex);
+
+    return state;
+}
+
+static int clip_cache_state(ClipCache *c)
+{
+    int state;
+
+    pthread_mutex_lock(&c->mutex);
+    state = c->state;
+    pthread_mutex_unlock(&c->mutex);
+
+    return state;
+}
+
+static int clip_cache_wait(ClipCache *c)
+{
+    int state;
+
+    pthread_mutex_lock(&c->mutex);
+    while (c->state == CACHE_FILLING && fill_me)
+        pthread_cond_wait(&c->cond, &c->mutex);
+    state = c->state;
+    pthread_mutex_unlock(&c->mutex);
+
+    return state;
+}
+
+static void clip_cache_abort(ClipCache *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void clip_cache_free(ClipCache *c)
+{
+    clip_cache_release(c);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond);
+}
+
+/* Playlist entries share a single output timeline: every item starts
+ * where the previous one ended. The next item is opened in background
+ * while the current one is read and played. */
+typedef struct PlayItem {
+    char *filename;
+    AVFormatContext *ic;
+    AVStream *audio_st;
+    AVStream *video_st;
+    struct SwsContext *sws;
+    int sws_width, sws_height, sws_format; // source the scaler is set for
+    int crop_x, crop_y, crop_w, crop_h;    // source area shown
+    int dst_x, dst_y, dst_w, dst_h;        // where it lands on the output
+    int64_t first_pts;      // AV_TIME_BASE, subtracted from every packet
+    int64_t in;             // AV_TIME_BASE, where it starts past first_pts
+    int64_t start;          // AV_TIME_BASE, position on the output timeline
+    int64_t duration;       // AV_TIME_BASE, as far as the packets read tell
+    int ready;              // 1 once opened, -1 if it cannot be played
+} PlayItem;
+
+PlayItem *playlist;
+int nb_items;
+
+static int playlist_add(const char *filename)
+{
+    PlayItem *items = (PlayItem *)av_realloc(playlist,
+                                             (nb_items + 1) * sizeof(*items));
+    if (!items)
+        return -1;
+
+    playlist = items;
+    memset(&playlist[nb_items], 0, sizeof(*playlist));
+    playlist[nb_items].filename  = strdup(filename);
+    playlist[nb_items].first_pts = AV_NOPTS_VALUE;
+    nb_items++;
+
+    return 0;
+}
+
+/* One file per line, empty lines and lines starting with # are skipped */
+static int playlist_load(const char *listfile)
+{
+    FILE *f = fopen(listfile, "r");
+    char line[1024];
+
+    if (!f) {
+        fprintf(stderr, "Cannot open the playlist %s\n", listfile);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0] || line[0] == '#')
+            continue;
+        if (playlist_add(line) < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int open_item(PlayItem *item)
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    item->ready = -1;
+
+    if (live)
+        live_source_options(&opts);
+
+    ret = avformat_open_input(&item->ic, item->filename, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot open %s\n", item->filename);
+        item->ic = NULL;
+        return -1;
+    }
+
+    avformat_find_stream_info(item->ic, NULL);
+
+    for (int i = 0; i < item->ic->nb_streams; i++) {
+        AVStream *st          = item->ic->streams[i];
+        AVCodecContext *avctx = st->codec;
         AVCodec *codec        = avcodec_find_decoder(avctx->codec_id);
-        if (!codec || avcodec_open2(avctx, codec, NULL) < 0)
+
+        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO && raw_playout) {
+            // the frames come from the mapping, skip them while demuxing
+            st->discard = AVDISCARD_ALL;
+            if (avctx->codec_id == AV_CODEC_ID_V210)
+                pix = bmdFormat10BitYUV;
+            else if (avctx->codec_id == AV_CODEC_ID_RAWVIDEO &&
+                     avctx->pix_fmt == PIX_FMT_UYVY422)
+                pix = bmdFormat8BitYUV;
+            else {
+                fprintf(stderr,
+                        "Raw playout needs UYVY or v210 video\n");
+                return -1;
+            }
+            if (!raw_index.offsets &&
+                strcmp(item->ic->iformat->name, "rawvideo")) {
+                fprintf(stderr, "Cannot index the frames in %s\n",
+                        item->filename);
+                return -1;
+            }
+            item->video_st = st;
+            continue;
+        }
+
+        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+            avctx->thread_count = threads;
+            avctx->thread_type  = thread_type;
+        }
+        if (avctx->codec_type != AVMEDIA_TYPE_AUDIO &&
+            avctx->codec_type != AVMEDIA_TYPE_VIDEO)
+            continue;
+        if (!codec || avcodec_open2(avctx, codec, NULL) < 0) {
             fprintf(
                 stderr, "cannot find codecs for %s\n",
                 (avctx->codec_type ==
                  AVMEDIA_TYPE_AUDIO) ? "Audio" : "Video");
-        if (avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-            audio_st = st;
+            continue;
         }
-        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-            video_st = st;
+        if (avctx->codec_type == AVMEDIA_TYPE_AUDIO && !item->audio_st) {
+            item->audio_st = st;
+        }
+        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO && !item->video_st) {
+            item->video_st = st;
+        }
+    }
+
+    av_dump_format(item->ic, 0, item->filename, 0);
+
+    // the first item sets the audio output, the next ones have to fit it
+    if (item->audio_st && audio_channels >= 0) {
+        AVCodecContext *avctx = item->audio_st->codec;
+
+        if (avctx->sample_rate != 48000 || avctx->channels > audio_channels) {
+            fprintf(stderr, "%s: %d Hz %d channels audio does not fit the "
+                    "output (48000 Hz %d channels), playing it silent\n",
+                    item->filename, avctx->sample_rate, avctx->channels,
+                    audio_channels);
+            avcodec_close(avctx);
+            item->audio_st = NULL;
+        }
+    }
+
+    if (!raw_playout) {
+        if (!item->video_st) {
+            fprintf(stderr, "No video stream in %s\n", item->filename);
+            return -1;
+        }
+    }
+
+    item->ready = 1;
+    return 0;
+}
+
+/* Advance the plane pointers to the pixel x, y */
+static void offset_picture(uint8_t *data[4], const int linesize[4],
+                           enum PixelFormat fmt, int x, int y)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    // data[1] holds the palette of the paletted formats, not pixels
+    int planes = desc->flags & (PIX_FMT_PAL | PIX_FMT_PSEUDOPAL) ? 1 : 4;
+    int steps[4];
+
+    av_image_fill_max_pixsteps(steps, NULL, desc);
+
+    for (int i = 0; i < planes && data[i]; i++) {
+        // packed yuv steps cover a pair of pixels, like the chroma planes
+        int chroma = i == 1 || i == 2 || !data[1];
+        int sx     = chroma ? desc->log2_chroma_w : 0;
+        int sy     = chroma && data[1] ? desc->log2_chroma_h : 0;
+
+        data[i] += (y >> sy) * linesize[i] + (x >> sx) * steps[i];
+    }
+}
+
+/* The output formats are UYVY and 10 bit planar 4:2:2, packed to v210
+ * once converted */
+static void fill_black(AVPicture *pic, enum PixelFormat fmt,
+                       int x, int y, int w, int h)
+{
+    for (int j = y; j < y + h; j++) {
+        if (fmt == PIX_FMT_UYVY422) {
+            uint8_t *p = pic->data[0] + j * pic->linesize[0] + x * 2;
+
+            for (int i = 0; i < w / 2; i++, p += 4) {
+                p[0] = p[2] = 0x80;
+                p[1] = p[3] = 0x10;
+            }
+        } else {
+            uint16_t *l = (uint16_t *)(pic->data[0] + j * pic->linesize[0]) + x;
+            uint16_t *u = (uint16_t *)(pic->data[1] + j * pic->linesize[1]) + x / 2;
+            uint16_t *v = (uint16_t *)(pic->data[2] + j * pic->linesize[2]) + x / 2;
+
+            for (int i = 0; i < w; i++)
+                l[i] = 64;
+            for (int i = 0; i < w / 2; i++)
+                u[i] = v[i] = 512;
         }
     }
+}
+
+/* v210 packs 6 pixels in 4 little endian words of 3 samples each:
+ * u0 y0 v0, y1 u1 y2, v1 y3 u2, y4 v2 y5. x0 and x1 are multiples of 6. */
+static void v210_pack_row(uint8_t *dst, const uint16_t *y, const uint16_t *u,
+                          const uint16_t *v, int x0, int x1)
+{
+    for (int i = x0; i < x1; i += 6) {
+        uint8_t *p = dst + i / 6 * 16;
+        int c      = i / 2;
+
+        AV_WL32(p,      u[c]     | y[i]     << 10 | v[c]     << 20);
+        AV_WL32(p + 4,  y[i + 1] | u[c + 1] << 10 | y[i + 2] << 20);
+        AV_WL32(p + 8,  v[c + 1] | y[i + 3] << 10 | u[c + 2] << 20);
+        AV_WL32(p + 12, y[i + 4] | v[c + 2] << 10 | y[i + 5] << 20);
+    }
+}
+
+static void v210_unpack_row(const uint8_t *src, uint16_t *y, uint16_t *u,
+                            uint16_t *v, int x0, int x1)
+{
+    for (int i = x0; i < x1; i += 6) {
+        const uint8_t *p = src + i / 6 * 16;
+        uint32_t w[4]    = { AV_RL32(p), AV_RL32(p + 4),
+                             AV_RL32(p + 8), AV_RL32(p + 12) };
+        int c            = i / 2;
+
+        u[c]     = w[0] & 0x3ff;
+        y[i]     = w[0] >> 10 & 0x3ff;
+        v[c]     = w[0] >> 20 & 0x3ff;
+        y[i + 1] = w[1] & 0x3ff;
+        u[c + 1] = w[1] >> 10 & 0x3ff;
+        y[i + 2] = w[1] >> 20 & 0x3ff;
+        v[c + 1] = w[2] & 0x3ff;
+        y[i + 3] = w[2] >> 10 & 0x3ff;
+        u[c + 2] = w[2] >> 20 & 0x3ff;
+        y[i + 4] = w[3] & 0x3ff;
+        v[c + 2] = w[3] >> 10 & 0x3ff;
+        y[i + 5] = w[3] >> 20 & 0x3ff;
+    }
+}
+
+/* The planar picture needs FFALIGN(width, 6) columns */
+static void v210_pack(const AVPicture *pic, uint8_t *dst, int linesize,
+                      int width, int height)
+{
+    for (int j = 0; j < height; j++)
+        v210_pack_row(dst + j * linesize,
+                      (const uint16_t *)(pic->data[0] + j * pic->linesize[0]),
+                      (const uint16_t *)(pic->data[1] + j * pic->linesize[1]),
+                      (const uint16_t *)(pic->data[2] + j * pic->linesize[2]),
+                      0, FFALIGN(width, 6));
+}
+
+/* Work out the source area and the output area for the frame according
+ * to fit_mode and (re)create the scaler if the frame changed. */
+static int setup_scaler(PlayItem *item, AVFrame *frame,
+                        int width, int height)
+{
+    const AVPixFmtDescriptor *desc;
+    AVRational sar = frame->sample_aspect_ratio;
+    double src_aspect, out_par, scale;
+    int mask_w, mask_h;
+
+    if (item->sws && item->sws_width == frame->width &&
+        item->sws_height == frame->height &&
+        item->sws_format == frame->format)
+        return 0;
+
+    if (!sar.num || !sar.den)
+        sar = item->video_st->codec->sample_aspect_ratio;
+    if (!sar.num || !sar.den)
+        sar.num = sar.den = 1;
+
+    // SD modes are 4:3, every other one has square pixels
+    out_par    = width == 720 ? 4.0 / 3 * height / width : 1.0;
+    src_aspect = av_q2d(sar) / out_par;
+
+    desc   = av_pix_fmt_desc_get((enum PixelFormat)frame->format);
+    mask_w = ~((1 << desc->log2_chroma_w) - 1);
+    mask_h = ~((1 << desc->log2_chroma_h) - 1);
+
+    item->crop_x = item->crop_y = 0;
+    item->crop_w = frame->width;
+    item->crop_h = frame->height;
+    item->dst_x  = item->dst_y = 0;
+    item->dst_w  = width;
+    item->dst_h  = height;
+
+    // the source size in output pixels is frame->width * src_aspect
+    switch (fit_mode) {
+    case FIT_LETTERBOX:
+        scale = FFMIN(width / (frame->width * src_aspect),
+                      (double)height / frame->height);
+        item->dst_w = FFMIN((int)(frame->width * src_aspect * scale + 0.5) & ~1,
+                            width);
+        item->dst_h = FFMIN((int)(frame->height * scale + 0.5) & ~1, height);
+        item->dst_x = ((width - item->dst_w) / 2) & ~1;
+        item->dst_y = ((height - item->dst_h) / 2) & ~1;
+        break;
+    case FIT_CROP:
+        scale = FFMAX(width / (frame->width * src_aspect),
+                      (double)height / frame->height);
+        item->crop_w = FFMIN((int)(width / (src_aspect * scale) + 0.5),
+                             frame->width) & mask_w;
+        item->crop_h = FFMIN((int)(height / scale + 0.5),
+                             frame->height) & mask_h;
+        item->crop_x = ((frame->width - item->crop_w) / 2) & mask_w;
+        item->crop_y = ((frame->height - item->crop_h) / 2) & mask_h;
+        break;
+    }
+
+    item->sws = sws_getCachedContext(item->sws,
+                                     item->crop_w, item->crop_h,
+                                     (enum PixelFormat)frame->format,
+                                     item->dst_w, item->dst_h, pix_fmt,
+                                     SWS_BICUBIC, NULL, NULL, NULL);
+    if (!item->sws) {
+        fprintf(stderr, "Cannot scale %dx%d to %dx%d\n",
+                frame->width, frame->height, width, height);
+        return -1;
+    }
+
+    item->sws_width  = frame->width;
+    item->sws_height = frame->height;
+    item->sws_format = frame->format;
+
+    return 0;
+}
+
+/* Scale the frame into the output picture, painting the bars if any */
+static void scale_frame(PlayItem *item, AVFrame *frame, AVPicture *pic,
+                        int width, int height)
+{
+    uint8_t *src[4] = { frame->data[0], frame->data[1],
+                        frame->data[2], frame->data[3] };
+    uint8_t *dst[4] = { pic->data[0], pic->data[1],
+                        pic->data[2], pic->data[3] };
+
+    if (item->dst_h < height) {
+        fill_black(pic, pix_fmt, 0, 0, width, item->dst_y);
+        fill_black(pic, pix_fmt, 0, item->dst_y + item->dst_h, width,
+                   height - item->dst_y - item->dst_h);
+    }
+    if (item->dst_w < width) {
+        fill_black(pic, pix_fmt, 0, item->dst_y, item->dst_x, item->dst_h);
+        fill_black(pic, pix_fmt, item->dst_x + item->dst_w, item->dst_y,
+                   width - item->dst_x - item->dst_w, item->dst_h);
+    }
+
+    offset_picture(src, frame->linesize, (enum PixelFormat)frame->format,
+                   item->crop_x, item->crop_y);
+    offset_picture(dst, pic->linesize, pix_fmt, item->dst_x, item->dst_y);
+
+    sws_scale(item->sws, src, frame->linesize, 0, item->crop_h,
+              dst, pic->linesize);
+}
+
+/* Graphics overlay, a picture or a video with alpha blended on a copy
+ * of every output frame as it gets its slot, so the cached and repeated
+ * frames stay clean and the overlay runs on the output clock. Each
+ * overlay frame is converted once to a layer in the output
+ * colorspace, premultiplied by its alpha, and the rows remember the
+ * span actually covered so the blend skips the transparent areas.
+ * Live, the slots are taken by the output callback: a thread of its own
+ * keeps the next layers ready, the decoder thread makes the copies and
+ * the callback only blends, showing a repeated frame as it went out. */
+#define OVERLAY_LAYERS 3
+
+typedef struct OverlayLayer {
+    int16_t *y, *u, *v;     // premultiplied, 10 bit range
+    uint8_t *a, *ac;        // alpha for the luma and the chroma samples
+    int *span_start;        // per row, the columns with any alpha
+    int *span_end;
+    int64_t start;          // AV_TIME_BASE, when it is due
+} OverlayLayer;
+
+typedef struct Overlay {
+    AVFormatContext *ic;
+    AVStream *st;
+    AVFrame *frame;
+    struct SwsContext *sws;
+    uint8_t *bgra;
+    int bgra_linesize;
+    int width, height;
+    OverlayLayer layers[OVERLAY_LAYERS];
+    uint16_t *row;          // a v210 row unpacked for the blend
+    int64_t next;           // AV_TIME_BASE, when the next frame is due
+    int64_t base;           // AV_TIME_BASE, start of the current pass
+    int64_t first_pts;
+    int frames;             // frames decoded in the current pass
+    int still;              // a picture or a video that stopped decoding
+
+    // live, the layers ready from rindex on, in presentation order
+    pthread_t thread;
+    int running;
+    int rindex, nb_ready;
+    int64_t clock;          // AV_TIME_BASE, the last slot blended
+    int abort_request;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // signalled as the layers are used up
+} Overlay;
+
+const char *overlay_file = NULL;
+Overlay overlay;
+
+static void overlay_close(Overlay *o)
+{
+    if (o->running) {
+        pthread_mutex_lock(&o->mutex);
+        o->abort_request = 1;
+        pthread_cond_signal(&o->cond);
+        pthread_mutex_unlock(&o->mutex);
+        pthread_join(o->thread, NULL);
+        pthread_mutex_destroy(&o->mutex);
+        pthread_cond_destroy(&o->cond);
+        o->running = 0;
+    }
+    if (o->st)
+        avcodec_close(o->st->codec);
+    if (o->ic)
+        avformat_close_input(&o->ic);
+    if (o->sws)
+        sws_freeContext(o->sws);
+    av_freep(&o->frame);
+    av_freep(&o->bgra);
+    for (int i = 0; i < OVERLAY_LAYERS; i++) {
+        OverlayLayer *l = &o->layers[i];
+
+        av_freep(&l->y);
+        av_freep(&l->u);
+        av_freep(&l->v);
+        av_freep(&l->a);
+        av_freep(&l->ac);
+        av_freep(&l->span_start);
+        av_freep(&l->span_end);
+    }
+    av_freep(&o->row);
+}
+
+static int overlay_layer_alloc(OverlayLayer *l, int width, int height)
+{
+    l->y          = (int16_t *)av_malloc(width * height * sizeof(*l->y));
+    l->u          = (int16_t *)av_malloc(width / 2 * height * sizeof(*l->u));
+    l->v          = (int16_t *)av_malloc(width / 2 * height * sizeof(*l->v));
+    l->a          = (uint8_t *)av_malloc(width * height);
+    l->ac         = (uint8_t *)av_malloc(width / 2 * height);
+    l->span_start = (int *)av_mallocz(height * sizeof(*l->span_start));
+    l->span_end   = (int *)av_mallocz(height * sizeof(*l->span_end));
+
+    return l->y && l->u && l->v && l->a && l->ac &&
+           l->span_start && l->span_end ? 0 : -1;
+}
+
+static int overlay_open(Overlay *o, const char *filename, int width, int height,
+                        int nb_layers)
+{
+    AVCodec *codec;
+    int idx;
+
+    memset(o, 0, sizeof(*o));
+    o->width     = width;
+    o->height    = height;
+    o->first_pts = AV_NOPTS_VALUE;
+
+    if (avformat_open_input(&o->ic, filename, NULL, NULL) < 0) {
+        fprintf(stderr, "Cannot open the overlay %s\n", filename);
+        o->ic = NULL;
+        return -1;
+    }
+    avformat_find_stream_info(o->ic, NULL);
+
+    idx = av_find_best_stream(o->ic, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (idx < 0 || avcodec_open2(o->ic->streams[idx]->codec, codec, NULL) < 0) {
+        fprintf(stderr, "Cannot decode the overlay %s\n", filename);
+        goto fail;
+    }
+    o->st = o->ic->streams[idx];
+
+    o->bgra_linesize = width * 4;
+    o->frame      = avcodec_alloc_frame();
+    o->bgra       = (uint8_t *)av_malloc(o->bgra_linesize * height);
+    o->row        = (uint16_t *)av_malloc(FFALIGN(width, 6) * 2 *
+                                          sizeof(*o->row));
+    if (!o->frame || !o->bgra || !o->row)
+        goto fail;
+    for (int i = 0; i < nb_layers; i++)
+        if (overlay_layer_alloc(&o->layers[i], width, height) < 0)
+            goto fail;
+
+    return 0;
+fail:
+    overlay_close(o);
+    return -1;
+}
+
+/* 1 if a frame was decoded, 0 at the end of the stream */
+static int overlay_decode(Overlay *o)
+{
+    AVPacket pkt;
+    int got = 0;
+
+    while (!got) {
+        if (av_read_frame(o->ic, &pkt) < 0) {
+            // the delayed frames
+            av_init_packet(&pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+            avcodec_decode_video2(o->st->codec, o->frame, &got, &pkt);
+            return got;
+        }
+        if (pkt.stream_index == o->st->index)
+            avcodec_decode_video2(o->st->codec, o->frame, &got, &pkt);
+        av_free_packet(&pkt);
+    }
+
+    return 1;
+}
+
+/* Convert the decoded frame to premultiplied output samples */
+static int overlay_prepare(Overlay *o, OverlayLayer *l)
+{
+    // BT.601 for SD, BT.709 otherwise, limited range, scaled by 4/255
+    static const float k601[9] = {  65.481, 128.553,  24.966,
+                                   -37.797, -74.203, 112.000,
+                                   112.000, -93.786, -18.214 };
+    static const float k709[9] = {  46.559, 156.629,  15.812,
+                                   -25.664, -86.336, 112.000,
+                                   112.000, -101.730, -10.270 };
+    const float *k = o->width > 720 ? k709 : k601;
+    uint8_t *dst[4] = { o->bgra, NULL, NULL, NULL };
+    int linesize[4] = { o->bgra_linesize, 0, 0, 0 };
+
+    o->sws = sws_getCachedContext(o->sws, o->frame->width, o->frame->height,
+                                  (enum PixelFormat)o->frame->format,
+                                  o->width, o->height, PIX_FMT_BGRA,
+                                  SWS_BICUBIC, NULL, NULL, NULL);
+    if (!o->sws)
+        return -1;
+
+    sws_scale(o->sws, o->frame->data, o->frame->linesize, 0,
+              o->frame->height, dst, linesize);
+
+    for (int j = 0; j < o->height; j++) {
+        const uint8_t *p = o->bgra + j * o->bgra_linesize;
+        int start = o->width, end = 0;
+
+        for (int i = 0; i < o->width; i++, p += 4) {
+            float a = p[3] / 255.0;
+            float r = p[2] * a, g = p[1] * a, b = p[0] * a;
+            int idx = j * o->width + i;
+
+            l->a[idx] = p[3];
+            l->y[idx] = lrintf((k[0] * r + k[1] * g + k[2] * b) * 4 / 255 +
+                               64 * a);
+            if (p[3]) {
+                start = FFMIN(start, i);
+                end   = i + 1;
+            }
+
+            if (i & 1) {
+                int c   = j * (o->width / 2) + i / 2;
+                float ca = (p[3] + p[-1]) / 510.0;
+                // average the pair, both already premultiplied
+                float pr = (r + p[-2] * p[-1] / 255.0) / 2;
+                float pg = (g + p[-3] * p[-1] / 255.0) / 2;
+                float pb = (b + p[-4] * p[-1] / 255.0) / 2;
+
+                l->ac[c] = (p[3] + p[-1] + 1) / 2;
+                l->u[c]  = lrintf((k[3] * pr + k[4] * pg + k[5] * pb) * 4 / 255 +
+                                  512 * ca);
+                l->v[c]  = lrintf((k[6] * pr + k[7] * pg + k[8] * pb) * 4 / 255 +
+                                  512 * ca);
+            }
+        }
+
+        // whole pixel pairs, the chroma is shared
+        l->span_start[j] = start & ~1;
+        l->span_end[j]   = FFMIN((end + 1) & ~1, o->width & ~1);
+    }
+
+    return 0;
+}
+
+/* Decode the next frame, looping videos, 0 once the overlay stays put.
+ * start is set to when the frame is due. */
+static int overlay_step(Overlay *o, int64_t *start)
+{
+    AVRational rate = o->st->avg_frame_rate;
+    int64_t pts, duration;
+
+    while (!overlay_decode(o)) {
+        if (o->frames <= 1) {
+            o->still = 1;
+            return 0;
+        }
+        av_seek_frame(o->ic, o->st->index,
+                      o->first_pts == AV_NOPTS_VALUE ? 0 : o->first_pts,
+                      AVSEEK_FLAG_BACKWARD);
+        avcodec_flush_buffers(o->st->codec);
+        o->base   = o->next;
+        o->frames = 0;
+    }
+
+    pts = o->frame->pkt_pts;
+    if (pts == AV_NOPTS_VALUE)
+        pts = o->frames;
+    if (o->first_pts == AV_NOPTS_VALUE)
+        o->first_pts = pts;
+
+    duration = rate.num && rate.den ?
+               av_rescale(AV_TIME_BASE, rate.den, rate.num) :
+               AV_TIME_BASE / 25;
+    *start  = o->next;
+    o->next = o->base + duration +
+              av_rescale_q(pts - o->first_pts, o->st->time_base,
+                           time_base_q);
+    o->frames++;
+
+    return 1;
+}
+
+/* Decode the overlay up to time in the first layer, picture stay put */
+static int overlay_update(Overlay *o, int64_t time)
+{
+    int64_t start;
+    int updated = 0;
+
+    while (!o->still && time >= o->next && overlay_step(o, &start))
+        updated = 1;
+
+    if (updated)
+        return overlay_prepare(o, &o->layers[0]);
+
+    return 0;
+}
+
+/* Live, decode and prepare the layers ahead of the output, as many as
+ * there is room for. */
+static void *overlay_thread(void *priv)
+{
+    Overlay *o = (Overlay *)priv;
+
+    pthread_mutex_lock(&o->mutex);
+    while (!o->abort_request) {
+        OverlayLayer *l;
+        int64_t start;
+        int ret;
+
+        if (o->still || o->nb_ready == OVERLAY_LAYERS) {
+            pthread_cond_wait(&o->cond, &o->mutex);
+            continue;
+        }
+        l = &o->layers[(o->rindex + o->nb_ready) % OVERLAY_LAYERS];
+        pthread_mutex_unlock(&o->mutex);
+
+        ret = overlay_step(o, &start);
+        // a frame the output already went past is only decoded
+        while (ret > 0 &&
+               o->next <= __atomic_load_n(&o->clock, __ATOMIC_RELAXED))
+            ret = overlay_step(o, &start);
+        if (ret > 0) {
+            l->start = start;
+            if (overlay_prepare(o, l) < 0) {
+                decklink_log(DECKLINK_LOG_ERROR, "Cannot convert the overlay");
+                o->still = 1;
+                ret      = 0;
+            }
+        }
+
+        pthread_mutex_lock(&o->mutex);
+        if (ret > 0)
+            o->nb_ready++;
+    }
+    pthread_mutex_unlock(&o->mutex);
+
+    return NULL;
+}
+
+/* The first layer is ready before the thread starts, for the preroll */
+static int overlay_start(Overlay *o)
+{
+    int64_t start;
+
+    if (overlay_step(o, &start) > 0) {
+        if (overlay_prepare(o, &o->layers[0]) < 0)
+            return -1;
+        o->layers[0].start = start;
+        o->nb_ready        = 1;
+    }
+
+    pthread_mutex_init(&o->mutex, NULL);
+    pthread_cond_init(&o->cond, NULL);
+    if (pthread_create(&o->thread, NULL, overlay_thread, o)) {
+        pthread_mutex_destroy(&o->mutex);
+        pthread_cond_destroy(&o->cond);
+        return -1;
+    }
+    o->running = 1;
+
+    return 0;
+}
+
+/* Live, the layer due at time, NULL if none is. Called from the output
+ * callback, the layers a later one replaced go back to the thread. */
+static const OverlayLayer *overlay_layer(Overlay *o, int64_t time)
+{
+    const OverlayLayer *l = NULL;
+    int used = 0;
+
+    __atomic_store_n(&o->clock, time, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&o->mutex);
+    while (o->nb_ready > 1 &&
+           o->layers[(o->rindex + 1) % OVERLAY_LAYERS].start <= time) {
+        o->rindex = (o->rindex + 1) % OVERLAY_LAYERS;
+        o->nb_ready--;
+        used = 1;
+    }
+    if (o->nb_ready && o->layers[o->rindex].start <= time)
+        l = &o->layers[o->rindex];
+    if (used)
+        pthread_cond_signal(&o->cond);
+    pthread_mutex_unlock(&o->mutex);
+
+    return l;
+}
+
+static inline int div255(int v)
+{
+    return (v + 128 + ((v + 128) >> 8)) >> 8;
+}
+
+/* out = overlay + out * (1 - alpha), only over the covered spans.
+ * The loops are kept simple for the compiler to vectorize them. */
+static void overlay_blend_planar(const Overlay *o, const OverlayLayer *ol,
+                                 int j, int x0, int x1,
+                                 uint16_t *l, uint16_t *u, uint16_t *v)
+{
+    const int16_t *oy = ol->y + j * o->width;
+    const int16_t *ou = ol->u + j * (o->width / 2);
+    const int16_t *ov = ol->v + j * (o->width / 2);
+    const uint8_t *a  = ol->a + j * o->width;
+    const uint8_t *ac = ol->ac + j * (o->width / 2);
+
+    for (int i = x0; i < x1; i++)
+        l[i] = oy[i] + div255(l[i] * (255 - a[i]));
+    for (int i = x0 / 2; i < x1 / 2; i++) {
+        u[i] = ou[i] + div255(u[i] * (255 - ac[i]));
+        v[i] = ov[i] + div255(v[i] * (255 - ac[i]));
+    }
+}
+
+/* Blend on a frame in the output format, UYVY or v210 */
+static void overlay_blend(Overlay *o, const OverlayLayer *ol, uint8_t *data,
+                          int linesize, BMDPixelFormat format)
+{
+    int aligned = FFALIGN(o->width, 6);
+    uint16_t *l = o->row;
+    uint16_t *u = o->row + aligned;
+    uint16_t *v = o->row + aligned + aligned / 2;
+
+    for (int j = 0; j < o->height; j++) {
+        int x0 = ol->span_start[j], x1 = ol->span_end[j];
+        const int16_t *oy = ol->y + j * o->width;
+        const int16_t *ou = ol->u + j * (o->width / 2);
+        const int16_t *ov = ol->v + j * (o->width / 2);
+        const uint8_t *a  = ol->a + j * o->width;
+        const uint8_t *ac = ol->ac + j * (o->width / 2);
+        uint8_t *p        = data + j * linesize;
+
+        if (x0 >= x1)
+            continue;
+
+        if (format == bmdFormat8BitYUV) {
+            for (int i = x0; i < x1; i += 2) {
+                int c = i / 2;
+
+                p[2 * i]     = (ou[c] >> 2) + div255(p[2 * i] * (255 - ac[c]));
+                p[2 * i + 1] = (oy[i] >> 2) +
+                               div255(p[2 * i + 1] * (255 - a[i]));
+                p[2 * i + 2] = (ov[c] >> 2) +
+                               div255(p[2 * i + 2] * (255 - ac[c]));
+                p[2 * i + 3] = (oy[i + 1] >> 2) +
+                               div255(p[2 * i + 3] * (255 - a[i + 1]));
+            }
+        } else {
+            // whole v210 groups, the samples past the span go back as they were
+            int g0 = x0 / 6 * 6, g1 = FFALIGN(x1, 6);
+
+            v210_unpack_row(p, l, u, v, g0, g1);
+            overlay_blend_planar(o, ol, j, x0, x1, l, u, v);
+            v210_pack_row(p, l, u, v, g0, g1);
+        }
+    }
+}
+
+/* Frames since 00:00:00:00, a ; before the frames marks drop frame */
+static int64_t timecode_frames(const char *tc, AVRational rate)
+{
+    int fps = (rate.num + rate.den - 1) / rate.den;
+    int h, m, s, f, minutes;
+    int64_t frames;
+    char sep;
+
+    if (sscanf(tc, "%d:%d:%d%c%d", &h, &m, &s, &sep, &f) != 5)
+        return -1;
+
+    minutes = h * 60 + m;
+    frames  = ((int64_t)minutes * 60 + s) * fps + f;
+    // 2 frame numbers skipped every minute but the tenth at 29.97, 4 at
+    // 59.94, no other rate has drop frame timecodes
+    if (sep == ';' || sep == '.') {
+        AVRational ntsc = { 30000, 1001 }, ntsc_p = { 60000, 1001 };
+
+        if (av_cmp_q(rate, ntsc) && av_cmp_q(rate, ntsc_p))
+            return -1;
+        frames -= fps / 15 * (minutes - minutes / 10);
+    }
+
+    return frames;
+}
+
+/* Start the item at a frame number or at a timecode, counted from the
+ * timecode of its first frame if it carries one. */
+static int cue_item(PlayItem *item, const char *cue)
+{
+    AVRational rate = item->video_st->avg_frame_rate;
+    AVDictionaryEntry *tc;
+    int64_t frame;
+
+    if (!rate.num || !rate.den) {
+        fprintf(stderr, "Unknown frame rate, cannot cue %s\n", item->filename);
+        return -1;
+    }
+
+    if (strchr(cue, ':')) {
+        frame = timecode_frames(cue, rate);
+        tc    = av_dict_get(item->video_st->metadata, "timecode", NULL, 0);
+        if (!tc)
+            tc = av_dict_get(item->ic->metadata, "timecode", NULL, 0);
+        if (frame >= 0 && tc) {
+            int64_t origin = timecode_frames(tc->value, rate);
+
+            frame = origin < 0 ? -1 : frame - origin;
+        }
+    } else {
+        frame = strtoll(cue, NULL, 10);
+    }
+
+    if (frame < 0) {
+        fprintf(stderr, "Invalid cue point %s\n", cue);
+        return -1;
+    }
+
+    // the seek needs the origin before any packet is read
+    item->first_pts = item->ic->start_time != AV_NOPTS_VALUE ?
+                      item->ic->start_time : 0;
+    item->in        = av_rescale(frame, (int64_t)AV_TIME_BASE * rate.den,
+                                 rate.num);
+
+    return 0;
+}
+
+static void *open_item_thread(void *priv)
+{
+    open_item((PlayItem *)priv);
+    return NULL;
+}
+
+static void close_item(PlayItem *item)
+{
+    if (item->sws)
+        sws_freeContext(item->sws);
+    if (item->ic) {
+        for (int i = 0; i < item->ic->nb_streams; i++)
+            avcodec_close(item->ic->streams[i]->codec);
+        avformat_close_input(&item->ic);
+    }
+    free(item->filename);
+}
+
+/* The next playable item having the stream type, *idx is the cursor. */
+static PlayItem *playlist_next(int *idx, enum AVMediaType type)
+{
+    for (int i = 0; i < nb_items; i++) {
+        PlayItem *item;
+
+        if (*idx == nb_items) {
+            if (!loop)
+                break;
+            *idx = 0;
+        }
+        item = &playlist[(*idx)++];
+        AVStream *st   = type == AVMEDIA_TYPE_VIDEO ? item->video_st
+                                                    : item->audio_st;
+        if (item->ready > 0 && st)
+            return item;
+    }
+    return NULL;
+}
+
+/* An empty packet tells the decoders to drain and move to the next item */
+static void queue_item_end(PlayItem *item)
+{
+    AVPacket pkt;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    if (item->video_st && !raw_playout)
+        packet_queue_put(&videoqueue, &pkt, 0);
+    if (item->audio_st)
+        packet_queue_put(&audioqueue, &pkt, 0);
+}
+
+/* In loop mode an empty packet without stream marks the end of a pass */
+static void queue_cycle_end(void)
+{
+    AVPacket pkt;
+
+    av_init_packet(&pkt);
+    pkt.data         = NULL;
+    pkt.size         = 0;
+    pkt.stream_index = -1;
+
+    if (!raw_playout)
+        packet_queue_put(&videoqueue, &pkt, 0);
+    packet_queue_put(&audioqueue, &pkt, 0);
+}
+
+static void read_item(PlayItem *item)
+{
+    AVPacket pkt;
+
+    // wait for the decoders to catch up before reading any further
+    while (fill_me && packet_queue_wait_room(&videoqueue) >= 0 &&
+           packet_queue_wait_room(&audioqueue) >= 0 &&
+           av_read_frame(item->ic, &pkt) >= 0) {
+        AVStream *st     = item->ic->streams[pkt.stream_index];
+        int64_t duration = pkt.duration;
+        PacketQueue *q;
+
+        if (st == item->video_st)
+            q = &videoqueue;
+        else if (st == item->audio_st)
+            q = &audioqueue;
+        else {
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        if (!duration && st == item->video_st && st->avg_frame_rate.num)
+            duration = av_rescale_q(1, av_inv_q(st->avg_frame_rate),
+                                    st->time_base);
+
+        if (pkt.pts != AV_NOPTS_VALUE) {
+            if (item->first_pts == AV_NOPTS_VALUE)
+                item->first_pts = av_rescale_q(pkt.pts, st->time_base,
+                                               time_base_q);
+            pkt.pts -= av_rescale_q(item->first_pts + item->in, time_base_q,
+                                    st->time_base);
+
+            // the video sets the pace, audio only items rely on audio
+            if (st == item->video_st || !item->video_st || raw_playout)
+                item->duration = FFMAX(item->duration,
+                                       av_rescale_q(pkt.pts + duration,
+                                                    st->time_base,
+                                                    time_base_q));
+
+            // place it on the output timeline
+            pkt.pts += av_rescale_q(item->start, time_base_q,
+                                    st->time_base);
+        }
+        packet_queue_put(q, &pkt,
+                         av_rescale_q(duration, st->time_base, time_base_q));
+    }
+}
+
+void *fill_queues(void *unused)
+{
+    PlayItem *prev = NULL;
+    pthread_t opener;
+    int opening = 0;
+
+    while (fill_me) {
+        for (int i = 0; i < nb_items && fill_me; i++) {
+            PlayItem *item = &playlist[i];
+
+            if (opening) {
+                pthread_join(opener, NULL);
+                opening = 0;
+            }
+
+            if (i + 1 < nb_items && !playlist[i + 1].ready &&
+                !pthread_create(&opener, NULL, open_item_thread,
+                                &playlist[i + 1]))
+                opening = 1;
+
+            if (item->ready <= 0)
+                continue;
+
+            // looping or cued, land on the keyframe before the in point
+            if (item->first_pts != AV_NOPTS_VALUE)
+                av_seek_frame(item->ic, -1, item->first_pts + item->in,
+                              AVSEEK_FLAG_BACKWARD);
+
+            // rebase the item right after the previous one
+            if (prev)
+                item->start = prev->start + prev->duration;
+            prev = item;
+
+            read_item(item);
+
+            queue_item_end(item);
+        }
+
+        if (opening) {
+            pthread_join(opener, NULL);
+            opening = 0;
+        }
+
+        if (!loop || !prev)
+            break;
+
+        queue_cycle_end();
+
+        // the decoders replay the first pass from memory
+        if (clip_cache_wait(&clip_cache) == CACHE_READY)
+            return NULL;
+    }
+
+    packet_queue_finish(&videoqueue);
+    packet_queue_finish(&audioqueue);
+
+    return NULL;
+}
+
+void sigfunc(int signum)
+{
+    pthread_cond_signal(&sleepCond);
+}
+
+void dump_trace(int signum)
+{
+    decklink_trace_request();
+}
+
+void print_output_modes(IDeckLink *deckLink)
+{
+    IDeckLinkOutput *deckLinkOutput                   = NULL;
+    IDeckLinkDisplayModeIterator *displayModeIterator = NULL;
+    IDeckLinkDisplayMode *displayMode                 = NULL;
+    HRESULT result;
+    int displayModeCount = 0;
+
+    // Query the DeckLink for its configuration interface
+    result = deckLink->QueryInterface(IID_IDeckLinkOutput,
+                                      (void **)&deckLinkOutput);
+    if (result != S_OK) {
+        fprintf(
+            stderr,
+            "Could not obtain the IDeckLinkOutput interface - result = %08x\n",
+            result);
+        goto bail;
+    }
+
+    // Obtain an IDeckLinkDisplayModeIterator to enumerate the display modes supported on output
+    result = deckLinkOutput->GetDisplayModeIterator(&displayModeIterator);
+    if (result != S_OK) {
+        fprintf(
+            stderr,
+            "Could not obtain the video output display mode iterator - result = %08x\n",
+            result);
+        goto bail;
+    }
+
+    // List all supported output display modes
+    printf("Supported video output display modes and pixel formats:\n");
+    while (displayModeIterator->Next(&displayMode) == S_OK) {
+        BMDProbeString str;
+
+        result = displayMode->GetName(&str);
+        if (result == S_OK) {
+            char modeName[64];
+            int modeWidth;
+            int modeHeight;
+            BMDTimeValue frameRateDuration;
+            BMDTimeScale frameRateScale;
+            int pixelFormatIndex = 0;                                                         // index into the gKnownPixelFormats / gKnownFormatNames arrays
+            BMDDisplayModeSupport displayModeSupport;
+            // Obtain the display mode's properties
+            modeWidth  = displayMode->GetWidth();
+            modeHeight = displayMode->GetHeight();
+            displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
+            printf("        %2d:   %-20s \t %d x %d \t %7g FPS\n",
+                   displayModeCount++, ToStr(str), modeWidth, modeHeight,
+                   (double)frameRateScale / (double)frameRateDuration);
+
+            FreeStr(str);
+        }
+        // Release the IDeckLinkDisplayMode object to prevent a leak
+        displayMode->Release();
+    }
+//	printf("\n");
+bail:
+    // Ensure that the interfaces we obtained are released to prevent a memory leak
+    if (displayModeIterator != NULL)
+        displayModeIterator->Release();
+    if (deckLinkOutput != NULL)
+        deckLinkOutput->Release();
+}
+
+int usage(int status)
+{
+    HRESULT result;
+    IDeckLinkIterator *deckLinkIterator;
+    IDeckLink *deckLink;
+    int numDevices = 0;
+
+    fprintf(stderr,
+            "Usage: bmdplay -m <mode id> [OPTIONS]\n"
+            "\n"
+            "    -m <mode id>:\n"
+            );
+
+    // Create an IDeckLinkIterator object to enumerate all DeckLink cards in the system
+    deckLinkIterator = CreateDeckLinkIteratorInstance();
+    if (deckLinkIterator == NULL) {
+        fprintf(
+            stderr,
+            "A DeckLink iterator could not be created.  The DeckLink drivers may not be installed.\n");
+        return 1;
+    }
+
+    // Enumerate all cards in this system
+    while (deckLinkIterator->Next(&deckLink) == S_OK) {
+        BMDProbeString str;
+
+        // Increment the total number of DeckLink cards found
+        numDevices++;
+        if (numDevices > 1)
+            printf("\n\n");
+
+        // *** Print the model name of the DeckLink card
+        result = deckLink->GetModelName(&str);
+        if (result == S_OK) {
+            printf("-> %s (-C %d )\n\n",
+                   ToStr(str),
+                   numDevices - 1);
+            FreeStr(str);
+        }
+
+        print_output_modes(deckLink);
+        // Release the IDeckLink instance when we've finished with it to prevent leaks
+        deckLink->Release();
+    }
+    deckLinkIterator->Release();
+
+    // If no DeckLink cards were found in the system, inform the user
+    if (numDevices == 0)
+        printf("No Blackmagic Design devices were found.\n");
+    printf("\n");
+
+    fprintf(
+        stderr,
+        "    -f <filename>        File to play, repeat it to play several in a row\n"
+        "    -l <playlist>        Text file listing the files to play, one per line\n"
+        "    -C <num>             Card number to be used\n"
+        "    -k <frame|timecode>  Cue the first file to a frame number or to hh:mm:ss:ff\n"
+        "    -W                   Once cued wait for Enter to start\n"
+        "    -I                   Live source, start on the first frame and keep the latency low\n"
+        "    -J <num>             Frames of jitter buffer for live sources (default = 2)\n"
+        "    -X <num>[:<delay>]   Play the same frames on another card, <delay> frames later\n"
+        "    -b <num>             Milliseconds of pre-buffering before playback (default = 2000 ms)\n"
+        "    -a <num>             Milliseconds of audio kept scheduled on the card (default = 250 ms)\n"
+        "    -p <pixel>           PixelFormat Depth (8 or 10 - default is 8)\n"
+        "    -t <num>             Video decoding threads (default = 0, auto)\n"
+        "    -T <type>            Video threading type: frame, slice or both (default = both)\n"
+        "    -r                   Raw playout of uncompressed UYVY/v210 files, no decoding\n"
+        "    -L                   Loop the playlist forever\n"
+        "    -M <num>             Megabytes of decoded frames kept to loop from memory (default = 512)\n"
+        "    -g <signal>          Generate bars, black, box, counter, pip or drop instead of playing files\n"
+        "    -G <file>            Graphics overlay, a picture or a video with alpha\n"
+        "    -e <file>            Record the pipeline events as a Chrome trace, SIGUSR1 dumps it\n"
+        "    -w <num>             Report the output stalling for that many frames, with the queues\n"
+        "    -Q <policy:prio>     Run the reader and decoder as fifo:<1-99> or rr:<1-99>\n"
+        "    -U <cpus>            CPUs for the reader and decoder, as 0,2-3\n"
+        "    -K                   Lock the memory, nothing is paged out\n"
+        "    -S <mode>            Scaling: fit, letterbox or crop (default = letterbox)\n"
+        "    -P <min>:<max>       Bounds of the frames kept scheduled on the card (default = 2:10)\n"
+        "    -O <output>          Output connection:\n"
+        "                         1: Composite video + analog audio\n"
+        "                         2: Components video + analog audio\n"
+        "                         3: HDMI video + audio\n"
+        "                         4: SDI video + audio\n\n");
+
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    Player generator;
+    int ch, ret;
+    int videomode  = 2;
+    int connection = 0;
+    int camera     = 0;
+
+    while ((ch = getopt(argc, argv, "?hs:f:a:l:m:n:F:C:O:b:p:t:T:rLM:P:S:X:IJ:G:g:k:We:w:Q:U:K")) != -1) {
+        switch (ch) {
+        case 'p':
+            switch (atoi(optarg)) {
+            case  8:
+                pix     = bmdFormat8BitYUV;
+                pix_fmt = PIX_FMT_UYVY422;
+                break;
+            case 10:
+                pix     = bmdFormat10BitYUV;
+                pix_fmt = PIX_FMT_YUV422P10;
+                break;
+            default:
+                fprintf(
+                    stderr,
+                    "Invalid argument: Pixel Format Depth must be either 8 bits or 10 bits\n");
+                return usage(1);
+            }
+            break;
+        case 'f':
+            if (playlist_add(optarg) < 0)
+                return 1;
+            break;
+        case 'l':
+            if (playlist_load(optarg) < 0)
+                return 1;
+            break;
+        case 'm':
+            videomode = atoi(optarg);
+            break;
+        case 'O':
+            connection = atoi(optarg);
+            break;
+        case 'C':
+            camera = atoi(optarg);
+            break;
+        case 'b':
+            buffer = atoi(optarg) * 1000;
+            break;
+        case 'a':
+            audio_waterlevel = atoi(optarg) * 48;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            raw_playout = 1;
+            break;
+        case 'L':
+            loop = 1;
+            break;
+        case 'M':
+            cache_budget = atoll(optarg) * 1024 * 1024;
+            break;
+        case 'G':
+            overlay_file = optarg;
+            break;
+        case 'k':
+            cue_point = optarg;
+            break;
+        case 'W':
+            cue_wait = 1;
+            break;
+        case 'e':
+            trace_file = optarg;
+            break;
+        case 'w':
+            watchdog = atoi(optarg);
+            break;
+        case 'Q':
+            if (decklink_sched_parse(optarg, &sched_policy,
+                                     &sched_priority) < 0) {
+                fprintf(stderr, "Invalid scheduling '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            sched_cpus = optarg;
+            break;
+        case 'K':
+            lock_memory = 1;
+            break;
+        case 'g':
+            generate      = 1;
+            output_signal = kOutputSignalPattern;
+            if (!strcmp(optarg, "pip"))
+                output_signal = kOutputSignalPip;
+            else if (!strcmp(optarg, "drop"))
+                output_signal = kOutputSignalDrop;
+            else if (!strcmp(optarg, "bars"))
+                signal_pattern = DECKLINK_PATTERN_BARS;
+            else if (!strcmp(optarg, "black"))
+                signal_pattern = DECKLINK_PATTERN_BLACK;
+            else if (!strcmp(optarg, "box"))
+                signal_pattern = DECKLINK_PATTERN_BOX;
+            else if (!strcmp(optarg, "counter"))
+                signal_pattern = DECKLINK_PATTERN_COUNTER;
+            else {
+                fprintf(stderr,
+                        "Invalid argument: Signal must be bars, black, box, counter, pip or drop\n");
+                return usage(1);
+            }
+            break;
+        case 'I':
+            live = 1;
+            break;
+        case 'J':
+            jitter_frames = atoi(optarg);
+            if (jitter_frames < 1 || jitter_frames > kFrameQueueSize / 2) {
+                fprintf(stderr,
+                        "Invalid argument: Jitter buffer must be 1 to %d frames\n",
+                        kFrameQueueSize / 2);
+                return usage(1);
+            }
+            break;
+        case 'X':
+            if (nb_mirrors == kMaxMirrors) {
+                fprintf(stderr, "At most %d additional cards\n", kMaxMirrors);
+                return usage(1);
+            }
+            mirror_delay[nb_mirrors] = 0;
+            if (sscanf(optarg, "%d:%d", &mirror_card[nb_mirrors],
+                       &mirror_delay[nb_mirrors]) < 1 ||
+                mirror_delay[nb_mirrors] < 0) {
+                fprintf(stderr,
+                        "Invalid argument: Additional cards are <num>[:<delay>]\n");
+                return usage(1);
+            }
+            nb_mirrors++;
+            break;
+        case 'S':
+            if (!strcmp(optarg, "fit"))
+                fit_mode = FIT_STRETCH;
+            else if (!strcmp(optarg, "letterbox"))
+                fit_mode = FIT_LETTERBOX;
+            else if (!strcmp(optarg, "crop"))
+                fit_mode = FIT_CROP;
+            else {
+                fprintf(stderr,
+                        "Invalid argument: Scaling must be fit, letterbox or crop\n");
+                return usage(1);
+            }
+            break;
+        case 'P':
+            if (sscanf(optarg, "%d:%d", &min_preroll, &max_preroll) != 2 ||
+                min_preroll < 1 || max_preroll < min_preroll) {
+                fprintf(stderr,
+                        "Invalid argument: Preroll bounds must be <min>:<max> frames\n");
+                return usage(1);
+            }
+            break;
+        case 'T':
+            if (!strcmp(optarg, "frame"))
+                thread_type = FF_THREAD_FRAME;
+            else if (!strcmp(optarg, "slice"))
+                thread_type = FF_THREAD_SLICE;
+            else if (!strcmp(optarg, "both"))
+                thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            else {
+                fprintf(stderr,
+                        "Invalid argument: Threading type must be frame, slice or both\n");
+                return usage(1);
+            }
+            break;
+        case '?':
+        case 'h':
+            return usage(0);
+        }
+    }
+
+    if (!nb_items && !generate)
+        return usage(1);
+
+    if (cue_point && (raw_playout || live || generate)) {
+        fprintf(stderr, "Only decoded files can be cued\n");
+        return 1;
+    }
+
+    if (generate && (nb_items || raw_playout || live)) {
+        fprintf(stderr, "The signal generator plays no files\n");
+        return 1;
+    }
+
+    if (raw_playout && nb_items > 1) {
+        fprintf(stderr, "Raw playout supports a single file\n");
+        return 1;
+    }
+
+    if (live && (raw_playout || loop)) {
+        fprintf(stderr, "Live sources cannot be played raw or looped\n");
+        return 1;
+    }
+
+    // the reader keeps twice the pre-buffering at most
+    max_queue_duration = FFMAX(2 * (int64_t)buffer, AV_TIME_BASE);
+
+    // the buffers allocated from now on are locked as they are mapped
+    if (lock_memory && (ret = decklink_sched_lock_memory()) < 0) {
+        fprintf(stderr, "Cannot lock the memory: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    av_register_all();
+    avformat_network_init();
+
+    if (raw_playout && raw_index_open(&raw_index, playlist[0].filename) < 0)
+        return 1;
+
+    if (!generate) {
+        // a headerless raw file cannot be opened, it is video only
+        if (open_item(&playlist[0]) < 0 && (!raw_playout || playlist[0].ic))
+            return 1;
+
+        audio_st = playlist[0].audio_st;
+        video_st = playlist[0].video_st;
+    }
+
+    cue_time = av_gettime();
+    if (cue_point && cue_item(&playlist[0], cue_point) < 0)
+        return 1;
+
+    clip_cache_init(&clip_cache, cache_budget, loop && !raw_playout);
+
+    signal(SIGINT, sigfunc);
+    if (trace_file) {
+        if (decklink_trace_start(trace_file, 4096) < 0) {
+            fprintf(stderr, "Could not trace to '%s'\n", trace_file);
+            return 1;
+        }
+        signal(SIGUSR1, dump_trace);
+    }
+    pthread_mutex_init(&sleepMutex, NULL);
+    pthread_cond_init(&sleepCond, NULL);
+
+    ret = generator.Init(videomode, connection, camera);
+
+    for (int i = 0; i < nb_items; i++)
+        close_item(&playlist[i]);
+    av_freep(&playlist);
+    raw_index_close(&raw_index);
+    pattern_pool_close(&pattern_pool);
+    clip_cache_free(&clip_cache);
+    if (trace_file)
+        decklink_trace_stop();
+
+    decklink_log_flush();
+    fprintf(stderr, "video %ld audio %ld", videoqueue.nb_packets,
+            audioqueue.nb_packets);
+
+    return ret;
+}
+
+Player::Player()
+{
+    m_audioSampleRate = bmdAudioSampleRate48kHz;
+    m_running         = false;
+    m_outputSignal    = kOutputSignalPattern;
+    m_barsFrame       = NULL;
+    m_blackFrame      = NULL;
+
+    m_audioBuffer             = NULL;
+    m_audioBufferSampleLength = 0;
+    m_audioBufferOffset       = 0;
+    m_audioBufferTime         = 0;
+    m_audioItem               = NULL;
+    m_audioNextItem           = 0;
+    m_audioCycleDone          = false;
+    m_videoDone               = false;
+    m_audioPrerolled          = false;
+    pthread_cond_init(&m_prerollCond, NULL);
+    m_audioReplayPos          = 0;
+    m_audioReplayPass         = 1;
+
+    m_totalFramesScheduled = 0;
+    m_lateFrames           = 0;
+    m_preroll              = 0;
+    m_nbMirrors            = 0;
+    m_liveLast             = NULL;
+    m_liveSlot             = 0;
+    m_liveOffset           = 0;
+    m_liveRepeated         = 0;
+    m_liveDropped          = 0;
+    m_cadence[0]           = NULL;
+    m_cadence[1]           = NULL;
+    m_cadenceCached        = NULL;
+    m_cadenceSlot          = 0;
+    m_cadenceEnd           = 0;
+    m_interlaced           = false;
+    m_lowerFieldFirst      = false;
+    m_framesInFlight       = 0;
+    m_framesOnTime         = 0;
+    m_leadMin              = INT_MAX;
+    m_displayedLate        = 0;
+    m_dropped              = 0;
+    m_decoding             = false;
+    m_decodeTime           = 0;
+    m_decodeTimeAvg        = 0;
+    m_decodeTimeMax        = 0;
+    m_framesDecoded        = 0;
+    m_cueSkipped           = 0;
+    m_lastDecodeWarning    = 0;
+    m_watchdog             = NULL;
+}
+
+bool Player::Init(int videomode, int connection, int camera)
+{
+    // Initialize the DeckLink API
+    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+    HRESULT result;
+    int i = 0;
+
+    if (!deckLinkIterator) {
+        fprintf(stderr,
+                "This application requires the DeckLink drivers installed.\n");
+        goto bail;
+    }
+
+    m_outputSignal = output_signal;
+
+    audio_channels = 0;
+    if (generate) {
+        // the tone is 16 bit stereo
+        m_audioChannelCount = 2;
+        m_audioSampleDepth  = 16;
+    } else if (audio_st) {
+        if (audio_st->codec->sample_rate != 48000) {
+            fprintf(stderr, "%d Hz audio not supported, please use 48000 Hz\n",
+                    audio_st->codec->sample_rate);
+            goto bail;
+        }
+
+        // The output carries 2, 8 or 16 channels, pad the rest with silence
+        if (audio_st->codec->channels <= 2)
+            m_audioChannelCount = 2;
+        else if (audio_st->codec->channels <= 8)
+            m_audioChannelCount = 8;
+        else if (audio_st->codec->channels <= 16)
+            m_audioChannelCount = 16;
+        else {
+            fprintf(stderr,
+                    "%d channels not supported, please use at most 16\n",
+                    audio_st->codec->channels);
+            goto bail;
+        }
+        audio_channels = m_audioChannelCount;
+
+        switch (audio_st->codec->sample_fmt) {
+        case AV_SAMPLE_FMT_U8:
+        case AV_SAMPLE_FMT_U8P:
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+            m_audioSampleDepth = 16;
+            break;
+        default:
+            m_audioSampleDepth = 32;
+            break;
+        }
+    }
+
+    do
+        result = deckLinkIterator->Next(&m_deckLink);
+    while (i++ < camera);
+
+    if (result != S_OK) {
+        fprintf(stderr, "No DeckLink PCI cards found\n");
+        goto bail;
+    }
+
+    // Obtain the audio/video output interface (IDeckLinkOutput)
+    if (m_deckLink->QueryInterface(IID_IDeckLinkOutput,
+                                   (void **)&m_deckLinkOutput) != S_OK)
+        goto bail;
+
+    if (!OpenMirrors())
+        goto bail;
+
+    result = m_deckLink->QueryInterface(IID_IDeckLinkConfiguration,
+                                        (void **)&deckLinkConfiguration);
+    if (result != S_OK) {
+        fprintf(
+            stderr,
+            "Could not obtain the IDeckLinkConfiguration interface - result = %08x\n",
+            result);
+        goto bail;
+    }
+    //XXX make it generic
+    switch (connection) {
+    case 1:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComposite);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
+        break;
+    case 2:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComponent);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
+        break;
+    case 3:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionHDMI);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
+        break;
+    case 4:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSDI);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
+        break;
+    default:
+        // do not change it
+        break;
+    }
+
+    // Provide this class as a delegate to the audio and video output interfaces
+    m_deckLinkOutput->SetScheduledFrameCompletionCallback(this);
+    m_deckLinkOutput->SetAudioCallback(this);
+
+    avframe    = avcodec_alloc_frame();
+    audioframe = avcodec_alloc_frame();
+
+    packet_queue_init(&audioqueue);
+    packet_queue_init(&videoqueue);
+    if (frame_queue_init(&framequeue, kFrameQueueSize) < 0) {
+        fprintf(stderr, "Cannot allocate the frame queue\n");
+        goto bail;
+    }
+    pthread_t th;
+    if (!generate && !pthread_create(&th, NULL, fill_queues, NULL))
+        sched_thread(th, "reader");
+
+    // live sources start as soon as the jitter buffer is filled, the
+    // cued ones wait for the trigger anyway
+    if (!live && !generate && !cue_wait)
+        usleep(buffer); // You can add the microseconds you need for pre-buffering before start playing
+    // Start playing
+    StartRunning(videomode);
+
+    if (m_running && cue_wait) {
+        // the audio has to be on the card as well
+        pthread_mutex_lock(&sleepMutex);
+        while (!m_audioPrerolled)
+            pthread_cond_wait(&m_prerollCond, &sleepMutex);
+        pthread_mutex_unlock(&sleepMutex);
+
+        fprintf(stderr, "Cued, press Enter to start\n");
+        while (getchar() != '\n' && !feof(stdin))
+            ;
+        StartOnFrameBoundary();
+    }
+
+    pthread_mutex_lock(&sleepMutex);
+    pthread_cond_wait(&sleepCond, &sleepMutex);
+    pthread_mutex_unlock(&sleepMutex);
+    fill_me = 0;
+    fprintf(stderr, "Exiting, cleaning up\n");
+    clip_cache_abort(&clip_cache);
+    pattern_pool_abort(&pattern_pool);
+    packet_queue_abort(&videoqueue);
+    packet_queue_abort(&audioqueue);
+    frame_queue_abort(&framequeue);
+    for (int i = 0; i < m_nbMirrors; i++)
+        m_mirrors[i]->Abort();
+    if (m_decoding) {
+        pthread_join(m_decodeThread, NULL);
+        m_decoding = false;
+    }
+    if (!generate)
+        pthread_join(th, NULL);
+    fprintf(stderr, "Decoded %lu frames, %d us average, %d us max, "
+            "%lu scheduled late\n",
+            m_framesDecoded, (int)m_decodeTimeAvg, (int)m_decodeTimeMax,
+            m_lateFrames);
+    fprintf(stderr, "Preroll settled at %d frames, %lu displayed late, "
+            "%lu dropped\n", m_preroll, m_displayedLate, m_dropped);
+    if (live)
+        fprintf(stderr, "Live source: %lu frames repeated, %lu dropped\n",
+                m_liveRepeated, m_liveDropped);
+    if (m_liveLast)
+        m_liveLast->Release();
+    m_liveLast = NULL;
+    for (int i = 0; i < m_nbMirrors; i++) {
+        if (m_mirrors[i]->Failed())
+            continue;
+        fprintf(stderr, "Card %d: %lu frames scheduled, %lu late\n",
+                mirror_card[i], m_mirrors[i]->Scheduled(),
+                m_mirrors[i]->Late());
+    }
+    packet_queue_end(&audioqueue);
+    packet_queue_end(&videoqueue);
+    frame_queue_end(&framequeue);
+
+bail:
+    for (int i = 0; i < m_nbMirrors; i++) {
+        m_mirrors[i]->Stop();
+        delete m_mirrors[i];
+    }
+    m_nbMirrors = 0;
+
+    if (m_running == true) {
+        StopRunning();
+    } else {
+        // Release any resources that were partially allocated
+        if (m_deckLinkOutput != NULL) {
+            m_deckLinkOutput->Release();
+            m_deckLinkOutput = NULL;
+        }
+        //
+        if (m_deckLink != NULL) {
+            m_deckLink->Release();
+            m_deckLink = NULL;
+        }
+    }
+    // the output callback blends it until the output stops
+    overlay_close(&overlay);
+
+    if (deckLinkIterator != NULL)
+        deckLinkIterator->Release();
+
+    return true;
+}
+
+IDeckLinkDisplayMode *Player::GetDisplayModeByIndex(int selectedIndex)
+{
+    // Populate the display mode combo with a list of display modes supported by the installed DeckLink card
+    IDeckLinkDisplayModeIterator *displayModeIterator;
+    IDeckLinkDisplayMode *deckLinkDisplayMode;
+    IDeckLinkDisplayMode *selectedMode = NULL;
+    int index                          = 0;
+
+    if (m_deckLinkOutput->GetDisplayModeIterator(&displayModeIterator) != S_OK)
+        goto bail;
+    while (displayModeIterator->Next(&deckLinkDisplayMode) == S_OK) {
+        BMDProbeString str;
+
+        if (deckLinkDisplayMode->GetName(&str) == S_OK) {
+            if (index == selectedIndex) {
+                printf("Selected mode: %s\n\n\n", ToStr(str));
+                selectedMode = deckLinkDisplayMode;
+                FreeStr(str);
+                goto bail;
+            }
+        }
+        index++;
+    }
+bail:
+    displayModeIterator->Release();
+    return selectedMode;
+}
+
+void Player::StartRunning(int videomode)
+{
+    IDeckLinkDisplayMode *videoDisplayMode = NULL;
+    unsigned long audioSamplesPerFrame;
+
+    // Get the display mode for 1080i 59.95
+    videoDisplayMode = GetDisplayModeByIndex(videomode);
+
+    if (!videoDisplayMode)
+        return;
+
+    m_frameWidth  = videoDisplayMode->GetWidth();
+    m_frameHeight = videoDisplayMode->GetHeight();
+    videoDisplayMode->GetFrameRate(&m_frameDuration, &m_frameTimescale);
+    m_rowBytes = row_bytes(pix, m_frameWidth);
+
+    // only armed by the first completion, preroll and cueing are fine
+    if (watchdog > 0) {
+        m_watchdog = decklink_watchdog_alloc(1, m_frameDuration *
+                                                1000000000LL /
+                                                m_frameTimescale,
+                                             watchdog, 1, NULL, NULL);
+        if (m_watchdog) {
+            decklink_watchdog_set_dump(m_watchdog, dump_queues, NULL);
+            decklink_watchdog_sched(m_watchdog, sched_policy, sched_priority,
+                                    sched_cpus);
+            decklink_watchdog_arm(m_watchdog, 1);
+        }
+    }
+
+    switch (videoDisplayMode->GetFieldDominance()) {
+    case bmdLowerFieldFirst:
+        m_interlaced      = true;
+        m_lowerFieldFirst = true;
+        break;
+    case bmdUpperFieldFirst:
+        m_interlaced      = true;
+        m_lowerFieldFirst = false;
+        break;
+    default:
+        m_interlaced      = false;
+        m_lowerFieldFirst = false;
+        break;
+    }
+
+    if (raw_playout) {
+        if (!raw_index.offsets) {
+            raw_index.frame_size = m_rowBytes * m_frameHeight;
+            raw_index.nb_frames  = raw_index.map_size / raw_index.frame_size;
+        } else if ((unsigned long)raw_index.frame_size !=
+                   m_rowBytes * m_frameHeight) {
+            fprintf(stderr, "The raw frames do not match the output mode\n");
+            return;
+        }
+    }
+
+    // Set the video output mode
+    if (m_deckLinkOutput->EnableVideoOutput(videoDisplayMode->GetDisplayMode(),
+                                            bmdVideoOutputFlagDefault) !=
+        S_OK) {
+        fprintf(stderr, "Failed to enable video output\n");
+        return;
+    }
+
+    if (audio_st || generate) {
+        // Set the audio output mode
+        if (m_deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
+                                                m_audioSampleDepth,
+                                                m_audioChannelCount,
+                                                bmdAudioOutputStreamTimestamped) !=
+            S_OK) {
+            fprintf(stderr, "Failed to enable audio output\n");
+            return;
+        }
+
+        // Decoded audio is gathered in blocks of half the waterlevel
+        m_audioBufferSampleLength = FFMAX(audio_waterlevel / 2, 1024);
+        m_audioBufferOffset       = 0;
+        m_audioBuffer             = malloc(m_audioBufferSampleLength *
+                                           m_audioChannelCount *
+                                           m_audioSampleDepth / 8);
+        if (!m_audioBuffer) {
+            fprintf(stderr, "Failed to allocate the audio buffer\n");
+            return;
+        }
+    }
+
+    m_framesPerSecond = (m_frameTimescale + m_frameDuration - 1) /
+                        m_frameDuration;
+
+    if (generate) {
+        // the still pictures are scheduled again and again
+        if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight,
+                                               m_rowBytes, pix,
+                                               bmdFrameFlagDefault,
+                                               &m_barsFrame) != S_OK ||
+            m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight,
+                                               m_rowBytes, pix,
+                                               bmdFrameFlagDefault,
+                                               &m_blackFrame) != S_OK) {
+            fprintf(stderr, "Failed to allocate the pattern frames\n");
+            return;
+        }
+        FillColourBars(m_barsFrame);
+        FillBlack(m_blackFrame);
+
+        // enough for the card, a few queued and what the mirrors hold
+        if (m_outputSignal == kOutputSignalPattern &&
+            signal_pattern != DECKLINK_PATTERN_BARS &&
+            signal_pattern != DECKLINK_PATTERN_BLACK) {
+            int nb_frames = max_preroll + 4;
+
+            for (int i = 0; i < m_nbMirrors; i++)
+                nb_frames += mirror_delay[i];
+
+            if (pattern_pool_open(&pattern_pool, signal_pattern, nb_frames,
+                                  m_frameWidth, m_frameHeight, m_rowBytes,
+                                  pix) < 0) {
+                fprintf(stderr, "Failed to allocate the pattern frames\n");
+                return;
+            }
+        }
+    }
+
+    // raw frames are played as they are
+    if (overlay_file && !raw_playout &&
+        overlay_open(&overlay, overlay_file, m_frameWidth, m_frameHeight,
+                     live ? OVERLAY_LAYERS : 1) < 0)
+        return;
+
+    // live, the layers are made ahead away from the output callback
+    if (live && overlay.ic) {
+        if (overlay_start(&overlay) < 0) {
+            fprintf(stderr, "Failed to start the overlay thread\n");
+            return;
+        }
+        sched_thread(overlay.thread, "overlay");
+    }
+
+    if (pthread_create(&m_decodeThread, NULL,
+                       generate ? GeneratorThread :
+                       raw_playout ? RawVideoThread : DecodeThread, this)) {
+        fprintf(stderr, "Failed to start the decoding thread\n");
+        return;
+    }
+    m_decoding = true;
+    sched_thread(m_decodeThread, "decoding");
+
+    // start safe, UpdatePreroll shrinks it while the output keeps up
+    m_preroll = max_preroll;
+    if (live) {
+        frame_queue_wait(&framequeue, jitter_frames);
+        m_preroll = min_preroll;
+    }
+    for (int i = 0; i < m_preroll; i++)
+        ScheduleNextFrame(true);
+
+    if (cue_point)
+        fprintf(stderr, "Cued to %s: %d frames ready in %d ms, "
+                "%lu decoded to reach it\n", cue_point, m_preroll,
+                (int)((av_gettime() - cue_time) / 1000), m_cueSkipped);
+
+    // Begin audio preroll.  This will begin calling our audio callback, which will start the DeckLink output stream.
+//    m_audioBufferOffset = 0;
+    // the other cards preroll as much, to start together
+    for (int i = 0; i < m_nbMirrors; i++)
+        if (!m_mirrors[i]->Start(videoDisplayMode->GetDisplayMode(),
+                                 m_frameDuration, m_frameTimescale,
+                                 m_preroll))
+            fprintf(stderr, "Failed to start card %d, going on without it\n",
+                    mirror_card[i]);
+
+    if (!audio_st && !generate) {
+        m_audioPrerolled = true;
+        if (!cue_wait)
+            StartPlayback();
+    } else if (m_deckLinkOutput->BeginAudioPreroll() != S_OK) {
+        fprintf(stderr, "Failed to begin audio preroll\n");
+        return;
+    }
+
+    m_running = true;
+
+    return;
+}
+
+void Player::StopRunning()
+{
+    if (m_watchdog) {
+        fprintf(stderr, "Output stalled %lu times\n",
+                (unsigned long)decklink_watchdog_stalls(m_watchdog));
+        decklink_watchdog_free(m_watchdog);
+        m_watchdog = NULL;
+    }
+
+    // Stop the audio and video output streams immediately
+    m_deckLinkOutput->StopScheduledPlayback(0, NULL, 0);
+    //
+    m_deckLinkOutput->DisableAudioOutput();
+    m_deckLinkOutput->DisableVideoOutput();
+
+    if (m_audioBuffer != NULL)
+        free(m_audioBuffer);
+    m_audioBuffer = NULL;
+
+    if (m_barsFrame)
+        m_barsFrame->Release();
+    if (m_blackFrame)
+        m_blackFrame->Release();
+    m_barsFrame  = NULL;
+    m_blackFrame = NULL;
+}
+
+void Player::ScheduleNextFrame(bool prerolling)
+{
+    IDeckLinkVideoFrame *videoFrame;
+    int64_t pts, duration;
+    HRESULT ret;
+    int fresh;
+
+    if (!live && !prerolling && !frame_queue_count(&framequeue)) {
+        if (!m_lateFrames++)
+            decklink_log(DECKLINK_LOG_WARNING,
+                         "Frame queue underrun, decoding is late");
+    }
+
+    fresh = live ?
+            NextLiveFrame(&videoFrame, &pts, &duration, prerolling) :
+            frame_queue_get(&framequeue, &videoFrame, &pts, &duration, 1);
+    if (fresh < 0) {
+        // the playout ends once the last frame has been shown
+        m_videoDone = true;
+        if (!m_framesInFlight)
+            pthread_cond_signal(&sleepCond);
+        return;
+    }
+
+    // a repeated slot shows the frame as it went out, overlay included
+    if (live && fresh > 0)
+        BlendLiveOverlay(videoFrame, pts);
+
+    // the other cards show the same slots, repeats and drops included
+    for (int i = 0; i < m_nbMirrors && live; i++) {
+        videoFrame->AddRef();
+        m_mirrors[i]->Queue(videoFrame, pts, duration);
+    }
+
+    BMD_PROBE(bmdplay, schedule_frame, m_totalFramesScheduled, pts,
+              framequeue.nb_frames);
+    decklink_trace_begin(DECKLINK_TRACE_SCHEDULE, pts / m_frameDuration);
+    ret = m_deckLinkOutput->ScheduleVideoFrame(videoFrame, pts, duration,
+                                               m_frameTimescale);
+    decklink_trace_end(DECKLINK_TRACE_SCHEDULE, -1);
+    if (ret != S_OK) {
+        decklink_log_ratelimit(1000, DECKLINK_LOG_ERROR,
+                               "Error scheduling frame");
+    } else {
+        m_totalFramesScheduled++;
+        m_framesInFlight++;
+        BMD_PROBE(bmdplay, schedule_frame_done, m_totalFramesScheduled, pts,
+                  m_framesInFlight);
+
+        // how far ahead of the output the frame has been scheduled
+        if (m_running) {
+            BMDTimeValue now;
+            double speed;
+
+            if (m_deckLinkOutput->GetScheduledStreamTime(m_frameTimescale,
+                                                         &now, &speed) == S_OK)
+                m_leadMin = FFMIN(m_leadMin, pts - now);
+        }
+    }
+
+    videoFrame->Release();
+}
+
+/* A live source runs on its own clock: the output takes one frame per
+ * slot, showing the last one again if nothing arrived in time and
+ * dropping the oldest once more than twice the jitter buffer piles up.
+ * The audio follows the offset between the two timelines.
+ * Return 1 for a new frame, 0 for the last one again. */
+int Player::NextLiveFrame(IDeckLinkVideoFrame **frame, int64_t *pts,
+                          int64_t *duration, bool prerolling)
+{
+    IDeckLinkVideoFrame *next;
+    int64_t next_pts, next_duration;
+    int ret;
+
+    while (frame_queue_count(&framequeue) > 2 * jitter_frames &&
+           frame_queue_get(&framequeue, &next, &next_pts,
+                           &next_duration, 0) > 0) {
+        next->Release();
+        m_liveDropped++;
+    }
+
+    ret = frame_queue_get(&framequeue, &next, &next_pts, &next_duration,
+                          prerolling && !m_liveLast);
+    if (ret < 0 || (!ret && !m_liveLast))
+        return -1;
+
+    if (ret > 0) {
+        if (m_liveLast)
+            m_liveLast->Release();
+        m_liveLast   = next;
+        // read by the audio callback
+        __atomic_store_n(&m_liveOffset, m_liveSlot * m_frameDuration - next_pts,
+                         __ATOMIC_RELAXED);
+    } else {
+        m_liveRepeated++;
+    }
+
+    m_liveLast->AddRef();
+    *frame    = m_liveLast;
+    *pts      = m_liveSlot * m_frameDuration;
+    *duration = m_frameDuration;
+    m_liveSlot++;
+
+    return ret > 0;
+}
+
+/* The stream time to start at right away for the frame at 0 to go out
+ * on the next frame boundary of the card clock. The stream is half a
+ * frame into it at the boundary, which leaves the start call that long.
+ * wait is set to the time left to the boundary. */
+static BMDTimeValue boundary_start(IDeckLinkOutput *output,
+                                   BMDTimeScale timescale, BMDTimeValue *wait)
+{
+    BMDTimeValue now, inFrame, perFrame;
+
+    *wait = 0;
+    if (output->GetHardwareReferenceClock(timescale, &now, &inFrame,
+                                          &perFrame) != S_OK || !perFrame)
+        return 0;
+
+    *wait = perFrame - inFrame;
+
+    return perFrame / 2 - *wait;
+}
+
+/* Let the card start on its next frame boundary, the first cued frame
+ * goes out there with nothing shown before it. */
+void Player::StartOnFrameBoundary()
+{
+    int64_t start = av_gettime();
+    BMDTimeValue wait;
+
+    m_deckLinkOutput->StartScheduledPlayback(boundary_start(m_deckLinkOutput,
+                                                            m_frameTimescale,
+                                                            &wait),
+                                             m_frameTimescale, 1.0);
+    for (int i = 0; i < m_nbMirrors; i++)
+        m_mirrors[i]->StartPlayback(true);
+
+    fprintf(stderr, "Started %d us after the trigger, on air %d us after it\n",
+            (int)(av_gettime() - start),
+            (int)av_rescale(wait, 1000000, m_frameTimescale));
+}
+
+void Player::StartPlayback()
+{
+    m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
+    for (int i = 0; i < m_nbMirrors; i++)
+        m_mirrors[i]->StartPlayback(false);
+}
+
+/* Every card gets a reference to the same converted frame, the frame
+ * reference is consumed. Live, the other cards are fed the output slots
+ * by ScheduleNextFrame instead. */
+int Player::QueueFrame(IDeckLinkVideoFrame *frame, int64_t pts,
+                       int64_t duration)
+{
+    // live, the output callback blends on the copy made here
+    if ((live && overlay.running && CopyFrame(&frame) < 0) ||
+        (!live && BlendOverlay(&frame, pts) < 0)) {
+        fprintf(stderr, "Cannot allocate a video frame\n");
+        frame->Release();
+        return -1;
+    }
+
+    for (int i = 0; i < m_nbMirrors && !live; i++) {
+        frame->AddRef();
+        if (m_mirrors[i]->Queue(frame, pts, duration) < 0) {
+            frame->Release();
+            return -1;
+        }
+    }
+
+    return frame_queue_put(&framequeue, frame, pts, duration, 1);
+}
+
+/* A copy of the frame to blend on, since it might be cached or shown
+ * again. The frame reference is replaced, and left alone on failure. */
+int Player::CopyFrame(IDeckLinkVideoFrame **frame)
+{
+    IDeckLinkMutableVideoFrame *copy;
+    void *src, *dst;
+
+    if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight,
+                                           m_rowBytes, pix,
+                                           bmdFrameFlagDefault,
+                                           &copy) != S_OK)
+        return -1;
+
+    (*frame)->GetBytes(&src);
+    copy->GetBytes(&dst);
+    memcpy(dst, src, m_rowBytes * m_frameHeight);
+
+    (*frame)->Release();
+    *frame = copy;
+
+    return 0;
+}
+
+/* The overlay at the output time of the slot, on a copy of the frame */
+int Player::BlendOverlay(IDeckLinkVideoFrame **frame, int64_t time)
+{
+    void *data;
+
+    if (!overlay.ic ||
+        overlay_update(&overlay,
+                       av_rescale(time, AV_TIME_BASE, m_frameTimescale)) < 0)
+        return 0;
+
+    if (CopyFrame(frame) < 0)
+        return -1;
+
+    (*frame)->GetBytes(&data);
+    overlay_blend(&overlay, &overlay.layers[0], (uint8_t *)data, m_rowBytes,
+                  pix);
+
+    return 0;
+}
+
+/* Live, from the output callback: the layer due at the slot goes on the
+ * copy QueueFrame made, nothing is decoded or allocated here. */
+void Player::BlendLiveOverlay(IDeckLinkVideoFrame *frame, int64_t time)
+{
+    const OverlayLayer *layer;
+    void *data;
+
+    if (!overlay.running)
+        return;
+
+    layer = overlay_layer(&overlay,
+                          av_rescale(time, AV_TIME_BASE, m_frameTimescale));
+    if (!layer)
+        return;
+
+    frame->GetBytes(&data);
+    overlay_blend(&overlay, layer, (uint8_t *)data, m_rowBytes, pix);
+}
+
+void Player::FinishFrames()
+{
+    for (int i = 0; i < m_nbMirrors; i++)
+        m_mirrors[i]->Finish();
+    frame_queue_finish(&framequeue);
+}
+
+bool Player::OpenMirrors()
+{
+    for (int n = 0; n < nb_mirrors; n++) {
+        IDeckLinkIterator *it = CreateDeckLinkIteratorInstance();
+        IDeckLink *deckLink   = NULL;
+        IDeckLinkOutput *output;
+        HRESULT result        = S_FALSE;
+        int i = 0;
+
+        if (!it)
+            return false;
+
+        do {
+            if (deckLink)
+                deckLink->Release();
+            deckLink = NULL;
+            result   = it->Next(&deckLink);
+        } while (result == S_OK && i++ < mirror_card[n]);
+        it->Release();
+
+        if (result != S_OK ||
+            deckLink->QueryInterface(IID_IDeckLinkOutput,
+                                     (void **)&output) != S_OK) {
+            fprintf(stderr, "Cannot use card %d for output\n", mirror_card[n]);
+            if (deckLink)
+                deckLink->Release();
+            return false;
+        }
+        deckLink->Release();
+
+        m_mirrors[m_nbMirrors] = new MirrorOutput(output, mirror_delay[n]);
+        if (!m_mirrors[m_nbMirrors]->Init()) {
+            delete m_mirrors[m_nbMirrors];
+            return false;
+        }
+        m_nbMirrors++;
+    }
+
+    return true;
+}
+
+/************************* Additional outputs *****************************/
+
+MirrorOutput::MirrorOutput(IDeckLinkOutput *output, int delay)
+    : m_output(output), m_queue(NULL), m_delay(delay), m_running(false),
+      m_failed(0), m_frameDuration(0), m_frameTimescale(0), m_scheduled(0),
+      m_late(0)
+{
+}
+
+MirrorOutput::~MirrorOutput()
+{
+    if (m_queue) {
+        frame_queue_end(m_queue);
+        av_freep(&m_queue);
+    }
+    m_output->Release();
+}
+
+// the queue covers the delay on top of what the main output buffers
+bool MirrorOutput::Init()
+{
+    m_queue = (FrameQueue *)av_mallocz(sizeof(*m_queue));
+
+    return m_queue && frame_queue_init(m_queue, kFrameQueueSize + m_delay) >= 0;
+}
+
+bool MirrorOutput::Start(BMDDisplayMode mode, BMDTimeValue frameDuration,
+                         BMDTimeScale timeScale, int preroll)
+{
+    m_frameDuration  = frameDuration;
+    m_frameTimescale = timeScale;
+
+    if (m_output->EnableVideoOutput(mode, bmdVideoOutputFlagDefault) != S_OK) {
+        // stop taking frames, the decoder might be waiting on the queue
+        __atomic_store_n(&m_failed, 1, __ATOMIC_RELEASE);
+        frame_queue_abort(m_queue);
+        return false;
+    }
+
+    m_output->SetScheduledFrameCompletionCallback(this);
+
+    for (int i = 0; i < preroll; i++)
+        ScheduleNextFrame();
+
+    m_running = true;
+
+    return true;
+}
+
+/* Every card waits for its own frame boundary */
+void MirrorOutput::StartPlayback(bool onBoundary)
+{
+    BMDTimeValue wait;
+
+    if (m_running)
+        m_output->StartScheduledPlayback(onBoundary ?
+                                         boundary_start(m_output,
+                                                        m_frameTimescale,
+                                                        &wait) : 0,
+                                         m_frameTimescale, 1.0);
+}
+
+void MirrorOutput::Stop()
+{
+    Abort();
+    if (m_running) {
+        m_output->StopScheduledPlayback(0, NULL, 0);
+        m_output->DisableVideoOutput();
+        m_output->SetScheduledFrameCompletionCallback(NULL);
+        m_running = false;
+    }
+}
+
+void MirrorOutput::Abort()
+{
+    if (m_queue)
+        frame_queue_abort(m_queue);
+}
+
+void MirrorOutput::Finish()
+{
+    frame_queue_finish(m_queue);
+}
+
+/* A card that failed to start takes no frames, the others go on. Live,
+ * the frames come from the output callback, which must not wait. */
+int MirrorOutput::Queue(IDeckLinkVideoFrame *frame, int64_t pts,
+                        int64_t duration)
+{
+    if (Failed()) {
+        frame->Release();
+        return 0;
+    }
+
+    if (frame_queue_put(m_queue, frame, pts, duration, !live) < 0)
+        return Failed() ? 0 : -1;
+
+    return 0;
+}
+
+void MirrorOutput::ScheduleNextFrame()
+{
+    IDeckLinkVideoFrame *frame;
+    int64_t pts, duration;
+
+    if (frame_queue_get(m_queue, &frame, &pts, &duration, 1) < 0)
+        return;
+
+    // the first delay slots stay black
+    if (m_output->ScheduleVideoFrame(frame, pts + m_delay * m_frameDuration,
+                                     duration, m_frameTimescale) == S_OK)
+        m_scheduled++;
+
+    frame->Release();
+}
+
+HRESULT MirrorOutput::ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
+                                              BMDOutputFrameCompletionResult result)
+{
+    if (result == bmdOutputFrameDisplayedLate ||
+        result == bmdOutputFrameDropped)
+        m_late++;
+
+    if (result != bmdOutputFrameFlushed)
+        ScheduleNextFrame();
+
+    return S_OK;
+}
+
+/* Keep the smallest preroll that does not lose frames: grow it as soon
+ * as a frame is late, dropped or scheduled less than half a frame ahead,
+ * shrink it by one after a few seconds in which every frame was on time
+ * with at least a frame to spare. */
+void Player::UpdatePreroll(BMDOutputFrameCompletionResult result)
+{
+    int preroll = m_preroll;
+
+    if (result == bmdOutputFrameDisplayedLate)
+        m_displayedLate++;
+    else if (result == bmdOutputFrameDropped)
+        m_dropped++;
+
+    if (result == bmdOutputFrameDisplayedLate ||
+        result == bmdOutputFrameDropped ||
+        m_leadMin < m_frameDuration / 2) {
+        preroll = FFMIN(m_preroll + 1, max_preroll);
+    } else if (++m_framesOnTime >= 4 * m_framesPerSecond) {
+        if (m_leadMin >= 2 * m_frameDuration)
+            preroll = FFMAX(m_preroll - 1, min_preroll);
+    } else {
+        return;
+    }
+
+    m_framesOnTime = 0;
+    m_leadMin      = INT_MAX;
+
+    if (preroll != m_preroll) {
+        decklink_log(DECKLINK_LOG_INFO, "Preroll %d frames", preroll);
+        m_preroll = preroll;
+    }
+}
+
+void *Player::DecodeThread(void *priv)
+{
+    Player *player = (Player *)priv;
+
+    player->DecodeVideo();
+
+    return NULL;
+}
+
+void Player::DecodeVideo()
+{
+    AVRational out_tb = { 1, (int)m_frameTimescale };
+    AVRational tb     = out_tb;
+    PlayItem *item    = NULL;
+    int next_item     = 0;
+    AVPacket pkt;
+    AVPicture picture, planar = { { 0 } };
+    int64_t duration = 0, next_pts = 0;
+    bool aborted = false;
+    bool keyframe = !live;
+
+    // v210 is scaled to planar 10 bit and packed in the card frame
+    if (pix == bmdFormat10BitYUV) {
+        if (avpicture_alloc(&planar, pix_fmt, FFALIGN(m_frameWidth, 6),
+                            m_frameHeight) < 0) {
+            fprintf(stderr, "Cannot allocate the 10 bit picture\n");
+            FinishFrames();
+            return;
+        }
+        fill_black(&planar, pix_fmt, 0, 0, FFALIGN(m_frameWidth, 6),
+                   m_frameHeight);
+    }
+
+    while (!aborted && packet_queue_get(&videoqueue, &pkt, 1) > 0) {
+        // fill_queues sends an empty packet once an item is over
+        bool flush = !pkt.size;
+        int got_picture;
+
+        // end of a pass in loop mode
+        if (flush && pkt.stream_index < 0) {
+            av_free_packet(&pkt);
+            if (FlushCadence() < 0)
+                break;
+            if (clip_cache_complete(&clip_cache) == CACHE_READY) {
+                ReplayCachedVideo();
+                break;
+            }
+            continue;
+        }
+
+        // joining a live stream, nothing decodes before a keyframe
+        if (!keyframe && !flush) {
+            if (!(pkt.flags & AV_PKT_FLAG_KEY)) {
+                av_free_packet(&pkt);
+                continue;
+            }
+            keyframe = true;
+        }
+
+        if (!item) {
+            AVRational rate;
+
+            item = playlist_next(&next_item, AVMEDIA_TYPE_VIDEO);
+            if (!item) {
+                av_free_packet(&pkt);
+                break;
+            }
+
+            tb   = item->video_st->time_base;
+            rate = item->video_st->avg_frame_rate;
+            if (rate.num && rate.den)
+                duration = av_rescale(tb.den, rate.den,
+                                      (int64_t)tb.num * rate.num);
+            else
+                duration = av_rescale(tb.den, m_frameDuration,
+                                      (int64_t)tb.num * m_frameTimescale);
+            next_pts = av_rescale_q(item->start, time_base_q, tb);
+        }
+
+        do {
+            IDeckLinkMutableVideoFrame *videoFrame;
+            void *frame;
+            int64_t start = av_gettime();
+            int64_t pts;
+
+            decklink_trace_begin(DECKLINK_TRACE_DECODE, -1);
+            avcodec_decode_video2(item->video_st->codec, avframe,
+                                  &got_picture, &pkt);
+            decklink_trace_end(DECKLINK_TRACE_DECODE, -1);
+            m_decodeTime += av_gettime() - start;
+
+            if (!got_picture)
+                break;
+
+            // With frame threading the pictures come out delayed and
+            // reordered, pkt_pts follows the picture, not the packet.
+            pts = avframe->pkt_pts;
+            if (pts == AV_NOPTS_VALUE)
+                pts = next_pts;
+            next_pts = pts + duration;
+
+            // decoded forward from the keyframe before the in point
+            if (pts + duration / 2 <
+                av_rescale_q(item->start, time_base_q, tb)) {
+                m_cueSkipped++;
+                continue;
+            }
+
+            if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
+                                                   m_frameHeight,
+                                                   m_rowBytes,
+                                                   pix,
+                                                   bmdFrameFlagDefault,
+                                                   &videoFrame) != S_OK) {
+                fprintf(stderr, "Cannot allocate a video frame\n");
+                aborted = true;
+                break;
+            }
+
+            start = av_gettime();
+            decklink_trace_begin(DECKLINK_TRACE_CONVERT,
+                                 av_rescale_q(pts, tb, out_tb) /
+                                 m_frameDuration);
+            videoFrame->GetBytes(&frame);
+            if (planar.data[0])
+                picture = planar;
+            else
+                avpicture_fill(&picture, (uint8_t *)frame, pix_fmt,
+                               m_frameWidth, m_frameHeight);
+
+            if (setup_scaler(item, avframe, m_frameWidth, m_frameHeight) < 0) {
+                decklink_trace_end(DECKLINK_TRACE_CONVERT, -1);
+                videoFrame->Release();
+                aborted = true;
+                break;
+            }
+            scale_frame(item, avframe, &picture, m_frameWidth, m_frameHeight);
+            if (planar.data[0])
+                v210_pack(&planar, (uint8_t *)frame, m_rowBytes,
+                          m_frameWidth, m_frameHeight);
+            decklink_trace_end(DECKLINK_TRACE_CONVERT, -1);
+            m_decodeTime += av_gettime() - start;
+
+            UpdateDecodeStats();
+
+            if (PutCadenced(videoFrame, av_rescale_q(pts, tb, out_tb),
+                            av_rescale_q(pts + duration, tb, out_tb)) < 0) {
+                aborted = true;
+                break;
+            }
+        } while (flush);
+
+        av_free_packet(&pkt);
+
+        if (flush) {
+            // ready to start over, the item might be looped
+            avcodec_flush_buffers(item->video_st->codec);
+            item = NULL;
+        }
+    }
+
+    if (!aborted)
+        FlushCadence();
+    ResetCadence();
+    avpicture_free(&planar);
+
+    FinishFrames();
+}
+
+/* The decoded frames are mapped on the output frame grid: every output
+ * slot shows the frame whose span covers the slot time, rounded to the
+ * nearest slot, so frames are repeated or dropped as the rates require.
+ * On interlaced outputs each field is picked on its own, which gives
+ * the 2:3 pulldown for film rate material; only the slots mixing two
+ * frames are copied, repeats reuse the converted frame. */
+IDeckLinkMutableVideoFrame *Player::PickField(int64_t time)
+{
+    int64_t round = m_interlaced ? m_frameDuration / 4 : m_frameDuration / 2;
+
+    if (m_cadence[1] && time + round > m_cadenceStart[1])
+        return m_cadence[1];
+
+    return m_cadence[0] ? m_cadence[0] : m_cadence[1];
+}
+
+int Player::EmitSlot(int64_t slot)
+{
+    int64_t time = slot * m_frameDuration;
+    IDeckLinkMutableVideoFrame *first  = PickField(time);
+    IDeckLinkMutableVideoFrame *second = m_interlaced ?
+                                         PickField(time + m_frameDuration / 2) :
+                                         first;
+    IDeckLinkMutableVideoFrame *frame;
+
+    if (first == second) {
+        frame = first;
+        frame->AddRef();
+    } else {
+        uint8_t *dst, *src[2];
+
+        if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth, m_frameHeight,
+                                               m_rowBytes, pix,
+                                               bmdFrameFlagDefault,
+                                               &frame) != S_OK) {
+            fprintf(stderr, "Cannot allocate a video frame\n");
+            return -1;
+        }
+
+        frame->GetBytes((void **)&dst);
+        first->GetBytes((void **)&src[0]);
+        second->GetBytes((void **)&src[1]);
+
+        for (unsigned long y = 0; y < m_frameHeight; y++) {
+            int field = (y & 1) ^ m_lowerFieldFirst;
+
+            memcpy(dst + y * m_rowBytes, src[field] + y * m_rowBytes,
+                   m_rowBytes);
+        }
+    }
+
+    // a repeated frame takes no more memory in the cache, the state is
+    // checked under the cache lock
+    clip_cache_add_frame(&clip_cache, frame, time, m_frameDuration,
+                         frame == m_cadenceCached ?
+                         0 : m_rowBytes * m_frameHeight);
+    m_cadenceCached = frame;
+
+    return QueueFrame(frame, time, m_frameDuration);
+}
+
+int Player::PutCadenced(IDeckLinkMutableVideoFrame *frame,
+                        int64_t start, int64_t end)
+{
+    int64_t round = m_interlaced ? m_frameDuration / 4 : m_frameDuration / 2;
+    int64_t last  = m_interlaced ? m_frameDuration / 2 : 0;
+
+    if (!m_cadence[1])
+        m_cadenceSlot = start - round >= 0 ?
+                        (start - round) / m_frameDuration + 1 : 0;
+
+    // the slots before the new frame cannot change anymore
+    while (m_cadence[1] &&
+           m_cadenceSlot * m_frameDuration + last + round <= start) {
+        if (EmitSlot(m_cadenceSlot) < 0) {
+            frame->Release();
+            return -1;
+        }
+        m_cadenceSlot++;
+    }
+
+    if (m_cadence[0])
+        m_cadence[0]->Release();
+    m_cadence[0]      = m_cadence[1];
+    m_cadenceStart[0] = m_cadenceStart[1];
+    m_cadence[1]      = frame;
+    m_cadenceStart[1] = start;
+    m_cadenceEnd      = end;
+
+    return 0;
+}
+
+int Player::FlushCadence()
+{
+    int64_t round = m_interlaced ? m_frameDuration / 4 : m_frameDuration / 2;
+    int64_t last  = m_interlaced ? m_frameDuration / 2 : 0;
+
+    while (m_cadence[1] &&
+           m_cadenceSlot * m_frameDuration + last + round <= m_cadenceEnd) {
+        if (EmitSlot(m_cadenceSlot) < 0)
+            return -1;
+        m_cadenceSlot++;
+    }
+
+    return 0;
+}
+
+void Player::ResetCadence()
+{
+    for (int i = 0; i < 2; i++) {
+        if (m_cadence[i])
+            m_cadence[i]->Release();
+        m_cadence[i] = NULL;
+    }
+    m_cadenceCached = NULL;
+}
+
+void Player::ReplayCachedVideo()
+{
+    for (int64_t pass = 1; ; pass++) {
+        for (int i = 0; i < clip_cache.nb_frames; i++) {
+            IDeckLinkVideoFrame *frame = clip_cache.frames[i];
+
+            frame->AddRef();
+            if (QueueFrame(frame,
+                           clip_cache.pts[i] + pass * clip_cache.length,
+                           clip_cache.duration[i]) < 0)
+                return;
+        }
+    }
+}
 
-    av_dump_format(ic, 0, filename, 0);
+void *Player::GeneratorThread(void *priv)
+{
+    Player *player = (Player *)priv;
 
-    sws = sws_getContext(video_st->codec->width,
-                         video_st->codec->height,
-                         video_st->codec->pix_fmt,
-                         video_st->codec->width,
-                         video_st->codec->height,
-                         pix_fmt,
-                         SWS_BILINEAR, NULL, NULL, NULL);
+    player->GenerateVideo();
 
-    signal(SIGINT, sigfunc);
-    pthread_mutex_init(&sleepMutex, NULL);
-    pthread_cond_init(&sleepCond, NULL);
+    return NULL;
+}
 
-    free(filename);
+/* The still pictures are the same two frames scheduled over and over,
+ * the moving patterns come from the pool. Nothing is drawn that is
+ * already on screen. */
+IDeckLinkVideoFrame *Player::NextGeneratedFrame(int64_t number)
+{
+    // the flagged frame, once every second
+    bool flagged = !(number % m_framesPerSecond);
 
-    ret = generator.Init(videomode, connection, camera);
+    switch (m_outputSignal) {
+    case kOutputSignalPip:
+        return flagged ? m_barsFrame : m_blackFrame;
+    case kOutputSignalDrop:
+        return flagged ? m_blackFrame : m_barsFrame;
+    default:
+        if (pattern_pool.gen)
+            return pattern_pool_get(&pattern_pool, number);
+        return signal_pattern == DECKLINK_PATTERN_BLACK ? m_blackFrame :
+                                                         m_barsFrame;
+    }
+}
 
-    avformat_close_input(&ic);
+void Player::GenerateVideo()
+{
+    for (int64_t n = 0;; n++) {
+        IDeckLinkVideoFrame *frame = NextGeneratedFrame(n);
 
-    fprintf(stderr, "video %ld audio %ld", videoqueue.nb_packets,
-            audioqueue.nb_packets);
+        if (!frame)
+            break;
 
-    return ret;
+        frame->AddRef();
+        if (QueueFrame(frame, n * m_frameDuration, m_frameDuration) < 0)
+            break;
+    }
+
+    FinishFrames();
 }
 
-Player::Player()
+void *Player::RawVideoThread(void *priv)
 {
-    m_audioSampleRate = bmdAudioSampleRate48kHz;
-    m_running         = false;
-    m_outputSignal    = kOutputSignalDrop;
+    Player *player = (Player *)priv;
+
+    player->ReadRawVideo();
+
+    return NULL;
 }
 
-bool Player::Init(int videomode, int connection, int camera)
+void Player::ReadRawVideo()
 {
-    // Initialize the DeckLink API
-    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
-    HRESULT result;
-    int i = 0;
+    int ahead = kFrameQueueSize;
 
-    if (!deckLinkIterator) {
-        fprintf(stderr,
-                "This application requires the DeckLink drivers installed.\n");
-        goto bail;
-    }
+    for (int i = 0; i < FFMIN(ahead, raw_index.nb_frames); i++)
+        raw_index_prefetch(&raw_index, i);
 
-    m_audioSampleDepth =
-        av_get_exact_bits_per_sample(audio_st->codec->codec_id);
+    for (int64_t n = 0; raw_index.nb_frames &&
+                        (loop || n < raw_index.nb_frames); n++) {
+        int i = n % raw_index.nb_frames;
+        IDeckLinkVideoFrame *frame;
 
-    switch (audio_st->codec->channels) {
-        case  2:
-        case  8:
-        case 16:
-            break;
-        default:
-            fprintf(stderr,
-                    "%d channels not supported, please use 2, 8 or 16\n",
-                    audio_st->codec->channels);
-            goto bail;
-    }
+        // keep the readahead one queue worth in front of the output
+        raw_index_prefetch(&raw_index, (i + ahead) % raw_index.nb_frames);
+
+        frame = new MappedVideoFrame(raw_index_frame(&raw_index, i),
+                                     m_frameWidth, m_frameHeight,
+                                     m_rowBytes, pix);
 
-    switch (m_audioSampleDepth) {
-        case 16:
-        case 32:
+        if (QueueFrame(frame, n * m_frameDuration, m_frameDuration) < 0)
             break;
-        default:
-            fprintf(stderr, "%dbit audio not supported use 16bit or 32bit\n",
-                    m_audioSampleDepth);
     }
 
-    do
-        result = deckLinkIterator->Next(&m_deckLink);
-    while (i++ < camera);
+    FinishFrames();
+}
 
-    if (result != S_OK) {
-        fprintf(stderr, "No DeckLink PCI cards found\n");
-        goto bail;
+void Player::UpdateDecodeStats()
+{
+    int64_t budget  = m_frameDuration * 1000000 / m_frameTimescale;
+    int64_t elapsed = m_decodeTime;
+
+    m_decodeTime = 0;
+
+    if (elapsed > m_decodeTimeMax)
+        m_decodeTimeMax = elapsed;
+
+    // running average over the last few frames
+    if (!m_framesDecoded++)
+        m_decodeTimeAvg = elapsed;
+    else
+        m_decodeTimeAvg += (elapsed - m_decodeTimeAvg) / 16;
+
+    // Warn while the queue still covers for it, at most once per second
+    if (m_decodeTimeAvg > budget * 9 / 10 &&
+        m_framesDecoded - m_lastDecodeWarning > m_framesPerSecond) {
+        decklink_log(DECKLINK_LOG_WARNING,
+                     "Decoding takes %d us per frame, %d us available, "
+                     "%d frames queued: playout is going to underrun",
+                     (int)m_decodeTimeAvg, (int)budget,
+                     frame_queue_count(&framequeue));
+        m_lastDecodeWarning = m_framesDecoded;
     }
+}
 
-    // Obtain the audio/video output interface (IDeckLinkOutput)
-    if (m_deckLink->QueryInterface(IID_IDeckLinkOutput,
-                                   (void **)&m_deckLinkOutput) != S_OK)
-        goto bail;
+void Player::WriteNextAudioSamples()
+{
+    AVPacket pkt;
+    uint32_t bufferedSamples;
+    int ret;
 
-    result = m_deckLink->QueryInterface(IID_IDeckLinkConfiguration,
-                                        (void **)&deckLinkConfiguration);
-    if (result != S_OK) {
-        fprintf(
-            stderr,
-            "Could not obtain the IDeckLinkConfiguration interface - result = %08x\n",
-            result);
-        goto bail;
+    if (generate) {
+        WriteGeneratedAudio();
+        return;
     }
-    //XXX make it generic
-    switch (connection) {
-    case 1:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComposite);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
-        break;
-    case 2:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComponent);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
-        break;
-    case 3:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionHDMI);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
-        break;
-    case 4:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSDI);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
-        break;
-    default:
-        // do not change it
-        break;
+
+    if (m_audioCycleDone) {
+        switch (clip_cache_state(&clip_cache)) {
+        case CACHE_READY:
+            ReplayCachedAudio();
+            return;
+        case CACHE_FILLING:
+            // the video has not been fully decoded yet
+            ScheduleAudioBuffer();
+            return;
+        default:
+            m_audioCycleDone = false;
+            break;
+        }
     }
 
-    // Provide this class as a delegate to the audio and video output interfaces
-    m_deckLinkOutput->SetScheduledFrameCompletionCallback(this);
-    m_deckLinkOutput->SetAudioCallback(this);
+    // Keep decoding until the card holds the requested amount of audio
+    for (;; ) {
+        m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
 
-    avframe = avcodec_alloc_frame();
+        if (bufferedSamples + m_audioBufferOffset >= audio_waterlevel)
+            break;
 
-    packet_queue_init(&audioqueue);
-    packet_queue_init(&videoqueue);
-    pthread_t th;
-    pthread_create(&th, NULL, fill_queues, NULL);
+        ret = packet_queue_get(&audioqueue, &pkt, 0);
+        if (!ret)
+            break;
+        // every item has been read, the end of the video ends the playout
+        if (ret < 0)
+            break;
 
-    usleep(buffer); // You can add the microseconds you need for pre-buffering before start playing
-    // Start playing
-    StartRunning(videomode);
+        DecodeAudioPacket(&pkt);
+        av_free_packet(&pkt);
+    }
 
-    pthread_mutex_lock(&sleepMutex);
-    pthread_cond_wait(&sleepCond, &sleepMutex);
-    pthread_mutex_unlock(&sleepMutex);
-    fill_me = 0;
-    fprintf(stderr, "Exiting, cleaning up\n");
-    packet_queue_end(&audioqueue);
-    packet_queue_end(&videoqueue);
+    ScheduleAudioBuffer();
+}
 
-bail:
-    if (m_running == true) {
-        StopRunning();
-    } else {
-        // Release any resources that were partially allocated
-        if (m_deckLinkOutput != NULL) {
-            m_deckLinkOutput->Release();
-            m_deckLinkOutput = NULL;
-        }
-        //
-        if (m_deckLink != NULL) {
-            m_deckLink->Release();
-            m_deckLink = NULL;
-        }
-    }
+void Player::WriteGeneratedAudio()
+{
+    uint32_t bufferedSamples;
 
-    if (deckLinkIterator != NULL)
-        deckLinkIterator->Release();
+    // what did not fit the last time goes first
+    ScheduleAudioBuffer();
 
-    return true;
+    while (!m_audioBufferOffset) {
+        m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
+        if (bufferedSamples >= audio_waterlevel)
+            break;
+
+        GenerateAudio(m_audioBufferSampleLength);
+        ScheduleAudioBuffer();
+    }
 }
 
-IDeckLinkDisplayMode *Player::GetDisplayModeByIndex(int selectedIndex)
+/* Tone or silence, following the frames shown at the same time */
+void Player::GenerateAudio(unsigned long samples)
 {
-    // Populate the display mode combo with a list of display modes supported by the installed DeckLink card
-    IDeckLinkDisplayModeIterator *displayModeIterator;
-    IDeckLinkDisplayMode *deckLinkDisplayMode;
-    IDeckLinkDisplayMode *selectedMode = NULL;
-    int index                          = 0;
+    int sample_size = m_audioChannelCount * m_audioSampleDepth / 8;
+    uint8_t *dst    = (uint8_t *)m_audioBuffer;
+    unsigned long i = 0;
 
-    if (m_deckLinkOutput->GetDisplayModeIterator(&displayModeIterator) != S_OK)
-        goto bail;
-    while (displayModeIterator->Next(&deckLinkDisplayMode) == S_OK) {
-        BMDProbeString str;
+    while (i < samples) {
+        int64_t time   = m_audioBufferTime + i;
+        int64_t number = time * m_frameTimescale / (48000 * m_frameDuration);
+        // the first sample of the next frame
+        int64_t end    = ((number + 1) * m_frameDuration * 48000 +
+                          m_frameTimescale - 1) / m_frameTimescale;
+        unsigned long len = samples - i;
+        bool flagged      = !(number % m_framesPerSecond);
+        bool tone;
 
-        if (deckLinkDisplayMode->GetName(&str) == S_OK) {
-            if (index == selectedIndex) {
-                printf("Selected mode: %s\n\n\n", ToStr(str));
-                selectedMode = deckLinkDisplayMode;
-                FreeStr(str);
-                goto bail;
-            }
+        switch (m_outputSignal) {
+        case kOutputSignalPip:
+            tone = flagged;
+            len  = FFMIN(len, end - time);
+            break;
+        case kOutputSignalDrop:
+            tone = !flagged;
+            len  = FFMIN(len, end - time);
+            break;
+        default:
+            tone = signal_pattern != DECKLINK_PATTERN_BLACK;
+            break;
         }
-        index++;
+
+        if (tone)
+            FillSine(dst + i * sample_size, len, m_audioChannelCount,
+                     m_audioSampleDepth, time);
+        else
+            memset(dst + i * sample_size, 0, len * sample_size);
+        i += len;
     }
-bail:
-    displayModeIterator->Release();
-    return selectedMode;
+
+    m_audioBufferOffset = samples;
 }
 
-void Player::StartRunning(int videomode)
+void Player::ReplayCachedAudio()
 {
-    IDeckLinkDisplayMode *videoDisplayMode = NULL;
-    unsigned long audioSamplesPerFrame;
+    int sample_size = m_audioChannelCount * m_audioSampleDepth / 8;
+    int64_t length  = av_rescale(clip_cache.length, 48000, m_frameTimescale);
+    int64_t samples = FFMIN(clip_cache.audio_samples,
+                            length - clip_cache.audio_time);
+    uint32_t bufferedSamples;
 
-    // Get the display mode for 1080i 59.95
-    videoDisplayMode = GetDisplayModeByIndex(videomode);
-
-    if (!videoDisplayMode)
+    // what was decoded before the loop point goes first
+    ScheduleAudioBuffer();
+    if (m_audioBufferOffset || samples <= 0)
         return;
 
-    m_frameWidth  = videoDisplayMode->GetWidth();
-    m_frameHeight = videoDisplayMode->GetHeight();
-    videoDisplayMode->GetFrameRate(&m_frameDuration, &m_frameTimescale);
+    for (;; ) {
+        uint32_t samplesWritten = 0;
+        uint32_t count = FFMIN(samples - m_audioReplayPos,
+                               (int64_t)m_audioBufferSampleLength);
+        BMDTimeValue time = clip_cache.audio_time + m_audioReplayPos +
+                            av_rescale(m_audioReplayPass * clip_cache.length,
+                                       48000, m_frameTimescale);
 
-    // Set the video output mode
-    if (m_deckLinkOutput->EnableVideoOutput(videoDisplayMode->GetDisplayMode(),
-                                            bmdVideoOutputFlagDefault) !=
-        S_OK) {
-        fprintf(stderr, "Failed to enable video output\n");
-        return;
-    }
+        m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
+        if (bufferedSamples >= audio_waterlevel)
+            break;
 
-    // Set the audio output mode
-    if (m_deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
-                                            m_audioSampleDepth,
-                                            audio_st->codec->channels,
-                                            bmdAudioOutputStreamTimestamped) !=
-        S_OK) {
-        fprintf(stderr, "Failed to enable audio output\n");
-        return;
+        if (m_deckLinkOutput->ScheduleAudioSamples(clip_cache.audio +
+                                                   m_audioReplayPos * sample_size,
+                                                   count, time, 48000,
+                                                   &samplesWritten) != S_OK ||
+            !samplesWritten)
+            break;
+
+        m_audioReplayPos += samplesWritten;
+        if (m_audioReplayPos >= samples) {
+            m_audioReplayPos = 0;
+            m_audioReplayPass++;
+        }
     }
+}
 
-    for (unsigned i = 0; i < 10; i++)
-        ScheduleNextFrame(true);
+void Player::DecodeAudioPacket(AVPacket *pkt)
+{
+    AVPacket tmp = *pkt;
+    bool flush   = !pkt->size;  // end of the item, drain the decoder
 
-    // Begin audio preroll.  This will begin calling our audio callback, which will start the DeckLink output stream.
-//    m_audioBufferOffset = 0;
-    if (m_deckLinkOutput->BeginAudioPreroll() != S_OK) {
-        fprintf(stderr, "Failed to begin audio preroll\n");
+    // end of a pass in loop mode
+    if (flush && pkt->stream_index < 0) {
+        m_audioCycleDone = true;
         return;
     }
 
-    m_running = true;
+    if (!m_audioItem) {
+        if (flush)
+            return;
+        m_audioItem = playlist_next(&m_audioNextItem, AVMEDIA_TYPE_AUDIO);
+        if (!m_audioItem)
+            return;
+    }
 
-    return;
-}
+    for (;; ) {
+        int got_frame = 0;
+        int ret;
 
-void Player::StopRunning()
-{
-    // Stop the audio and video output streams immediately
-    m_deckLinkOutput->StopScheduledPlayback(0, NULL, 0);
-    //
-    m_deckLinkOutput->DisableAudioOutput();
-    m_deckLinkOutput->DisableVideoOutput();
+        avcodec_get_frame_defaults(audioframe);
+        ret = avcodec_decode_audio4(m_audioItem->audio_st->codec, audioframe,
+                                    &got_frame, &tmp);
+        if (ret < 0) {
+            fprintf(stderr, "Error decoding audio\n");
+            break;
+        }
 
-    if (m_audioBuffer != NULL)
-        free(m_audioBuffer);
-    m_audioBuffer = NULL;
+        if (got_frame)
+            AppendAudioFrame(audioframe);
+
+        if (flush) {
+            if (!got_frame)
+                break;
+            continue;
+        }
+
+        tmp.data += ret;
+        tmp.size -= ret;
+        tmp.pts   = tmp.dts = AV_NOPTS_VALUE;
+
+        if (tmp.size <= 0)
+            break;
+    }
+
+    if (flush) {
+        avcodec_flush_buffers(m_audioItem->audio_st->codec);
+        m_audioItem = NULL;
+    }
 }
 
-void Player::ScheduleNextFrame(bool prerolling)
+void Player::AppendAudioFrame(AVFrame *frame)
 {
-    AVPacket pkt;
-    AVPicture picture;
+    AVRational out_tb   = { 1, 48000 };
+    int sample_size     = m_audioChannelCount * m_audioSampleDepth / 8;
+    BMDTimeValue next   = m_audioBufferTime + m_audioBufferOffset;
+    BMDTimeValue time   = next;
+    int nb_samples      = frame->nb_samples;
+    int skip            = 0;
+    unsigned long pad   = 0;
+    uint8_t *dst;
 
-    if (packet_queue_get(&videoqueue, &pkt, 1) < 0)
-        return;
+    if (frame->pkt_pts != AV_NOPTS_VALUE)
+        time = av_rescale_q(frame->pkt_pts, m_audioItem->audio_st->time_base,
+                            out_tb);
+    if (live && frame->pkt_pts != AV_NOPTS_VALUE)
+        time += av_rescale(__atomic_load_n(&m_liveOffset, __ATOMIC_RELAXED),
+                           48000, m_frameTimescale);
 
-    IDeckLinkMutableVideoFrame *videoFrame;
-    m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
-                                       m_frameHeight,
-                                       m_frameWidth * 2,
-                                       pix,
-                                       bmdFrameFlagDefault,
-                                       &videoFrame);
-    void *frame;
-    int got_picture;
-    videoFrame->GetBytes(&frame);
-
-    avcodec_decode_video2(video_st->codec, avframe, &got_picture, &pkt);
-    if (got_picture) {
-        avpicture_fill(&picture, (uint8_t *)frame, pix_fmt,
-                       m_frameWidth, m_frameHeight);
-
-        sws_scale(sws, avframe->data, avframe->linesize, 0, avframe->height,
-                  picture.data, picture.linesize);
-
-        if (m_deckLinkOutput->ScheduleVideoFrame(videoFrame,
-                                                 pkt.pts *
-                                                 video_st->time_base.num,
-                                                 pkt.duration *
-                                                 video_st->time_base.num,
-                                                 video_st->time_base.den) !=
-            S_OK)
-            fprintf(stderr, "Error scheduling frame\n");
+    // decoded forward from the seek point, only keep what follows the in point
+    if (!live && frame->pkt_pts != AV_NOPTS_VALUE) {
+        BMDTimeValue in = av_rescale(m_audioItem->start, 48000, AV_TIME_BASE);
+
+        if (time + nb_samples <= in)
+            return;
+        if (time < in) {
+            skip        = in - time;
+            nb_samples -= skip;
+            time        = in;
+        }
     }
-    videoFrame->Release();
-    av_free_packet(&pkt);
+
+    // Start a new block on timestamp discontinuities (over 1ms) or if full
+    if (m_audioBufferOffset &&
+        (llabs(time - next) > 48 ||
+         m_audioBufferOffset + frame->nb_samples > m_audioBufferSampleLength))
+        ScheduleAudioBuffer();
+
+    // The card did not take all of it, what is left has to end where the
+    // frame starts: a gap is filled with silence, an overlap is cut.
+    if (m_audioBufferOffset && llabs(time - next) > 48) {
+        if (time < next) {
+            m_audioBufferOffset = FFMAX(time - m_audioBufferTime, 0);
+        } else if (time - next <= (int64_t)m_audioBufferSampleLength) {
+            pad = time - next;
+        } else {
+            decklink_log_ratelimit(1000, DECKLINK_LOG_WARNING,
+                                   "Audio gap of %d samples, dropping %lu "
+                                   "pending", (int)(time - next),
+                                   m_audioBufferOffset);
+            m_audioBufferOffset = 0;
+        }
+    }
+
+    if (m_audioBufferOffset + pad + frame->nb_samples >
+        m_audioBufferSampleLength) {
+        unsigned long length = m_audioBufferOffset + pad + frame->nb_samples;
+        void *buf            = realloc(m_audioBuffer, length * sample_size);
+
+        if (!buf) {
+            fprintf(stderr, "Cannot grow the audio buffer, dropping audio\n");
+            return;
+        }
+        m_audioBuffer             = buf;
+        m_audioBufferSampleLength = length;
+    }
+
+    if (pad) {
+        memset((uint8_t *)m_audioBuffer + m_audioBufferOffset * sample_size, 0,
+               pad * sample_size);
+        m_audioBufferOffset += pad;
+    }
+
+    if (!m_audioBufferOffset)
+        m_audioBufferTime = time;
+
+    dst = (uint8_t *)m_audioBuffer + m_audioBufferOffset * sample_size;
+    convert_audio(dst, m_audioSampleDepth, m_audioChannelCount,
+                  frame, m_audioItem->audio_st->codec->channels,
+                  m_audioItem->audio_st->codec->sample_fmt);
+    if (skip)
+        memmove(dst, dst + skip * sample_size, nb_samples * sample_size);
+
+    if (!m_audioCycleDone)
+        clip_cache_add_audio(&clip_cache, dst, nb_samples, time,
+                             sample_size);
+
+    m_audioBufferOffset += nb_samples;
 }
 
-void Player::WriteNextAudioSamples()
+void Player::ScheduleAudioBuffer()
 {
     uint32_t samplesWritten = 0;
-    AVPacket pkt            = { 0 };
-    unsigned int bufferedSamples;
-    int got_frame = 0;
-    int i;
-    int bytes_per_sample =
-        av_get_bytes_per_sample(audio_st->codec->sample_fmt) *
-        audio_st->codec->channels;
-
-    m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
+    int sample_size         = m_audioChannelCount * m_audioSampleDepth / 8;
 
-    if (bufferedSamples > kAudioWaterlevel)
+    if (!m_audioBufferOffset)
         return;
 
-    if (!packet_queue_get(&audioqueue, &pkt, 0)) {
-        fprintf(stderr, "I'd quit now \n");
-        pthread_cond_signal(&sleepCond);
-        return;
+    if (m_deckLinkOutput->ScheduleAudioSamples(m_audioBuffer,
+                                               m_audioBufferOffset,
+                                               m_audioBufferTime, 48000,
+                                               &samplesWritten) != S_OK) {
+        decklink_log_ratelimit(1000, DECKLINK_LOG_ERROR,
+                               "error writing audio sample");
+        samplesWritten = m_audioBufferOffset;
     }
 
-    if (m_deckLinkOutput->ScheduleAudioSamples(pkt.data,
-                                               pkt.size / bytes_per_sample,
-                                               pkt.pts, 48000,
-                                               &samplesWritten) != S_OK)
-        fprintf(stderr, "error writing audio sample\n");
+    // The card buffer may be full, keep what did not fit for the next call
+    if (samplesWritten < m_audioBufferOffset)
+        memmove(m_audioBuffer,
+                (uint8_t *)m_audioBuffer + samplesWritten * sample_size,
+                (m_audioBufferOffset - samplesWritten) * sample_size);
 
-    av_free_packet(&pkt);
+    m_audioBufferOffset -= samplesWritten;
+    m_audioBufferTime   += samplesWritten;
 }
 
 /************************* DeckLink API Delegate Methods *****************************/
@@ -785,8 +4266,22 @@ void Player::WriteNextAudioSamples()
 HRESULT Player::ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
                                         BMDOutputFrameCompletionResult result)
 {
-    if (fill_me)
+    if (m_watchdog)
+        decklink_watchdog_kick(m_watchdog);
+
+    m_framesInFlight--;
+
+    if (result != bmdOutputFrameFlushed)
+        UpdatePreroll(result);
+
+    // schedule two frames to grow the preroll, none to shrink it
+    for (int i = 0; i < 2 && fill_me && !m_videoDone &&
+                    m_framesInFlight < m_preroll; i++)
         ScheduleNextFrame(false);
+
+    if (m_videoDone && !m_framesInFlight)
+        pthread_cond_signal(&sleepCond);
+
     return S_OK;
 }
 
@@ -797,12 +4292,25 @@ HRESULT Player::ScheduledPlaybackHasStopped()
 
 HRESULT Player::RenderAudioSamples(bool preroll)
 {
+    // the timestamp is where the samples handed so far end, in 1/48000
+    BMD_PROBE(bmdplay, render_audio, m_totalFramesScheduled,
+              m_audioBufferTime + m_audioBufferOffset, audioqueue.nb_packets);
+    decklink_trace_begin(DECKLINK_TRACE_AUDIO, -1);
     // Provide further audio samples to the DeckLink API until our preferred buffer waterlevel is reached
     WriteNextAudioSamples();
+    decklink_trace_end(DECKLINK_TRACE_AUDIO, -1);
+    BMD_PROBE(bmdplay, render_audio_done, m_totalFramesScheduled,
+              m_audioBufferTime + m_audioBufferOffset, audioqueue.nb_packets);
 
-    if (preroll) {
+    if (preroll && !cue_wait) {
         // Start audio and video output
-        m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
+        StartPlayback();
+    } else if (preroll) {
+        // the cue waits for the audio preroll
+        pthread_mutex_lock(&sleepMutex);
+        m_audioPrerolled = true;
+        pthread_cond_signal(&m_prerollCond);
+        pthread_mutex_unlock(&sleepMutex);
     }
 
     return S_OK;
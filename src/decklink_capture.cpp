@@ -23,15 +23,39 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
 #include <time.h>
 
 #include <DeckLinkAPIDispatch.cpp>
 #include <DeckLinkAPI.h>
 
+// the capture probes carry the card queue, see below
+#define _SDT_HAS_SEMAPHORES 1
+#include "decklink_probe.h"
+
 extern "C" {
 #include "decklink_capture.h"
+#include "decklink_log.h"
+#include "decklink_sched.h"
+#include "decklink_trace.h"
+#include "decklink_watchdog.h"
 }
 
+// the card queue costs a driver call, made only while traced
+BMD_PROBE_SEMAPHORE(libbmd, capture_frame);
+BMD_PROBE_SEMAPHORE(libbmd, capture_frame_done);
+
+/**
+ * Written by the callback thread alone, read as they are by
+ * decklink_capture_stats().
+ */
+typedef struct CaptureCounters {
+    uint64_t frames;
+    uint64_t timed;     // frames with a hardware timestamp
+    int64_t  late_sum;
+    int64_t  late_max;
+} CaptureCounters;
+
 struct DecklinkCapture {
     IDeckLinkIterator            *it;
     IDeckLink                    *dl;
@@ -39,6 +63,9 @@ struct DecklinkCapture {
     IDeckLinkDisplayModeIterator *dm_it;
     IDeckLinkDisplayMode         *dm;
     IDeckLinkConfiguration       *conf;
+
+    DecklinkWatchdog             *wd;
+    CaptureCounters               counters;
 };
 
 class CaptureDelegate : public IDeckLinkInputCallback
@@ -47,7 +74,10 @@ public:
     CaptureDelegate(void *context,
                     int64_t time_base,
                     decklink_video_cb video,
-                    decklink_audio_cb audio);
+                    decklink_audio_cb audio,
+                    DecklinkWatchdog *watchdog,
+                    IDeckLinkInput *input,
+                    CaptureCounters *counters);
     ~CaptureDelegate();
 
     virtual HRESULT STDMETHODCALLTYPE
@@ -65,6 +95,8 @@ public:
                                IDeckLinkAudioInputPacket*);
 
 private:
+    void CountFrame(IDeckLinkVideoInputFrame *v_frame);
+
     ULONG ref_count;
     pthread_mutex_t mutex;
 
@@ -73,15 +105,24 @@ private:
     int64_t timebase;
     decklink_video_cb video_cb;
     decklink_audio_cb audio_cb;
+    DecklinkWatchdog *wd;
+    IDeckLinkInput *in;     // frames waiting and the hardware clock
+    CaptureCounters *counters;
 };
 
 CaptureDelegate::CaptureDelegate(void *context,
                                  int64_t time_base,
                                  decklink_video_cb video,
-                                 decklink_audio_cb audio) : ref_count(0)
+                                 decklink_audio_cb audio,
+                                 DecklinkWatchdog *watchdog,
+                                 IDeckLinkInput *input,
+                                 CaptureCounters *stats) : ref_count(0)
 {
     video_cb = video;
     audio_cb = audio;
+    wd       = watchdog;
+    in       = input;
+    counters = stats;
     timebase = time_base;
     ctx = context;
 
@@ -116,6 +157,30 @@ ULONG CaptureDelegate::Release(void)
     return (ULONG)ref_count;
 }
 
+// how late the callback runs after the card timestamped the frame
+void CaptureDelegate::CountFrame(IDeckLinkVideoInputFrame *v_frame)
+{
+    BMDTimeValue captured, duration, now, in_frame, per_frame;
+    int64_t late;
+
+    __atomic_store_n(&counters->frames, counters->frames + 1,
+                     __ATOMIC_RELAXED);
+
+    if (v_frame->GetHardwareReferenceTimestamp(1000000000LL, &captured,
+                                               &duration) != S_OK ||
+        in->GetHardwareReferenceClock(1000000000LL, &now, &in_frame,
+                                      &per_frame) != S_OK)
+        return;
+
+    late = now - captured;
+    __atomic_store_n(&counters->late_sum, counters->late_sum + late,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&counters->timed, counters->timed + 1,
+                     __ATOMIC_RELAXED);
+    if (late > counters->late_max)
+        __atomic_store_n(&counters->late_max, late, __ATOMIC_RELAXED);
+}
+
 HRESULT
 CaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame  *v_frame,
                                         IDeckLinkAudioInputPacket *a_frame)
@@ -123,22 +188,43 @@ CaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame  *v_frame,
     uint8_t *frame_bytes;
     BMDTimeValue timestamp;
     BMDTimeValue duration;
+#ifdef HAVE_SYS_SDT_H
+    uint32_t queued = 0;
+#endif
 
     // Handle Video Frame
     if (v_frame) {
+        // a frame without signal still tells the callbacks are flowing
+        if (wd)
+            decklink_watchdog_kick(wd);
+
         if (v_frame->GetFlags() & bmdFrameHasNoInputSource) {
-        // log
+            decklink_log_ratelimit(1000, DECKLINK_LOG_WARNING,
+                                   "No input signal");
             return S_OK;
         } else {
+            CountFrame(v_frame);
             v_frame->GetBytes((void **)&frame_bytes);
             v_frame->GetStreamTime(&timestamp, &duration, timebase);
 
+#ifdef HAVE_SYS_SDT_H
+            if (BMD_PROBE_ENABLED(libbmd, capture_frame) ||
+                BMD_PROBE_ENABLED(libbmd, capture_frame_done))
+                in->GetAvailableVideoFrameCount(&queued);
+#endif
+            BMD_PROBE(libbmd, capture_frame, counters->frames - 1, timestamp,
+                      queued);
+            decklink_trace_begin(DECKLINK_TRACE_CAPTURE,
+                                 duration ? timestamp / duration : -1);
             video_cb(ctx, frame_bytes,
                      v_frame->GetWidth(),
                      v_frame->GetHeight(),
                      v_frame->GetRowBytes(),
                      timestamp,
                      duration, 0);
+            decklink_trace_end(DECKLINK_TRACE_CAPTURE, -1);
+            BMD_PROBE(libbmd, capture_frame_done, counters->frames - 1,
+                      timestamp, queued);
         }
     }
 
@@ -191,6 +277,8 @@ void decklink_capture_free(DecklinkCapture *capture)
     if (capture->it)
         capture->it->Release();
 
+    decklink_watchdog_free(capture->wd);
+
     free(capture);
 }
 
@@ -203,6 +291,7 @@ DecklinkCapture *decklink_capture_connect(DecklinkConf *c)
     BMDDisplayMode    display_mode = -1;
     CaptureDelegate   *delegate;
     HRESULT           ret;
+    int               err;
     int               i            = 0;
 
     if (!capture)
@@ -338,8 +427,28 @@ DecklinkCapture *decklink_capture_connect(DecklinkConf *c)
 
     capture->dm->GetFrameRate(&c->tb_num, &c->tb_den);
 
+    if (c->watchdog > 0) {
+        capture->wd = decklink_watchdog_alloc(0, c->tb_num * 1000000000LL /
+                                                 c->tb_den,
+                                              c->watchdog, c->watchdog_dump,
+                                              c->stall_cb, c->priv);
+        if (!capture->wd)
+            goto fail;
+        if ((err = decklink_watchdog_sched(capture->wd, c->sched_policy,
+                                           c->sched_priority, c->cpus)) < 0)
+            decklink_log(DECKLINK_LOG_WARNING,
+                         "Cannot set the watchdog thread scheduling: %s",
+                         strerror(-err));
+    }
+
+    // the card buffers are the driver's, locking is all we can do
+    if (c->lock_memory && (err = decklink_sched_lock_memory()) < 0)
+        decklink_log(DECKLINK_LOG_WARNING, "Cannot lock the memory: %s",
+                     strerror(-err));
+
     delegate = new CaptureDelegate(c->priv, c->tb_den,
-                                   c->video_cb, c->audio_cb);
+                                   c->video_cb, c->audio_cb, capture->wd,
+                                   capture->in, &capture->counters);
 
     if (!delegate)
         goto fail;
@@ -668,10 +777,35 @@ DecklinkCapture *decklink_capture_alloc(DecklinkConf *c)
 
 int decklink_capture_start(DecklinkCapture *capture)
 {
+    if (capture->wd)
+        decklink_watchdog_arm(capture->wd, 1);
+
     return capture->in->StartStreams();
 }
 
 int decklink_capture_stop(DecklinkCapture *capture)
 {
+    if (capture->wd)
+        decklink_watchdog_arm(capture->wd, 0);
+
     return capture->in->StopStreams();
 }
+
+uint64_t decklink_capture_stalls(DecklinkCapture *capture)
+{
+    return capture->wd ? decklink_watchdog_stalls(capture->wd) : 0;
+}
+
+void decklink_capture_stats(DecklinkCapture *capture,
+                            DecklinkCaptureStats *stats)
+{
+    CaptureCounters *c = &capture->counters;
+    uint64_t timed     = __atomic_load_n(&c->timed, __ATOMIC_RELAXED);
+
+    stats->frames        = __atomic_load_n(&c->frames, __ATOMIC_RELAXED);
+    stats->stalls        = decklink_capture_stalls(capture);
+    stats->callback_late = timed ? __atomic_load_n(&c->late_sum,
+                                                   __ATOMIC_RELAXED) /
+                                   (int64_t)timed : 0;
+    stats->callback_max  = __atomic_load_n(&c->late_max, __ATOMIC_RELAXED);
+}
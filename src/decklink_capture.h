@@ -31,6 +31,19 @@ typedef int (*decklink_audio_cb)(void *priv, uint8_t *frame,
                                  int nb_samples,
                                  int64_t timestamp, int64_t flags);
 
+/**
+ * What the watchdog saw, times are in nanoseconds.
+ */
+typedef struct {
+    int      output;    // 0 capture, 1 playback
+    int64_t  elapsed;   // since the last frame callback
+    int64_t  frame;     // the frame duration of the mode
+    uint64_t stalls;    // reported so far, this one included
+    int      recovered; // frames came again after the stall
+} DecklinkStall;
+
+typedef void (*decklink_stall_cb)(void *priv, const DecklinkStall *stall);
+
 /**
  * Main struct assumes you know the video mode you want.
  */
@@ -52,8 +65,39 @@ typedef struct {
     void *priv;
     decklink_video_cb video_cb;
     decklink_audio_cb audio_cb;
+
+    // added after the first release, new fields go at the end
+
+    // playback only, 0 picks a default
+    int preroll;   // frames kept scheduled ahead of the hardware clock
+    int pool_size; // frames that can be submitted in advance
+
+    // playback only, once prerolled wait for decklink_playback_start_at()
+    int hold;
+
+    // frame durations without a frame callback to report a stall, 0 off
+    int watchdog;
+    int watchdog_dump; // log the queues and the last traced events too
+    decklink_stall_cb stall_cb; // optional, from the watchdog thread
+
+    // the threads the library starts, see decklink_sched.h
+    int         sched_policy;   // DecklinkSchedPolicy, 0 leaves them alone
+    int         sched_priority;
+    const char *cpus;           // CPU list as "0,2-3", NULL for any
+    int         lock_memory;    // mlockall() and prefault the frame pool
 } DecklinkConf;
 
+/**
+ * Capture statistics, since the capture was opened.
+ */
+typedef struct {
+    uint64_t frames;        // frames handed to video_cb
+    uint64_t stalls;        // reported by the watchdog
+    int64_t  callback_late; // mean ns from the card timestamp of a frame
+                            // to its callback, the scheduling jitter
+    int64_t  callback_max;  // the worst of them
+} DecklinkCaptureStats;
+
 typedef struct DecklinkCapture DecklinkCapture;
 
 DecklinkCapture *decklink_capture_alloc(DecklinkConf *conf);
@@ -62,6 +106,14 @@ int decklink_capture_start(DecklinkCapture *capture);
 
 int decklink_capture_stop(DecklinkCapture *capture);
 
+/**
+ * Stalls reported by the watchdog since the capture was opened.
+ */
+uint64_t decklink_capture_stalls(DecklinkCapture *capture);
+
+void decklink_capture_stats(DecklinkCapture *capture,
+                            DecklinkCaptureStats *stats);
+
 void decklink_capture_free(DecklinkCapture *);
 
 #endif // DECKLINK_CAPTURE_H
@@ -0,0 +1,544 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "decklink_util.h"
+
+extern "C" {
+#include "decklink_export.h"
+}
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#define EXPORT_BUFFERS 64
+#define EXPORT_READERS 32
+
+// writer to reader, along with the buffer descriptor
+typedef struct {
+    uint32_t buffer;
+    uint32_t size;
+    int32_t  width, height, stride;
+    int32_t  pixel_format;
+    int64_t  timestamp;
+    int64_t  duration;
+    uint64_t sequence;
+} ExportMessage;
+
+// reader to writer
+typedef struct {
+    uint32_t buffer;
+} ExportRelease;
+
+typedef struct {
+    int      fd;
+    int      ro_fd;   // what the readers get
+    uint8_t *data;
+    int      refs;    // readers holding it, plus the writer filling it
+} ExportBuffer;
+
+typedef struct {
+    int      sock;
+    uint64_t held;    // mask of the buffers it holds
+    int      nb_held;
+} ExportClient;
+
+struct DecklinkExport {
+    ExportBuffer    buffers[EXPORT_BUFFERS];
+    int             nb_buffers;
+    int             buffer_size;
+    int             next_buffer;
+    int             max_held;
+    char           *path;
+
+    int             listen_fd;
+    int             stop_fd;
+    pthread_t       server;
+    bool            serving;
+
+    pthread_mutex_t mutex;
+    ExportClient    clients[EXPORT_READERS];
+    int             nb_clients;
+
+    DecklinkExportStats stats;
+};
+
+struct DecklinkExportReader {
+    int      sock;
+    uint8_t *maps[EXPORT_BUFFERS];
+    size_t   sizes[EXPORT_BUFFERS];
+};
+
+static void release_buffer(DecklinkExport *exp, ExportClient *client, int i)
+{
+    uint64_t bit = 1ULL << i;
+
+    if (!(client->held & bit))
+        return;
+
+    client->held &= ~bit;
+    client->nb_held--;
+    exp->buffers[i].refs--;
+}
+
+static void drop_client(DecklinkExport *exp, int i)
+{
+    ExportClient *client = &exp->clients[i];
+    int j;
+
+    pthread_mutex_lock(&exp->mutex);
+    for (j = 0; j < exp->nb_buffers; j++)
+        release_buffer(exp, client, j);
+    close(client->sock);
+    exp->nb_clients--;
+    *client = exp->clients[exp->nb_clients];
+    pthread_mutex_unlock(&exp->mutex);
+}
+
+static int read_release(DecklinkExport *exp, int i)
+{
+    ExportRelease rel;
+
+    if (recv(exp->clients[i].sock, &rel, sizeof(rel), MSG_DONTWAIT) !=
+        sizeof(rel))
+        return -1;
+
+    pthread_mutex_lock(&exp->mutex);
+    if (rel.buffer < (uint32_t)exp->nb_buffers)
+        release_buffer(exp, &exp->clients[i], rel.buffer);
+    pthread_mutex_unlock(&exp->mutex);
+
+    return 0;
+}
+
+static void add_client(DecklinkExport *exp)
+{
+    int sock = accept4(exp->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (sock < 0)
+        return;
+
+    pthread_mutex_lock(&exp->mutex);
+    if (exp->nb_clients == EXPORT_READERS) {
+        pthread_mutex_unlock(&exp->mutex);
+        close(sock);
+        return;
+    }
+    exp->clients[exp->nb_clients].sock    = sock;
+    exp->clients[exp->nb_clients].held    = 0;
+    exp->clients[exp->nb_clients].nb_held = 0;
+    exp->nb_clients++;
+    pthread_mutex_unlock(&exp->mutex);
+}
+
+/**
+ * Only this thread changes the client list, the lock keeps
+ * decklink_export_publish() from sending on a closed socket.
+ */
+static void *server_thread(void *priv)
+{
+    DecklinkExport *exp = (DecklinkExport *)priv;
+    struct pollfd fds[EXPORT_READERS + 2];
+    int i, nb;
+
+    for (;;) {
+        fds[0].fd     = exp->stop_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd     = exp->listen_fd;
+        fds[1].events = POLLIN;
+        nb = exp->nb_clients;
+        for (i = 0; i < nb; i++) {
+            fds[i + 2].fd     = exp->clients[i].sock;
+            fds[i + 2].events = POLLIN;
+        }
+
+        if (poll(fds, nb + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents)
+            break;
+
+        for (i = nb - 1; i >= 0; i--)
+            if (fds[i + 2].revents && read_release(exp, i) < 0)
+                drop_client(exp, i);
+
+        if (fds[1].revents & POLLIN)
+            add_client(exp);
+    }
+
+    return NULL;
+}
+
+static int open_buffer(ExportBuffer *buf, int size)
+{
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+    char proc[64];
+
+    buf->fd = memfd_create("libbmd-export", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (buf->fd < 0)
+        return -1;
+
+    if (ftruncate(buf->fd, size) < 0 ||
+        fcntl(buf->fd, F_ADD_SEALS, seals) < 0)
+        return -1;
+
+    buf->data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, buf->fd, 0);
+    if (buf->data == MAP_FAILED) {
+        buf->data = NULL;
+        return -1;
+    }
+
+    // past this mapping nobody gets to write, a reader reopening the fd
+    // through /proc included. Older kernels cannot, see the header.
+    if (fcntl(buf->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0 &&
+        errno != EINVAL)
+        return -1;
+    if (fcntl(buf->fd, F_ADD_SEALS, F_SEAL_SEAL) < 0)
+        return -1;
+
+    // the readers get a descriptor opened read-only
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", buf->fd);
+    buf->ro_fd = open(proc, O_RDONLY | O_CLOEXEC);
+    if (buf->ro_fd < 0)
+        return -1;
+
+    return 0;
+}
+
+DecklinkExport *decklink_export_alloc(const char *path, int nb_buffers,
+                                      int buffer_size, int max_held)
+{
+    DecklinkExport *exp;
+    struct sockaddr_un addr;
+    int i;
+
+    if (nb_buffers < 2 || nb_buffers > EXPORT_BUFFERS ||
+        buffer_size <= 0 || max_held < 1 ||
+        strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+
+    exp = (DecklinkExport *)calloc(1, sizeof(*exp));
+    if (!exp)
+        return NULL;
+
+    exp->listen_fd = -1;
+    exp->stop_fd   = -1;
+    for (i = 0; i < EXPORT_BUFFERS; i++)
+        exp->buffers[i].fd = exp->buffers[i].ro_fd = -1;
+    pthread_mutex_init(&exp->mutex, NULL);
+
+    exp->nb_buffers  = nb_buffers;
+    exp->buffer_size = buffer_size;
+    exp->max_held    = max_held;
+
+    for (i = 0; i < nb_buffers; i++)
+        if (open_buffer(&exp->buffers[i], buffer_size) < 0)
+            goto fail;
+
+    exp->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (exp->stop_fd < 0)
+        goto fail;
+
+    exp->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (exp->listen_fd < 0)
+        goto fail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(exp->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    exp->path = strdup(path);
+
+    if (listen(exp->listen_fd, EXPORT_READERS) < 0)
+        goto fail;
+
+    if (pthread_create(&exp->server, NULL, server_thread, exp))
+        goto fail;
+    exp->serving = true;
+
+    return exp;
+fail:
+    decklink_export_free(exp);
+    return NULL;
+}
+
+int decklink_export_publish(DecklinkExport *exp, const uint8_t *frame,
+                            int width, int height, int stride,
+                            int pixel_format,
+                            int64_t timestamp, int64_t duration)
+{
+    ExportBuffer *buf = NULL;
+    ExportMessage msg;
+    int size = stride * height;
+    int i, b;
+
+    if (size > exp->buffer_size)
+        return -1;
+
+    pthread_mutex_lock(&exp->mutex);
+    for (i = 0; i < exp->nb_buffers; i++) {
+        b = (exp->next_buffer + i) % exp->nb_buffers;
+        if (!exp->buffers[b].refs) {
+            buf = &exp->buffers[b];
+            break;
+        }
+    }
+    if (!buf) {
+        exp->stats.no_buffer++;
+        pthread_mutex_unlock(&exp->mutex);
+        return -1;
+    }
+    buf->refs = 1;
+    exp->next_buffer = (b + 1) % exp->nb_buffers;
+    pthread_mutex_unlock(&exp->mutex);
+
+    memcpy(buf->data, frame, size);
+
+    msg.buffer       = b;
+    msg.size         = size;
+    msg.width        = width;
+    msg.height       = height;
+    msg.stride       = stride;
+    msg.pixel_format = pixel_format;
+    msg.timestamp    = timestamp;
+    msg.duration     = duration;
+
+    pthread_mutex_lock(&exp->mutex);
+    msg.sequence = exp->stats.published++;
+    for (i = 0; i < exp->nb_clients; i++) {
+        ExportClient *client = &exp->clients[i];
+
+        if (client->nb_held >= exp->max_held ||
+            decklink_send_fd(client->sock, &msg, sizeof(msg), buf->ro_fd,
+                             MSG_DONTWAIT) != sizeof(msg)) {
+            exp->stats.skipped++;
+            continue;
+        }
+
+        client->held |= 1ULL << b;
+        client->nb_held++;
+        buf->refs++;
+        exp->stats.sent++;
+    }
+    buf->refs--;
+    pthread_mutex_unlock(&exp->mutex);
+
+    return 0;
+}
+
+void decklink_export_stats(DecklinkExport *exp, DecklinkExportStats *stats)
+{
+    pthread_mutex_lock(&exp->mutex);
+    *stats         = exp->stats;
+    stats->readers = exp->nb_clients;
+    pthread_mutex_unlock(&exp->mutex);
+}
+
+void decklink_export_free(DecklinkExport *exp)
+{
+    uint64_t one = 1;
+    int i;
+
+    if (!exp)
+        return;
+
+    if (exp->serving) {
+        if (write(exp->stop_fd, &one, sizeof(one)) == sizeof(one))
+            pthread_join(exp->server, NULL);
+    }
+
+    for (i = 0; i < exp->nb_clients; i++)
+        close(exp->clients[i].sock);
+
+    if (exp->path) {
+        unlink(exp->path);
+        free(exp->path);
+    }
+    if (exp->listen_fd >= 0)
+        close(exp->listen_fd);
+    if (exp->stop_fd >= 0)
+        close(exp->stop_fd);
+
+    for (i = 0; i < EXPORT_BUFFERS; i++) {
+        ExportBuffer *buf = &exp->buffers[i];
+
+        if (buf->data)
+            munmap(buf->data, exp->buffer_size);
+        if (buf->ro_fd >= 0)
+            close(buf->ro_fd);
+        if (buf->fd >= 0)
+            close(buf->fd);
+    }
+
+    pthread_mutex_destroy(&exp->mutex);
+    free(exp);
+}
+
+DecklinkExportReader *decklink_export_connect(const char *path)
+{
+    DecklinkExportReader *reader;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+
+    reader = (DecklinkExportReader *)calloc(1, sizeof(*reader));
+    if (!reader)
+        return NULL;
+
+    reader->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (reader->sock < 0)
+        goto fail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(reader->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    return reader;
+fail:
+    decklink_export_disconnect(reader);
+    return NULL;
+}
+
+/**
+ * The buffers are the same for the whole session, each is mapped the
+ * first time it comes and the descriptors sent later are just closed.
+ */
+static uint8_t *map_buffer(DecklinkExportReader *reader, int b, int fd)
+{
+    struct stat st;
+    void *data;
+
+    if (reader->maps[b]) {
+        close(fd);
+        return reader->maps[b];
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    reader->maps[b]  = (uint8_t *)data;
+    reader->sizes[b] = st.st_size;
+
+    return reader->maps[b];
+}
+
+int decklink_export_next(DecklinkExportReader *reader,
+                         DecklinkExportFrame *frame, int timeout)
+{
+    struct pollfd pfd = { reader->sock, POLLIN, 0 };
+    ExportMessage msg;
+    ssize_t ret;
+    int fd;
+
+    switch (poll(&pfd, 1, timeout)) {
+    case 0:
+        return 0;
+    case -1:
+        return errno == EINTR ? 0 : -1;
+    }
+
+    ret = decklink_recv_fd(reader->sock, &msg, sizeof(msg), &fd, 0);
+    if (ret != sizeof(msg) || fd < 0 || msg.buffer >= EXPORT_BUFFERS) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    frame->data = map_buffer(reader, msg.buffer, fd);
+    if (!frame->data || msg.size > reader->sizes[msg.buffer])
+        return -1;
+
+    frame->size         = msg.size;
+    frame->width        = msg.width;
+    frame->height       = msg.height;
+    frame->stride       = msg.stride;
+    frame->pixel_format = msg.pixel_format;
+    frame->timestamp    = msg.timestamp;
+    frame->duration     = msg.duration;
+    frame->sequence     = msg.sequence;
+    frame->buffer       = msg.buffer;
+
+    return 1;
+}
+
+int decklink_export_release(DecklinkExportReader *reader,
+                            const DecklinkExportFrame *frame)
+{
+    ExportRelease rel = { (uint32_t)frame->buffer };
+
+    if (send(reader->sock, &rel, sizeof(rel), MSG_NOSIGNAL) != sizeof(rel))
+        return -1;
+
+    return 0;
+}
+
+int decklink_export_fd(DecklinkExportReader *reader)
+{
+    return reader->sock;
+}
+
+void decklink_export_disconnect(DecklinkExportReader *reader)
+{
+    int i;
+
+    if (!reader)
+        return;
+
+    for (i = 0; i < EXPORT_BUFFERS; i++)
+        if (reader->maps[i])
+            munmap(reader->maps[i], reader->sizes[i]);
+    if (reader->sock >= 0)
+        close(reader->sock);
+    free(reader);
+}
@@ -0,0 +1,99 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_EXPORT_H
+#define DECKLINK_EXPORT_H
+
+#include <stdint.h>
+
+/**
+ * Hand out the frames to other processes over a unix socket.
+ *
+ * Every frame is copied once in one of nb_buffers sealed memfds, each
+ * reader gets a read-only descriptor for it along with the frame
+ * timestamp and geometry, maps it and hands it back once done. A
+ * buffer is reused only when every reader released it. The writer
+ * never waits: a reader whose socket is full or holding max_held
+ * frames misses the frame, and a frame is dropped if every buffer is
+ * still held.
+ *
+ * The memfds are sealed against any write but the writer's own mapping,
+ * from Linux 5.1 on. Older kernels cannot seal them that way, there the
+ * readers are trusted not to reopen them for writing.
+ */
+typedef struct DecklinkExport DecklinkExport;
+typedef struct DecklinkExportReader DecklinkExportReader;
+
+typedef struct {
+    const uint8_t *data;  // read-only, valid until released
+    int      size;
+    int      width, height, stride;
+    int      pixel_format;  // as in DecklinkConf
+    int64_t  timestamp;
+    int64_t  duration;
+    uint64_t sequence;    // frames published before this one
+    int      buffer;
+} DecklinkExportFrame;
+
+typedef struct {
+    uint64_t published;   // frames copied in a buffer
+    uint64_t sent;        // frames handed to a reader
+    uint64_t skipped;     // frames a reader missed
+    uint64_t no_buffer;   // frames dropped, every buffer held
+    int      readers;
+} DecklinkExportStats;
+
+/**
+ * nb_buffers is at most 64.
+ */
+DecklinkExport *decklink_export_alloc(const char *path, int nb_buffers,
+                                      int buffer_size, int max_held);
+
+int decklink_export_publish(DecklinkExport *exp, const uint8_t *frame,
+                            int width, int height, int stride,
+                            int pixel_format,
+                            int64_t timestamp, int64_t duration);
+
+void decklink_export_stats(DecklinkExport *exp, DecklinkExportStats *stats);
+
+void decklink_export_free(DecklinkExport *exp);
+
+DecklinkExportReader *decklink_export_connect(const char *path);
+
+/**
+ * Wait up to timeout milliseconds for the next frame, -1 waits forever.
+ *
+ * Return 1 with frame filled, 0 on timeout and a negative value on
+ * error or once the writer went away.
+ */
+int decklink_export_next(DecklinkExportReader *reader,
+                         DecklinkExportFrame *frame, int timeout);
+
+int decklink_export_release(DecklinkExportReader *reader,
+                            const DecklinkExportFrame *frame);
+
+/**
+ * The socket the frames come from, to poll along other sources.
+ */
+int decklink_export_fd(DecklinkExportReader *reader);
+
+void decklink_export_disconnect(DecklinkExportReader *reader);
+
+#endif // DECKLINK_EXPORT_H
@@ -0,0 +1,558 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "decklink_util.h"
+
+extern "C" {
+#include "decklink_framebus.h"
+}
+
+#define FRAMEBUS_MAGIC   0x6c626d64 // "lbmd"
+#define FRAMEBUS_VERSION 1
+#define FRAMEBUS_ALIGN   4096
+#define FRAMEBUS_READERS 32
+
+// Linux 5.1, keeps the existing writable mapping of the writer only
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/**
+ * Shared layout: the header, nb_slots slot descriptors and, from
+ * data_offset, nb_slots buffers of slot_size bytes.
+ *
+ * Frame n goes in slot n % nb_slots, its seq is 2n + 1 while the
+ * frame is copied and 2n + 2 once complete, so a reader can tell
+ * whether the slot still holds the frame it looked at.
+ */
+typedef struct {
+    uint64_t seq;
+    int64_t  timestamp;
+    int64_t  duration;
+    int32_t  width, height, stride;
+    int32_t  pixel_format;
+    uint32_t size;
+    uint32_t reserved[3];
+} FramebusSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_slots;
+    uint32_t slot_size;
+    uint64_t data_offset;
+    uint64_t written;   // frames published so far
+} FramebusHeader;
+
+struct DecklinkFramebus {
+    int             memfd;
+    FramebusHeader *hdr;
+    size_t          map_size;
+    char           *path;
+
+    int             listen_fd;
+    int             stop_fd;
+    pthread_t       server;
+    bool            serving;
+
+    pthread_mutex_t mutex;
+    int             conn[FRAMEBUS_READERS];   // reader sockets
+    int             notify[FRAMEBUS_READERS]; // their eventfds
+    int             nb_readers;
+
+    // accepted, their eventfd did not come yet, server thread only
+    int             pending[FRAMEBUS_READERS];
+    int             nb_pending;
+};
+
+struct DecklinkFramebusReader {
+    int             sock;
+    int             efd;
+    FramebusHeader *hdr;
+    size_t          map_size;
+    uint64_t        next;
+};
+
+static FramebusSlot *get_slot(FramebusHeader *hdr, uint64_t n)
+{
+    return (FramebusSlot *)(hdr + 1) + n % hdr->nb_slots;
+}
+
+static uint8_t *get_data(FramebusHeader *hdr, uint64_t n)
+{
+    return (uint8_t *)hdr + hdr->data_offset +
+           (n % hdr->nb_slots) * hdr->slot_size;
+}
+
+static void signal_fd(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+static void drop_reader(DecklinkFramebus *bus, int i)
+{
+    pthread_mutex_lock(&bus->mutex);
+    close(bus->conn[i]);
+    close(bus->notify[i]);
+    bus->nb_readers--;
+    bus->conn[i]   = bus->conn[bus->nb_readers];
+    bus->notify[i] = bus->notify[bus->nb_readers];
+    pthread_mutex_unlock(&bus->mutex);
+}
+
+/* The sockets are nonblocking, a client that connects and sends
+ * nothing waits in the pending list without holding anybody up. */
+static void accept_reader(DecklinkFramebus *bus)
+{
+    int sock = accept4(bus->listen_fd, NULL, NULL,
+                       SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+    if (sock < 0)
+        return;
+
+    if (bus->nb_pending == FRAMEBUS_READERS) {
+        close(sock);
+        return;
+    }
+
+    bus->pending[bus->nb_pending++] = sock;
+}
+
+static void add_reader(DecklinkFramebus *bus, int i)
+{
+    int sock = bus->pending[i];
+    int efd;
+    char c = 0;
+
+    bus->pending[i] = bus->pending[--bus->nb_pending];
+
+    // the reader sends its eventfd first, gets the ring back
+    if (decklink_recv_fd(sock, &c, 1, &efd, 0) != 1 || efd < 0 ||
+        bus->nb_readers == FRAMEBUS_READERS ||
+        fcntl(efd, F_SETFL, O_NONBLOCK) < 0 ||
+        decklink_send_fd(sock, &c, 1, bus->memfd, 0) != 1) {
+        if (efd >= 0)
+            close(efd);
+        close(sock);
+        return;
+    }
+
+    pthread_mutex_lock(&bus->mutex);
+    bus->conn[bus->nb_readers]   = sock;
+    bus->notify[bus->nb_readers] = efd;
+    bus->nb_readers++;
+    pthread_mutex_unlock(&bus->mutex);
+}
+
+/**
+ * Only this thread changes the reader list, the lock keeps
+ * decklink_framebus_publish() from signalling a closed eventfd.
+ */
+static void *server_thread(void *priv)
+{
+    DecklinkFramebus *bus = (DecklinkFramebus *)priv;
+    struct pollfd fds[2 * FRAMEBUS_READERS + 2];
+    int i, nb, nb_pending;
+
+    for (;;) {
+        fds[0].fd     = bus->stop_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd     = bus->listen_fd;
+        fds[1].events = POLLIN;
+        nb = bus->nb_readers;
+        for (i = 0; i < nb; i++) {
+            fds[i + 2].fd     = bus->conn[i];
+            fds[i + 2].events = POLLIN;
+        }
+        nb_pending = bus->nb_pending;
+        for (i = 0; i < nb_pending; i++) {
+            fds[nb + i + 2].fd     = bus->pending[i];
+            fds[nb + i + 2].events = POLLIN;
+        }
+
+        if (poll(fds, nb + nb_pending + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents)
+            break;
+
+        // readers never write after the handshake, anything is a hangup
+        for (i = nb - 1; i >= 0; i--)
+            if (fds[i + 2].revents)
+                drop_reader(bus, i);
+
+        // backwards, add_reader() moves the last pending one to i
+        for (i = nb_pending - 1; i >= 0; i--)
+            if (fds[nb + i + 2].revents)
+                add_reader(bus, i);
+
+        if (fds[1].revents & POLLIN)
+            accept_reader(bus);
+    }
+
+    return NULL;
+}
+
+DecklinkFramebus *decklink_framebus_alloc(const char *path,
+                                          int nb_slots, int slot_size)
+{
+    DecklinkFramebus *bus;
+    struct sockaddr_un addr;
+    size_t offset;
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+    if (nb_slots < 2 || slot_size <= 0 ||
+        strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+
+    bus = (DecklinkFramebus *)calloc(1, sizeof(*bus));
+    if (!bus)
+        return NULL;
+
+    bus->memfd     = -1;
+    bus->listen_fd = -1;
+    bus->stop_fd   = -1;
+    pthread_mutex_init(&bus->mutex, NULL);
+
+    slot_size = (slot_size + 63) & ~63;
+    offset = sizeof(FramebusHeader) + nb_slots * sizeof(FramebusSlot);
+    offset = (offset + FRAMEBUS_ALIGN - 1) & ~(size_t)(FRAMEBUS_ALIGN - 1);
+    bus->map_size = offset + (size_t)nb_slots * slot_size;
+
+    bus->memfd = memfd_create("libbmd-framebus",
+                              MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (bus->memfd < 0)
+        goto fail;
+
+    // readers can trust the size they map
+    if (ftruncate(bus->memfd, bus->map_size) < 0 ||
+        fcntl(bus->memfd, F_ADD_SEALS, seals) < 0)
+        goto fail;
+
+    bus->hdr = (FramebusHeader *)mmap(NULL, bus->map_size,
+                                      PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      bus->memfd, 0);
+    if (bus->hdr == MAP_FAILED) {
+        bus->hdr = NULL;
+        goto fail;
+    }
+
+    // past this mapping nobody gets to write, a reader reopening the fd
+    // through /proc included. Older kernels cannot, see the header.
+    if (fcntl(bus->memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0 &&
+        errno != EINVAL)
+        goto fail;
+    if (fcntl(bus->memfd, F_ADD_SEALS, F_SEAL_SEAL) < 0)
+        goto fail;
+
+    bus->hdr->nb_slots    = nb_slots;
+    bus->hdr->slot_size   = slot_size;
+    bus->hdr->data_offset = offset;
+    bus->hdr->version     = FRAMEBUS_VERSION;
+    __atomic_store_n(&bus->hdr->magic, FRAMEBUS_MAGIC, __ATOMIC_RELEASE);
+
+    bus->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (bus->stop_fd < 0)
+        goto fail;
+
+    bus->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (bus->listen_fd < 0)
+        goto fail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(bus->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    bus->path = strdup(path);
+
+    if (listen(bus->listen_fd, FRAMEBUS_READERS) < 0)
+        goto fail;
+
+    if (pthread_create(&bus->server, NULL, server_thread, bus))
+        goto fail;
+    bus->serving = true;
+
+    return bus;
+fail:
+    decklink_framebus_free(bus);
+    return NULL;
+}
+
+int decklink_framebus_publish(DecklinkFramebus *bus, const uint8_t *frame,
+                              int width, int height, int stride,
+                              int pixel_format,
+                              int64_t timestamp, int64_t duration)
+{
+    FramebusHeader *hdr = bus->hdr;
+    uint64_t n = hdr->written;
+    FramebusSlot *slot = get_slot(hdr, n);
+    size_t size = (size_t)stride * height;
+    int i;
+
+    if (size > hdr->slot_size)
+        return -1;
+
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(get_data(hdr, n), frame, size);
+    slot->timestamp    = timestamp;
+    slot->duration     = duration;
+    slot->width        = width;
+    slot->height       = height;
+    slot->stride       = stride;
+    slot->pixel_format = pixel_format;
+    slot->size         = size;
+
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->written, n + 1, __ATOMIC_RELEASE);
+
+    // the eventfds are nonblocking, a reader asleep only piles up counts
+    pthread_mutex_lock(&bus->mutex);
+    for (i = 0; i < bus->nb_readers; i++)
+        signal_fd(bus->notify[i]);
+    pthread_mutex_unlock(&bus->mutex);
+
+    return 0;
+}
+
+int decklink_framebus_readers(DecklinkFramebus *bus)
+{
+    int nb;
+
+    pthread_mutex_lock(&bus->mutex);
+    nb = bus->nb_readers;
+    pthread_mutex_unlock(&bus->mutex);
+
+    return nb;
+}
+
+void decklink_framebus_free(DecklinkFramebus *bus)
+{
+    int i;
+
+    if (!bus)
+        return;
+
+    if (bus->serving) {
+        signal_fd(bus->stop_fd);
+        pthread_join(bus->server, NULL);
+    }
+
+    for (i = 0; i < bus->nb_readers; i++) {
+        close(bus->conn[i]);
+        close(bus->notify[i]);
+    }
+    for (i = 0; i < bus->nb_pending; i++)
+        close(bus->pending[i]);
+
+    if (bus->path) {
+        unlink(bus->path);
+        free(bus->path);
+    }
+    if (bus->listen_fd >= 0)
+        close(bus->listen_fd);
+    if (bus->stop_fd >= 0)
+        close(bus->stop_fd);
+    if (bus->hdr)
+        munmap(bus->hdr, bus->map_size);
+    if (bus->memfd >= 0)
+        close(bus->memfd);
+
+    pthread_mutex_destroy(&bus->mutex);
+    free(bus);
+}
+
+DecklinkFramebusReader *decklink_framebus_attach(const char *path)
+{
+    DecklinkFramebusReader *reader;
+    struct sockaddr_un addr;
+    struct stat st;
+    FramebusHeader *hdr;
+    int memfd = -1;
+    char c = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+
+    reader = (DecklinkFramebusReader *)calloc(1, sizeof(*reader));
+    if (!reader)
+        return NULL;
+
+    reader->sock = -1;
+    reader->efd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reader->efd < 0)
+        goto fail;
+
+    reader->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (reader->sock < 0)
+        goto fail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(reader->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        decklink_send_fd(reader->sock, &c, 1, reader->efd, 0) != 1 ||
+        decklink_recv_fd(reader->sock, &c, 1, &memfd, 0) != 1)
+        goto fail;
+
+    if (memfd < 0 || fstat(memfd, &st) < 0 ||
+        st.st_size < (off_t)sizeof(FramebusHeader))
+        goto fail;
+
+    reader->map_size = st.st_size;
+    hdr = (FramebusHeader *)mmap(NULL, reader->map_size, PROT_READ,
+                                 MAP_SHARED, memfd, 0);
+    close(memfd);
+    memfd = -1;
+    if (hdr == MAP_FAILED)
+        goto fail;
+    reader->hdr = hdr;
+
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != FRAMEBUS_MAGIC ||
+        hdr->version != FRAMEBUS_VERSION ||
+        hdr->data_offset + (uint64_t)hdr->nb_slots * hdr->slot_size >
+        reader->map_size)
+        goto fail;
+
+    reader->next = __atomic_load_n(&hdr->written, __ATOMIC_ACQUIRE);
+
+    return reader;
+fail:
+    if (memfd >= 0)
+        close(memfd);
+    decklink_framebus_detach(reader);
+    return NULL;
+}
+
+int decklink_framebus_next(DecklinkFramebusReader *reader,
+                           DecklinkFramebusFrame *frame, int timeout)
+{
+    FramebusHeader *hdr = reader->hdr;
+    FramebusSlot *slot;
+    uint64_t written, n, seq, count;
+    struct pollfd fd = { reader->efd, POLLIN, 0 };
+
+    for (;;) {
+        written = __atomic_load_n(&hdr->written, __ATOMIC_ACQUIRE);
+
+        if (written <= reader->next) {
+            // the count is only a wakeup, the ring tells what is new
+            if (read(reader->efd, &count, sizeof(count)) == sizeof(count))
+                continue;
+            if (!timeout)
+                return 0;
+            switch (poll(&fd, 1, timeout)) {
+            case 0:
+                return 0;
+            case -1:
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            continue;
+        }
+
+        // too far behind, what is left will be overwritten soon
+        n = reader->next;
+        if (written - n >= hdr->nb_slots)
+            n = written - 1;
+
+        // overwritten meanwhile, the writer is nb_slots ahead by now
+        slot = get_slot(hdr, n);
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != 2 * n + 2)
+            continue;
+
+        frame->data         = get_data(hdr, n);
+        frame->size         = slot->size;
+        frame->width        = slot->width;
+        frame->height       = slot->height;
+        frame->stride       = slot->stride;
+        frame->pixel_format = slot->pixel_format;
+        frame->timestamp    = slot->timestamp;
+        frame->duration     = slot->duration;
+        frame->sequence     = n;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+            (uint32_t)frame->size > hdr->slot_size)
+            continue;
+
+        frame->dropped = n - reader->next;
+        reader->next   = n + 1;
+
+        return 1;
+    }
+}
+
+int decklink_framebus_valid(DecklinkFramebusReader *reader,
+                            const DecklinkFramebusFrame *frame)
+{
+    FramebusSlot *slot = get_slot(reader->hdr, frame->sequence);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) ==
+           2 * frame->sequence + 2;
+}
+
+int decklink_framebus_fd(DecklinkFramebusReader *reader)
+{
+    return reader->efd;
+}
+
+void decklink_framebus_detach(DecklinkFramebusReader *reader)
+{
+    if (!reader)
+        return;
+
+    if (reader->hdr)
+        munmap(reader->hdr, reader->map_size);
+    if (reader->sock >= 0)
+        close(reader->sock);
+    if (reader->efd >= 0)
+        close(reader->efd);
+    free(reader);
+}
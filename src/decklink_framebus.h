@@ -0,0 +1,95 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_FRAMEBUS_H
+#define DECKLINK_FRAMEBUS_H
+
+#include <stdint.h>
+
+/**
+ * A ring of frames in shared memory for local consumers.
+ *
+ * The writer copies every frame once in a sealed memfd, readers in
+ * other processes map it read-only and look at the frames in place.
+ * Readers attach through a unix socket at path, handing over an
+ * eventfd the writer signals on every frame. The writer never waits
+ * for the readers: one falling more than nb_slots - 1 frames behind
+ * skips to the newest frame and is told how many it lost.
+ *
+ * The memfd is sealed against any write but the writer's own mapping,
+ * from Linux 5.1 on. Older kernels cannot seal it that way, there the
+ * readers are trusted not to reopen it for writing.
+ */
+typedef struct DecklinkFramebus DecklinkFramebus;
+typedef struct DecklinkFramebusReader DecklinkFramebusReader;
+
+typedef struct {
+    const uint8_t *data;  // in the shared mapping, read-only
+    int      size;
+    int      width, height, stride;
+    int      pixel_format;  // as in DecklinkConf
+    int64_t  timestamp;
+    int64_t  duration;
+    uint64_t sequence;    // frames published on the bus before this one
+    uint64_t dropped;     // frames skipped since the previous read
+} DecklinkFramebusFrame;
+
+/**
+ * Create a bus of nb_slots frames of up to slot_size bytes each and
+ * accept the readers on the unix socket at path.
+ */
+DecklinkFramebus *decklink_framebus_alloc(const char *path,
+                                          int nb_slots, int slot_size);
+
+/**
+ * Copy a frame in the oldest slot and wake up the readers.
+ */
+int decklink_framebus_publish(DecklinkFramebus *bus, const uint8_t *frame,
+                              int width, int height, int stride,
+                              int pixel_format,
+                              int64_t timestamp, int64_t duration);
+
+int decklink_framebus_readers(DecklinkFramebus *bus);
+
+void decklink_framebus_free(DecklinkFramebus *bus);
+
+DecklinkFramebusReader *decklink_framebus_attach(const char *path);
+
+/**
+ * Wait up to timeout milliseconds for the next frame, -1 waits forever.
+ *
+ * Return 1 with frame filled, 0 on timeout and a negative value on
+ * error. The frame data stays in place until the writer comes back to
+ * its slot, decklink_framebus_valid() tells whether it still did not.
+ */
+int decklink_framebus_next(DecklinkFramebusReader *reader,
+                           DecklinkFramebusFrame *frame, int timeout);
+
+int decklink_framebus_valid(DecklinkFramebusReader *reader,
+                            const DecklinkFramebusFrame *frame);
+
+/**
+ * The eventfd signalled on new frames, to poll along other sources.
+ */
+int decklink_framebus_fd(DecklinkFramebusReader *reader);
+
+void decklink_framebus_detach(DecklinkFramebusReader *reader);
+
+#endif // DECKLINK_FRAMEBUS_H
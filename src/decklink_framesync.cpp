@@ -0,0 +1,528 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <DeckLinkAPI.h>
+
+#include "decklink_util.h"
+
+extern "C" {
+#include "decklink_framesync.h"
+}
+
+// input frames held at most, past it the oldest are dropped
+#define SYNC_QUEUE 4
+
+class SyncDelegate;
+
+struct DecklinkFrameSync {
+    IDeckLink                *in_dl;
+    IDeckLink                *out_dl;
+    IDeckLinkInput           *in;
+    IDeckLinkOutput          *out;
+    IDeckLinkDisplayMode     *in_dm;
+    IDeckLinkDisplayMode     *out_dm;
+    IDeckLinkVideoConversion *conv;
+
+    BMDPixelFormat out_pix;
+    int            width, height, row_bytes;
+    BMDTimeValue   duration;
+    BMDTimeScale   timescale;
+    int            preroll;
+
+    IDeckLinkVideoFrame *queue[SYNC_QUEUE];
+    int                  rindex, nb_queued;
+    IDeckLinkVideoFrame *last;  // shown again if the input is late
+    int64_t              slot;
+
+    pthread_mutex_t mutex;
+    int             running;
+    int             playing;
+
+    DecklinkFrameSyncStats stats;
+};
+
+class SyncDelegate : public IDeckLinkInputCallback,
+                     public IDeckLinkVideoOutputCallback
+{
+public:
+    SyncDelegate(DecklinkFrameSync *sync);
+    ~SyncDelegate();
+
+    virtual HRESULT STDMETHODCALLTYPE
+        QueryInterface(REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE
+        AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE
+        Release(void);
+    virtual HRESULT STDMETHODCALLTYPE
+        VideoInputFormatChanged(BMDVideoInputFormatChangedEvents,
+                                IDeckLinkDisplayMode*,
+                                BMDDetectedVideoInputFormatFlags)
+        { return S_OK; }
+    virtual HRESULT STDMETHODCALLTYPE
+        VideoInputFrameArrived(IDeckLinkVideoInputFrame*,
+                               IDeckLinkAudioInputPacket*);
+    virtual HRESULT STDMETHODCALLTYPE
+        ScheduledFrameCompleted(IDeckLinkVideoFrame*,
+                                BMDOutputFrameCompletionResult);
+    virtual HRESULT STDMETHODCALLTYPE
+        ScheduledPlaybackHasStopped(void) { return S_OK; }
+
+private:
+    ULONG ref_count;
+    pthread_mutex_t mutex;
+
+    DecklinkFrameSync *fs;
+};
+
+/* Called with the mutex held, the frame for the next output slot.
+ * One frame in hand is the steady state, a second one is tolerated to
+ * absorb the phase jitter between the two clocks, more mean the input
+ * runs fast and the oldest go. An empty queue means it runs slow and
+ * the previous frame is shown again. */
+static IDeckLinkVideoFrame *framesync_next(DecklinkFrameSync *fs)
+{
+    while (fs->nb_queued > 2) {
+        fs->queue[fs->rindex]->Release();
+        fs->rindex = (fs->rindex + 1) % SYNC_QUEUE;
+        fs->nb_queued--;
+        fs->stats.dropped++;
+    }
+
+    if (fs->nb_queued) {
+        if (fs->last)
+            fs->last->Release();
+        fs->last   = fs->queue[fs->rindex];
+        fs->rindex = (fs->rindex + 1) % SYNC_QUEUE;
+        fs->nb_queued--;
+    } else if (fs->last) {
+        fs->stats.repeated++;
+    }
+
+    if (fs->last)
+        fs->last->AddRef();
+
+    return fs->last;
+}
+
+static void framesync_schedule(DecklinkFrameSync *fs)
+{
+    IDeckLinkVideoFrame *frame;
+    int64_t slot;
+
+    pthread_mutex_lock(&fs->mutex);
+    if (!fs->running) {
+        pthread_mutex_unlock(&fs->mutex);
+        return;
+    }
+    frame = framesync_next(fs);
+    slot  = fs->slot++;
+    pthread_mutex_unlock(&fs->mutex);
+
+    if (!frame)
+        return;
+
+    if (fs->out->ScheduleVideoFrame(frame, slot * fs->duration, fs->duration,
+                                    fs->timescale) == S_OK) {
+        pthread_mutex_lock(&fs->mutex);
+        fs->stats.scheduled++;
+        pthread_mutex_unlock(&fs->mutex);
+    }
+
+    frame->Release();
+}
+
+SyncDelegate::SyncDelegate(DecklinkFrameSync *sync) : ref_count(0)
+{
+    fs = sync;
+
+    pthread_mutex_init(&mutex, NULL);
+}
+
+SyncDelegate::~SyncDelegate()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+ULONG SyncDelegate::AddRef(void)
+{
+    pthread_mutex_lock(&mutex);
+    ref_count++;
+    pthread_mutex_unlock(&mutex);
+
+    return (ULONG)ref_count;
+}
+
+ULONG SyncDelegate::Release(void)
+{
+    pthread_mutex_lock(&mutex);
+    ref_count--;
+    pthread_mutex_unlock(&mutex);
+
+    if (!ref_count) {
+        delete this;
+        return 0;
+    }
+
+    return (ULONG)ref_count;
+}
+
+HRESULT
+SyncDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame  *v_frame,
+                                     IDeckLinkAudioInputPacket *a_frame)
+{
+    IDeckLinkVideoFrame *frame;
+    int start;
+
+    if (!v_frame)
+        return S_OK;
+
+    if (v_frame->GetFlags() & bmdFrameHasNoInputSource) {
+        // keep showing the last good frame
+        pthread_mutex_lock(&fs->mutex);
+        fs->stats.no_input++;
+        pthread_mutex_unlock(&fs->mutex);
+        return S_OK;
+    }
+
+    if (fs->conv) {
+        IDeckLinkMutableVideoFrame *out_frame;
+
+        if (fs->out->CreateVideoFrame(fs->width, fs->height, fs->row_bytes,
+                                      fs->out_pix, bmdFrameFlagDefault,
+                                      &out_frame) != S_OK)
+            return S_OK;
+        if (fs->conv->ConvertFrame(v_frame, out_frame) != S_OK) {
+            out_frame->Release();
+            return S_OK;
+        }
+        frame = out_frame;
+    } else {
+        // same format, the output takes the captured frame as it is
+        v_frame->AddRef();
+        frame = v_frame;
+    }
+
+    pthread_mutex_lock(&fs->mutex);
+    if (fs->nb_queued == SYNC_QUEUE) {
+        fs->queue[fs->rindex]->Release();
+        fs->rindex = (fs->rindex + 1) % SYNC_QUEUE;
+        fs->nb_queued--;
+        fs->stats.dropped++;
+    }
+    fs->queue[(fs->rindex + fs->nb_queued) % SYNC_QUEUE] = frame;
+    fs->nb_queued++;
+    fs->stats.received++;
+
+    start = fs->running && !fs->playing;
+    if (start)
+        fs->playing = 1;
+    pthread_mutex_unlock(&fs->mutex);
+
+    // the first frame starts the output, preroll slots ahead
+    if (start) {
+        for (int i = 0; i < fs->preroll; i++)
+            framesync_schedule(fs);
+        fs->out->StartScheduledPlayback(0, fs->timescale, 1.0);
+    }
+
+    return S_OK;
+}
+
+HRESULT
+SyncDelegate::ScheduledFrameCompleted(IDeckLinkVideoFrame *frame,
+                                      BMDOutputFrameCompletionResult result)
+{
+    if (result == bmdOutputFrameDisplayedLate ||
+        result == bmdOutputFrameDropped) {
+        pthread_mutex_lock(&fs->mutex);
+        fs->stats.late++;
+        pthread_mutex_unlock(&fs->mutex);
+    }
+
+    if (result != bmdOutputFrameFlushed)
+        framesync_schedule(fs);
+
+    return S_OK;
+}
+
+static IDeckLink *framesync_device(int instance)
+{
+    IDeckLinkIterator *it = CreateDeckLinkIteratorInstance();
+    IDeckLink *dl         = NULL;
+    HRESULT ret           = S_FALSE;
+    int i                 = 0;
+
+    if (!it)
+        return NULL;
+
+    do {
+        if (dl)
+            dl->Release();
+        dl  = NULL;
+        ret = it->Next(&dl);
+    } while (ret == S_OK && i++ < instance);
+
+    it->Release();
+
+    return ret == S_OK ? dl : NULL;
+}
+
+static IDeckLinkDisplayMode *framesync_mode(IDeckLinkDisplayModeIterator *it,
+                                            int index)
+{
+    IDeckLinkDisplayMode *dm;
+    int i = 0;
+
+    while (it->Next(&dm) == S_OK) {
+        if (i++ == index)
+            return dm;
+        dm->Release();
+    }
+
+    return NULL;
+}
+
+static HRESULT framesync_connection(IDeckLink *dl,
+                                    BMDDeckLinkConfigurationID id,
+                                    int connection)
+{
+    const int64_t connections[] = { 0,
+                                    bmdVideoConnectionComposite,
+                                    bmdVideoConnectionComponent,
+                                    bmdVideoConnectionHDMI,
+                                    bmdVideoConnectionSDI };
+    IDeckLinkConfiguration *conf;
+    HRESULT ret;
+
+    // do not change it
+    if (connection <= 0 || connection > 4)
+        return S_OK;
+
+    ret = dl->QueryInterface(IID_IDeckLinkConfiguration, (void**)&conf);
+    if (ret != S_OK)
+        return ret;
+
+    ret = conf->SetInt(id, connections[connection]);
+    conf->Release();
+
+    return ret;
+}
+
+void decklink_framesync_free(DecklinkFrameSync *fs)
+{
+    if (!fs)
+        return;
+
+    if (fs->running)
+        decklink_framesync_stop(fs);
+
+    if (fs->in) {
+        fs->in->DisableVideoInput();
+        fs->in->SetCallback(NULL);
+        fs->in->Release();
+    }
+
+    if (fs->out) {
+        fs->out->DisableVideoOutput();
+        fs->out->SetScheduledFrameCompletionCallback(NULL);
+        fs->out->Release();
+    }
+
+    if (fs->conv)
+        fs->conv->Release();
+
+    if (fs->in_dm)
+        fs->in_dm->Release();
+
+    if (fs->out_dm)
+        fs->out_dm->Release();
+
+    if (fs->in_dl)
+        fs->in_dl->Release();
+
+    if (fs->out_dl)
+        fs->out_dl->Release();
+
+    pthread_mutex_destroy(&fs->mutex);
+
+    free(fs);
+}
+
+DecklinkFrameSync *decklink_framesync_alloc(DecklinkConf *ic,
+                                            DecklinkConf *oc)
+{
+    DecklinkFrameSync *fs   = (DecklinkFrameSync *)calloc(1, sizeof(*fs));
+    BMDPixelFormat    pix[] = { bmdFormat8BitYUV, bmdFormat10BitYUV,
+                                bmdFormat8BitARGB, bmdFormat10BitRGB,
+                                bmdFormat8BitBGRA };
+    const int         nb_pix = sizeof(pix) / sizeof(*pix);
+    IDeckLinkDisplayModeIterator *dm_it;
+    SyncDelegate      *delegate;
+    HRESULT           ret;
+
+    if (!fs)
+        return NULL;
+
+    pthread_mutex_init(&fs->mutex, NULL);
+
+    if (ic->pixel_format < 0 || ic->pixel_format >= nb_pix ||
+        oc->pixel_format < 0 || oc->pixel_format >= nb_pix)
+        goto fail;
+
+    if (oc->preroll <= 0)
+        oc->preroll = 2;
+
+    fs->in_dl  = framesync_device(ic->instance);
+    fs->out_dl = framesync_device(oc->instance);
+
+    if (!fs->in_dl || !fs->out_dl)
+        goto fail;
+
+    ret = fs->in_dl->QueryInterface(IID_IDeckLinkInput, (void**)&fs->in);
+    if (ret != S_OK)
+        goto fail;
+
+    ret = fs->out_dl->QueryInterface(IID_IDeckLinkOutput, (void**)&fs->out);
+    if (ret != S_OK)
+        goto fail;
+
+    if (framesync_connection(fs->in_dl, bmdDeckLinkConfigVideoInputConnection,
+                             ic->video_connection) != S_OK ||
+        framesync_connection(fs->out_dl, bmdDeckLinkConfigVideoOutputConnection,
+                             oc->video_connection) != S_OK)
+        goto fail;
+
+    if (fs->in->GetDisplayModeIterator(&dm_it) != S_OK)
+        goto fail;
+    fs->in_dm = framesync_mode(dm_it, ic->video_mode);
+    dm_it->Release();
+
+    if (fs->out->GetDisplayModeIterator(&dm_it) != S_OK)
+        goto fail;
+    fs->out_dm = framesync_mode(dm_it, oc->video_mode);
+    dm_it->Release();
+
+    if (!fs->in_dm || !fs->out_dm)
+        goto fail;
+
+    ic->width  = fs->in_dm->GetWidth();
+    ic->height = fs->in_dm->GetHeight();
+    fs->in_dm->GetFrameRate(&ic->tb_num, &ic->tb_den);
+    oc->width  = fs->out_dm->GetWidth();
+    oc->height = fs->out_dm->GetHeight();
+    fs->out_dm->GetFrameRate(&oc->tb_num, &oc->tb_den);
+
+    if (ic->width != oc->width || ic->height != oc->height)
+        goto fail;
+
+    fs->width     = oc->width;
+    fs->height    = oc->height;
+    fs->out_pix   = pix[oc->pixel_format];
+    fs->row_bytes = decklink_row_bytes(fs->out_pix, fs->width);
+    fs->duration  = oc->tb_num;
+    fs->timescale = oc->tb_den;
+    fs->preroll   = oc->preroll;
+
+    if (ic->pixel_format != oc->pixel_format) {
+        fs->conv = CreateVideoConversionInstance();
+        if (!fs->conv)
+            goto fail;
+    }
+
+    delegate = new SyncDelegate(fs);
+
+    if (!delegate)
+        goto fail;
+
+    fs->in->SetCallback(delegate);
+    fs->out->SetScheduledFrameCompletionCallback(delegate);
+
+    ret = fs->in->EnableVideoInput(fs->in_dm->GetDisplayMode(),
+                                   pix[ic->pixel_format], 0);
+    if (ret != S_OK)
+        goto fail;
+
+    ret = fs->out->EnableVideoOutput(fs->out_dm->GetDisplayMode(),
+                                     bmdVideoOutputFlagDefault);
+    if (ret != S_OK)
+        goto fail;
+
+    return fs;
+fail:
+    decklink_framesync_free(fs);
+    return NULL;
+}
+
+int decklink_framesync_start(DecklinkFrameSync *fs)
+{
+    pthread_mutex_lock(&fs->mutex);
+    memset(&fs->stats, 0, sizeof(fs->stats));
+    fs->running = 1;
+    fs->playing = 0;
+    fs->slot    = 0;
+    pthread_mutex_unlock(&fs->mutex);
+
+    return fs->in->StartStreams();
+}
+
+void decklink_framesync_stats(DecklinkFrameSync *fs,
+                              DecklinkFrameSyncStats *stats)
+{
+    pthread_mutex_lock(&fs->mutex);
+    *stats        = fs->stats;
+    stats->queued = fs->nb_queued;
+    pthread_mutex_unlock(&fs->mutex);
+}
+
+int decklink_framesync_stop(DecklinkFrameSync *fs)
+{
+    HRESULT ret;
+
+    pthread_mutex_lock(&fs->mutex);
+    fs->running = 0;
+    pthread_mutex_unlock(&fs->mutex);
+
+    ret = fs->in->StopStreams();
+
+    if (fs->playing) {
+        fs->out->StopScheduledPlayback(0, NULL, 0);
+        fs->playing = 0;
+    }
+
+    pthread_mutex_lock(&fs->mutex);
+    while (fs->nb_queued) {
+        fs->queue[fs->rindex]->Release();
+        fs->rindex = (fs->rindex + 1) % SYNC_QUEUE;
+        fs->nb_queued--;
+    }
+    if (fs->last) {
+        fs->last->Release();
+        fs->last = NULL;
+    }
+    pthread_mutex_unlock(&fs->mutex);
+
+    return ret;
+}
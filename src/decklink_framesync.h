@@ -0,0 +1,62 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_FRAMESYNC_H
+#define DECKLINK_FRAMESYNC_H
+
+#include <stdint.h>
+
+#include "decklink_capture.h"
+
+typedef struct {
+    uint64_t received;    // input frames with a signal
+    uint64_t no_input;    // input frames without a signal
+    uint64_t scheduled;   // output slots filled
+    uint64_t repeated;    // slots showing the previous frame again
+    uint64_t dropped;     // input frames never shown
+    uint64_t late;        // frames the output displayed late or dropped
+    int      queued;      // input frames waiting for a slot
+} DecklinkFrameSyncStats;
+
+typedef struct DecklinkFrameSync DecklinkFrameSync;
+
+/**
+ * Pass the frames captured on one device to the output of another.
+ *
+ * Both devices must use video modes of the same size. The input
+ * frames are scheduled as they are when the pixel formats match and
+ * converted otherwise. output->preroll sets the frames kept scheduled
+ * ahead on the output, which is the latency added to the capture
+ * (default 2, minimum 1). Frames are dropped or repeated to absorb the
+ * drift between the two clocks.
+ */
+DecklinkFrameSync *decklink_framesync_alloc(DecklinkConf *input,
+                                            DecklinkConf *output);
+
+int decklink_framesync_start(DecklinkFrameSync *sync);
+
+void decklink_framesync_stats(DecklinkFrameSync *sync,
+                              DecklinkFrameSyncStats *stats);
+
+int decklink_framesync_stop(DecklinkFrameSync *sync);
+
+void decklink_framesync_free(DecklinkFrameSync *sync);
+
+#endif // DECKLINK_FRAMESYNC_H
@@ -0,0 +1,352 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <DeckLinkAPI.h>
+
+#include "decklink_util.h"
+
+extern "C" {
+#include "decklink_generator.h"
+}
+
+#define TONE_PERIOD    48 // 1 kHz at 48 kHz
+#define COUNTER_DIGITS 8
+
+// one period of the tone, -20 dBFS in 32 bit
+static const int32_t tone[TONE_PERIOD] = {
+              0,    28030286,    55580967,    82180641,
+      107374182,   130730521,   151850025,   170371332,
+      185977539,   198401619,   207430992,   212911163,
+      214748365,   212911163,   207430992,   198401619,
+      185977539,   170371332,   151850025,   130730521,
+      107374182,    82180641,    55580967,    28030286,
+              0,   -28030286,   -55580967,   -82180641,
+     -107374182,  -130730521,  -151850025,  -170371332,
+     -185977539,  -198401619,  -207430992,  -212911163,
+     -214748365,  -212911163,  -207430992,  -198401619,
+     -185977539,  -170371332,  -151850025,  -130730521,
+     -107374182,   -82180641,   -55580967,   -28030286,
+};
+
+// 5x7 digits, the most significant of the 5 bits is the leftmost column
+static const uint8_t font[10][7] = {
+    { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },
+    { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },
+    { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },
+    { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },
+    { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },
+    { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },
+    { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },
+    { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+    { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },
+    { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },
+};
+
+/* Everything is drawn in groups, the pixels packed together in the
+ * output format: 2 for UYVY, 6 for v210. Each pattern is made of
+ * whole lines prepared once, drawing is copying parts of them. */
+struct DecklinkGenerator {
+    uint64_t generation;
+    DecklinkPattern pattern;
+    int width, height, row_bytes;
+    int group_px, group_bytes;
+    int groups;
+
+    uint8_t *bars;  // the bars are the same on every line
+    uint8_t *black;
+    uint8_t *white;
+
+    int box_groups, box_rows, box_y, box_step;
+    int cell_groups, cell_rows, counter_x, counter_y;
+};
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Pack a line of 10 bit 4:2:2 samples, padded to whole groups */
+static void pack_line(DecklinkGenerator *g, uint8_t *dst, const uint16_t *y,
+                      const uint16_t *u, const uint16_t *v)
+{
+    if (g->group_px == 2) {
+        for (int i = 0; i < g->groups; i++) {
+            dst[4 * i]     = u[i] >> 2;
+            dst[4 * i + 1] = y[2 * i] >> 2;
+            dst[4 * i + 2] = v[i] >> 2;
+            dst[4 * i + 3] = y[2 * i + 1] >> 2;
+        }
+        return;
+    }
+
+    for (int i = 0; i < g->groups; i++, y += 6, u += 3, v += 3, dst += 16) {
+        put_le32(dst,      u[0] | y[0] << 10 | v[0] << 20);
+        put_le32(dst + 4,  y[1] | u[1] << 10 | y[2] << 20);
+        put_le32(dst + 8,  v[1] | y[3] << 10 | u[2] << 20);
+        put_le32(dst + 12, y[4] | v[2] << 10 | y[5] << 20);
+    }
+}
+
+static int make_lines(DecklinkGenerator *g)
+{
+    // white, yellow, cyan, green, magenta, red, blue, black
+    static const uint8_t rgb[8] = { 7, 6, 3, 2, 5, 4, 1, 0 };
+    // BT.709 for HD, BT.601 for SD
+    double kr  = g->width > 720 ? 0.2126 : 0.299;
+    double kb  = g->width > 720 ? 0.0722 : 0.114;
+    int    len = g->groups * g->group_px;
+    uint16_t *y = (uint16_t *)malloc(len * sizeof(*y));
+    uint16_t *u = (uint16_t *)malloc(len / 2 * sizeof(*u));
+    uint16_t *v = (uint16_t *)malloc(len / 2 * sizeof(*v));
+
+    if (!y || !u || !v) {
+        free(y);
+        free(u);
+        free(v);
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        int    c  = i < g->width ? rgb[i * 8 / g->width] : 0;
+        double r  = c & 4 ? 0.75 : 0;
+        double gr = c & 2 ? 0.75 : 0;
+        double b  = c & 1 ? 0.75 : 0;
+        double l  = kr * r + (1 - kr - kb) * gr + kb * b;
+
+        y[i] = 64 + 876 * l + 0.5;
+        if (!(i & 1)) {
+            u[i / 2] = 512 + 896 * (b - l) / (2 * (1 - kb)) + 0.5;
+            v[i / 2] = 512 + 896 * (r - l) / (2 * (1 - kr)) + 0.5;
+        }
+    }
+    pack_line(g, g->bars, y, u, v);
+
+    for (int i = 0; i < len; i++) {
+        y[i]     = 64;
+        u[i / 2] = v[i / 2] = 512;
+    }
+    pack_line(g, g->black, y, u, v);
+
+    for (int i = 0; i < len; i++)
+        y[i] = 940;
+    pack_line(g, g->white, y, u, v);
+
+    free(y);
+    free(u);
+    free(v);
+
+    return 0;
+}
+
+/* Copy a rectangle, x and w in groups, from a prepared line */
+static void copy_rect(DecklinkGenerator *g, uint8_t *frame, int stride,
+                      const uint8_t *line, int x, int w, int y, int h)
+{
+    int offset = x * g->group_bytes;
+
+    for (int j = y; j < y + h; j++)
+        memcpy(frame + j * stride + offset, line + offset,
+               w * g->group_bytes);
+}
+
+static int box_x(DecklinkGenerator *g, int64_t number)
+{
+    return number * g->box_step % (g->groups - g->box_groups + 1);
+}
+
+static int digit(int64_t number, int pos)
+{
+    for (int i = pos; i < COUNTER_DIGITS - 1; i++)
+        number /= 10;
+
+    return number % 10;
+}
+
+/* Only the digits that differ from the drawn ones are redrawn */
+static void draw_counter(DecklinkGenerator *g, uint8_t *frame, int stride,
+                         int64_t drawn, int64_t number)
+{
+    int cell = g->cell_groups;
+
+    if (drawn < 0)
+        copy_rect(g, frame, stride, g->black, g->counter_x - cell,
+                  (6 * COUNTER_DIGITS + 1) * cell,
+                  g->counter_y - g->cell_rows, 9 * g->cell_rows);
+
+    for (int d = 0; d < COUNTER_DIGITS; d++) {
+        int n = digit(number, d);
+        int x = g->counter_x + d * 6 * cell;
+
+        if (drawn >= 0 && digit(drawn, d) == n)
+            continue;
+
+        copy_rect(g, frame, stride, g->black, x, 5 * cell,
+                  g->counter_y, 7 * g->cell_rows);
+        for (int r = 0; r < 7; r++)
+            for (int c = 0; c < 5; c++)
+                if (font[n][r] & (0x10 >> c))
+                    copy_rect(g, frame, stride, g->white, x + c * cell, cell,
+                              g->counter_y + r * g->cell_rows, g->cell_rows);
+    }
+}
+
+void decklink_generator_draw(DecklinkGenerator *g, uint8_t *frame,
+                             int stride, int64_t drawn, int64_t number)
+{
+    if (drawn == number)
+        return;
+
+    if (drawn < 0) {
+        const uint8_t *line = g->pattern == DECKLINK_PATTERN_BLACK ?
+                              g->black : g->bars;
+
+        for (int j = 0; j < g->height; j++)
+            memcpy(frame + j * stride, line, g->row_bytes);
+    }
+
+    switch (g->pattern) {
+    case DECKLINK_PATTERN_BOX:
+        if (drawn >= 0)
+            copy_rect(g, frame, stride, g->bars, box_x(g, drawn),
+                      g->box_groups, g->box_y, g->box_rows);
+        copy_rect(g, frame, stride, g->white, box_x(g, number),
+                  g->box_groups, g->box_y, g->box_rows);
+        break;
+    case DECKLINK_PATTERN_COUNTER:
+        draw_counter(g, frame, stride, drawn, number);
+        break;
+    default:
+        // still pictures
+        break;
+    }
+}
+
+static uint64_t generations;
+
+uint64_t decklink_generator_generation(const DecklinkGenerator *g)
+{
+    return g->generation;
+}
+
+void decklink_generator_tone(uint8_t *samples, int nb_samples,
+                             int channels, int sample_depth,
+                             int64_t timestamp)
+{
+    int pos = ((timestamp % TONE_PERIOD) + TONE_PERIOD) % TONE_PERIOD;
+
+    for (int i = 0; i < nb_samples; i++) {
+        int32_t s = tone[pos];
+
+        if (sample_depth == 16) {
+            int16_t *dst = (int16_t *)samples + i * channels;
+            for (int c = 0; c < channels; c++)
+                dst[c] = s >> 16;
+        } else {
+            int32_t *dst = (int32_t *)samples + i * channels;
+            for (int c = 0; c < channels; c++)
+                dst[c] = s;
+        }
+
+        if (++pos == TONE_PERIOD)
+            pos = 0;
+    }
+}
+
+void decklink_generator_free(DecklinkGenerator *g)
+{
+    if (!g)
+        return;
+
+    free(g->bars);
+    free(g->black);
+    free(g->white);
+    free(g);
+}
+
+DecklinkGenerator *decklink_generator_alloc(int width, int height,
+                                            int pixel_format,
+                                            DecklinkPattern pattern)
+{
+    DecklinkGenerator *g = (DecklinkGenerator *)calloc(1, sizeof(*g));
+    int counter_groups;
+
+    if (!g)
+        return NULL;
+
+    switch (pixel_format) {
+    case 0:
+        g->row_bytes   = decklink_row_bytes(bmdFormat8BitYUV, width);
+        g->group_px    = 2;
+        g->group_bytes = 4;
+        break;
+    case 1:
+        g->row_bytes   = decklink_row_bytes(bmdFormat10BitYUV, width);
+        g->group_px    = 6;
+        g->group_bytes = 16;
+        break;
+    default:
+        goto fail;
+    }
+
+    g->pattern = pattern;
+    g->width   = width;
+    g->height  = height;
+    g->groups  = (width + g->group_px - 1) / g->group_px;
+
+    g->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+
+    // the padding of the v210 lines stays zero
+    g->bars  = (uint8_t *)calloc(1, g->row_bytes);
+    g->black = (uint8_t *)calloc(1, g->row_bytes);
+    g->white = (uint8_t *)calloc(1, g->row_bytes);
+    if (!g->bars || !g->black || !g->white || make_lines(g) < 0)
+        goto fail;
+
+    g->box_rows   = height / 8;
+    g->box_groups = g->box_rows / g->group_px;
+    if (g->box_groups < 1)
+        g->box_groups = 1;
+    g->box_y      = (height - g->box_rows) / 2;
+    g->box_step   = (8 + g->group_px - 1) / g->group_px;
+
+    g->cell_groups = height / (54 * g->group_px);
+    if (g->cell_groups < 1)
+        g->cell_groups = 1;
+    g->cell_rows   = g->cell_groups * g->group_px;
+    counter_groups = (6 * COUNTER_DIGITS + 1) * g->cell_groups;
+    g->counter_x   = (g->groups - counter_groups) / 2 + g->cell_groups;
+    g->counter_y   = height * 3 / 4;
+
+    if (g->box_groups > g->groups || counter_groups > g->groups ||
+        g->counter_y + 8 * g->cell_rows > height)
+        goto fail;
+
+    return g;
+fail:
+    decklink_generator_free(g);
+    return NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_GENERATOR_H
+#define DECKLINK_GENERATOR_H
+
+#include <stdint.h>
+
+typedef enum {
+    DECKLINK_PATTERN_BLACK,
+    DECKLINK_PATTERN_BARS,    // 75% colour bars
+    DECKLINK_PATTERN_BOX,     // bars with a white box moving across
+    DECKLINK_PATTERN_COUNTER, // bars with the frame number burnt in
+} DecklinkPattern;
+
+typedef struct DecklinkGenerator DecklinkGenerator;
+
+/**
+ * Prepare a test pattern, pixel_format is the DecklinkConf one,
+ * only 8 bit (0) and 10 bit (1) YUV are supported.
+ */
+DecklinkGenerator *decklink_generator_alloc(int width, int height,
+                                            int pixel_format,
+                                            DecklinkPattern pattern);
+
+/**
+ * Bring a frame to the pattern for the frame number.
+ *
+ * The frame is expected to hold the picture drawn earlier for the
+ * drawn frame number, only the area that changes is written.
+ * Use -1 for a frame holding anything else.
+ */
+void decklink_generator_draw(DecklinkGenerator *gen, uint8_t *frame,
+                             int stride, int64_t drawn, int64_t number);
+
+/**
+ * Write a 1 kHz tone at -20 dBFS on every channel, the timestamp is in
+ * 1/48000 units and keeps the phase continuous across calls.
+ */
+void decklink_generator_tone(uint8_t *samples, int nb_samples,
+                             int channels, int sample_depth,
+                             int64_t timestamp);
+
+void decklink_generator_free(DecklinkGenerator *gen);
+
+#endif // DECKLINK_GENERATOR_H
@@ -0,0 +1,332 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+extern "C" {
+#include "decklink_log.h"
+}
+
+// records in the ring, a power of two
+#define LOG_RING     256
+#define LOG_LINE     256
+// how often the thread looks at the ring without an eventfd, ms
+#define LOG_INTERVAL 10
+
+/**
+ * Multiple producers, one consumer. A record belongs to the writer of
+ * position n while its seq is n, to the reader once it is n + 1 and
+ * is free again for position n + LOG_RING.
+ */
+typedef struct {
+    uint64_t seq;
+    int      level;
+    char     msg[LOG_LINE];
+} LogRecord;
+
+static LogRecord        log_ring[LOG_RING];
+static uint64_t         log_tail;      // next position to write
+static uint64_t         log_head;      // next position to read
+static uint64_t         log_dropped;
+static int              log_level = DECKLINK_LOG_INFO;
+static decklink_log_cb  log_cb;
+static void            *log_priv;
+static DecklinkLogSite *log_sites;     // the rate limited ones seen so far
+
+static pthread_once_t   log_once        = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t        log_thread;
+static int              log_wake_fd = -1;
+static int              log_idle;      // the thread waits on log_wake_fd
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void default_cb(void *priv, DecklinkLogLevel level, const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+}
+
+static void emit(int level, const char *fmt, ...)
+{
+    decklink_log_cb cb = log_cb ? log_cb : default_cb;
+    char msg[LOG_LINE];
+    va_list vl;
+
+    va_start(vl, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, vl);
+    va_end(vl);
+
+    cb(log_priv, (DecklinkLogLevel)level, msg);
+}
+
+/**
+ * A site that went quiet after a burst never gets to tell how many
+ * messages it lost, say it for it.
+ *
+ * Return the milliseconds until the next site goes quiet, -1 if none
+ * has anything to report.
+ */
+static int report_sites(int64_t now)
+{
+    DecklinkLogSite *site;
+    int64_t next = -1;
+
+    for (site = __atomic_load_n(&log_sites, __ATOMIC_ACQUIRE); site;
+         site = site->next) {
+        int64_t quiet;
+        uint32_t n;
+
+        if (!__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED))
+            continue;
+
+        // a site still logging reports along its next message
+        quiet = __atomic_load_n(&site->last, __ATOMIC_RELAXED) +
+                2 * site->interval - now;
+        if (quiet > 0) {
+            if (next < 0 || quiet < next)
+                next = quiet;
+            continue;
+        }
+
+        n = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+        if (n)
+            emit(site->level, "%s:%d: %u similar messages suppressed",
+                 site->file, site->line, n);
+    }
+
+    return next;
+}
+
+static int drain(void)
+{
+    uint64_t dropped;
+    int timeout;
+
+    pthread_mutex_lock(&log_drain_mutex);
+    for (;;) {
+        LogRecord *r = &log_ring[log_head % LOG_RING];
+
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != log_head + 1)
+            break;
+
+        emit(r->level, "%s", r->msg);
+        __atomic_store_n(&r->seq, log_head + LOG_RING, __ATOMIC_RELEASE);
+        log_head++;
+    }
+
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        emit(DECKLINK_LOG_WARNING, "%llu log messages dropped",
+             (unsigned long long)dropped);
+
+    timeout = report_sites(now_ms());
+    pthread_mutex_unlock(&log_drain_mutex);
+
+    return timeout;
+}
+
+/**
+ * Called once there is something for the thread, only the first call
+ * after it went idle costs a write.
+ */
+static void wake(void)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&log_idle, 0, __ATOMIC_RELAXED) &&
+        write(log_wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/**
+ * Sleep until a message comes or a rate limited site goes quiet. The
+ * thread is marked idle before draining: what is pushed before the
+ * drain looks is drained, whoever pushes later finds the flag and
+ * wakes the thread.
+ */
+static void *log_thread_func(void *priv)
+{
+    struct pollfd pfd = { log_wake_fd, POLLIN, 0 };
+    uint64_t count;
+    int timeout;
+
+    for (;;) {
+        __atomic_store_n(&log_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        timeout = drain();
+
+        if (log_wake_fd < 0 && (timeout < 0 || timeout > LOG_INTERVAL))
+            timeout = LOG_INTERVAL;
+
+        if (poll(&pfd, 1, timeout) > 0 &&
+            read(log_wake_fd, &count, sizeof(count)) < 0)
+            continue;
+    }
+
+    return NULL;
+}
+
+static void log_init(void)
+{
+    pthread_attr_t attr;
+    int i;
+
+    for (i = 0; i < LOG_RING; i++)
+        log_ring[i].seq = i;
+
+    // without it the thread looks at the ring every LOG_INTERVAL
+    log_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    // never joined, it lives as long as the process
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&log_thread, &attr, log_thread_func, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+static void push(int level, const char *suffix, const char *fmt, va_list vl)
+{
+    uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    LogRecord *r;
+    int len;
+
+    pthread_once(&log_once, log_init);
+
+    for (;;) {
+        int64_t diff;
+
+        r    = &log_ring[pos % LOG_RING];
+        diff = (int64_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // full, the reader has not freed it yet
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            wake();
+            return;
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    len = vsnprintf(r->msg, LOG_LINE, fmt, vl);
+    if (len < 0)
+        len = 0;
+
+    // the sink gets lines without the newline
+    if (len && len < LOG_LINE && r->msg[len - 1] == '\n')
+        r->msg[--len] = '\0';
+    if (suffix && len < LOG_LINE)
+        snprintf(r->msg + len, LOG_LINE - len, "%s", suffix);
+
+    r->level = level;
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+    wake();
+}
+
+void decklink_log_set_callback(decklink_log_cb cb, void *priv)
+{
+    pthread_mutex_lock(&log_drain_mutex);
+    log_cb   = cb;
+    log_priv = priv;
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+void decklink_log_set_level(DecklinkLogLevel level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+void decklink_log(DecklinkLogLevel level, const char *fmt, ...)
+{
+    va_list vl;
+
+    if (level > __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+        return;
+
+    va_start(vl, fmt);
+    push(level, NULL, fmt, vl);
+    va_end(vl);
+}
+
+void decklink_log_site(DecklinkLogSite *site, int interval,
+                       DecklinkLogLevel level, const char *fmt, ...)
+{
+    int64_t now = now_ms();
+    int64_t last;
+    uint32_t n;
+    char suffix[48];
+    va_list vl;
+
+    if (level > __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+        return;
+
+    if (!__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL)) {
+        site->level    = level;
+        site->interval = interval;
+        site->next     = __atomic_load_n(&log_sites, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_sites, &site->next, site,
+                                            true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+
+    // whoever moves last forward logs, the others count
+    last = __atomic_load_n(&site->last, __ATOMIC_RELAXED);
+    if ((last && now - last < interval) ||
+        !__atomic_compare_exchange_n(&site->last, &last, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // the thread reports it if the site goes quiet
+        if (__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED) == 1)
+            wake();
+        return;
+    }
+
+    n = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    if (n)
+        snprintf(suffix, sizeof(suffix), " (%u similar suppressed)", n);
+
+    va_start(vl, fmt);
+    push(level, n ? suffix : NULL, fmt, vl);
+    va_end(vl);
+}
+
+void decklink_log_flush(void)
+{
+    drain();
+}
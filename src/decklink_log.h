@@ -0,0 +1,91 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_LOG_H
+#define DECKLINK_LOG_H
+
+#include <stdint.h>
+
+/**
+ * Logging safe to use from the card callbacks.
+ *
+ * The messages are formatted in a lock-free ring and handed to the
+ * sink by a background thread, the caller never waits on stderr. When
+ * the ring is full messages are dropped and counted instead.
+ */
+typedef enum {
+    DECKLINK_LOG_ERROR,
+    DECKLINK_LOG_WARNING,
+    DECKLINK_LOG_INFO,
+    DECKLINK_LOG_DEBUG,
+} DecklinkLogLevel;
+
+/**
+ * Gets one line at a time, without the trailing newline.
+ */
+typedef void (*decklink_log_cb)(void *priv, DecklinkLogLevel level,
+                                const char *msg);
+
+typedef struct DecklinkLogSite {
+    const char *file;
+    int         line;
+    int         level;
+    int         interval;     // milliseconds
+    int64_t     last;         // when it last logged, in milliseconds
+    uint32_t    suppressed;
+    int         registered;
+    struct DecklinkLogSite *next;
+} DecklinkLogSite;
+
+/**
+ * NULL restores the default sink, writing on stderr.
+ */
+void decklink_log_set_callback(decklink_log_cb cb, void *priv);
+
+/**
+ * Messages above level are discarded before being formatted, the
+ * default is DECKLINK_LOG_INFO.
+ */
+void decklink_log_set_level(DecklinkLogLevel level);
+
+void decklink_log(DecklinkLogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void decklink_log_site(DecklinkLogSite *site, int interval,
+                       DecklinkLogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/**
+ * Log at most once every interval milliseconds from this place, the
+ * messages suppressed meanwhile are counted and reported.
+ */
+#define decklink_log_ratelimit(interval, level, ...)                    \
+    do {                                                                \
+        static DecklinkLogSite decklink_log_site_ = { __FILE__, __LINE__ }; \
+        decklink_log_site(&decklink_log_site_, interval, level,          \
+                          __VA_ARGS__);                                 \
+    } while (0)
+
+/**
+ * Hand everything logged so far to the sink, call it before exiting.
+ */
+void decklink_log_flush(void);
+
+#endif // DECKLINK_LOG_H
@@ -0,0 +1,44 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_PHASE_H
+#define DECKLINK_PHASE_H
+
+#include <stdint.h>
+
+/* Internal, kept apart from the DeckLink API so the tests can use it */
+
+/**
+ * The mean position within the period p of nb > 0 samples, unwrapped
+ * around the first sample since they may straddle the boundary.
+ */
+static inline int64_t decklink_mean_phase(const int64_t *samples, int nb,
+                                          int64_t p)
+{
+    int64_t first = samples[0] % p;
+    int64_t sum   = 0;
+
+    for (int i = 0; i < nb; i++)
+        sum += (samples[i] % p - first + p + p / 2) % p - p / 2;
+
+    return ((first + sum / nb) % p + p) % p;
+}
+
+#endif // DECKLINK_PHASE_H
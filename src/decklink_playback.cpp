@@ -0,0 +1,878 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <DeckLinkAPI.h>
+
+#include "decklink_probe.h"
+#include "decklink_util.h"
+
+extern "C" {
+#include "decklink_generator.h"
+#include "decklink_log.h"
+#include "decklink_playback.h"
+#include "decklink_sched.h"
+#include "decklink_trace.h"
+#include "decklink_watchdog.h"
+}
+
+class PlaybackDelegate;
+
+typedef struct PlaybackEntry {
+    IDeckLinkMutableVideoFrame *frame;
+    int64_t pts;
+    int64_t duration;
+} PlaybackEntry;
+
+struct DecklinkPlayback {
+    IDeckLinkIterator            *it;
+    IDeckLink                    *dl;
+    IDeckLinkOutput              *out;
+    IDeckLinkDisplayModeIterator *dm_it;
+    IDeckLinkDisplayMode         *dm;
+    IDeckLinkConfiguration       *conf;
+
+    int     width, height, row_bytes;
+    int64_t tb_num, tb_den;
+    int64_t frame_duration; // of the mode, in 1/tb_den units
+    int     preroll;
+    int     hold;
+
+    // every frame is either free, pending or scheduled on the card
+    IDeckLinkMutableVideoFrame **pool;
+    IDeckLinkMutableVideoFrame **free_frames;
+    int                          pool_size;
+    int                          nb_free;
+
+    // the pattern left in each pool frame, to only patch what changes,
+    // by generator generation, 0 for anything else
+    uint64_t *drawn_by;
+    int64_t  *drawn;
+
+    // submitted and waiting for the scheduling thread
+    PlaybackEntry *pending;
+    int            rindex, windex, nb_pending;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+    int             running;
+    int             threaded;
+    int             playing;
+    int64_t         start_pts;
+
+    int   sched_policy, sched_priority;
+    char *cpus;
+
+    DecklinkPlaybackStats stats;
+    int64_t               wake_sum;
+    uint64_t              wakeups;
+
+    DecklinkWatchdog *wd;
+    uint64_t          stalls_base;
+};
+
+class PlaybackDelegate : public IDeckLinkVideoOutputCallback
+{
+public:
+    PlaybackDelegate(DecklinkPlayback *playback);
+    ~PlaybackDelegate();
+
+    virtual HRESULT STDMETHODCALLTYPE
+        QueryInterface(REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE
+        AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE
+        Release(void);
+    virtual HRESULT STDMETHODCALLTYPE
+        ScheduledFrameCompleted(IDeckLinkVideoFrame*,
+                                BMDOutputFrameCompletionResult);
+    virtual HRESULT STDMETHODCALLTYPE
+        ScheduledPlaybackHasStopped(void) { return S_OK; }
+
+private:
+    ULONG ref_count;
+    pthread_mutex_t mutex;
+
+    DecklinkPlayback *pb;
+};
+
+PlaybackDelegate::PlaybackDelegate(DecklinkPlayback *playback) : ref_count(0)
+{
+    pb = playback;
+
+    pthread_mutex_init(&mutex, NULL);
+}
+
+PlaybackDelegate::~PlaybackDelegate()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+ULONG PlaybackDelegate::AddRef(void)
+{
+    pthread_mutex_lock(&mutex);
+    ref_count++;
+    pthread_mutex_unlock(&mutex);
+
+    return (ULONG)ref_count;
+}
+
+ULONG PlaybackDelegate::Release(void)
+{
+    pthread_mutex_lock(&mutex);
+    ref_count--;
+    pthread_mutex_unlock(&mutex);
+
+    if (!ref_count) {
+        delete this;
+        return 0;
+    }
+
+    return (ULONG)ref_count;
+}
+
+HRESULT
+PlaybackDelegate::ScheduledFrameCompleted(IDeckLinkVideoFrame *frame,
+                                          BMDOutputFrameCompletionResult result)
+{
+    if (pb->wd)
+        decklink_watchdog_kick(pb->wd);
+
+    pthread_mutex_lock(&pb->mutex);
+
+    switch (result) {
+    case bmdOutputFrameCompleted:
+        pb->stats.completed++;
+        break;
+    case bmdOutputFrameDisplayedLate:
+        pb->stats.late++;
+        break;
+    case bmdOutputFrameDropped:
+        pb->stats.dropped++;
+        break;
+    case bmdOutputFrameFlushed:
+        pb->stats.flushed++;
+        break;
+    }
+
+    pb->stats.buffered--;
+    if (!pb->stats.buffered && pb->running && pb->playing)
+        pb->stats.underruns++;
+
+    // the pool only holds frames we created
+    pb->free_frames[pb->nb_free++] =
+        static_cast<IDeckLinkMutableVideoFrame *>(frame);
+    pthread_cond_broadcast(&pb->cond);
+
+    pthread_mutex_unlock(&pb->mutex);
+
+    return S_OK;
+}
+
+// called with the mutex held, returns early if something is submitted
+static void playback_wait(DecklinkPlayback *pb, int64_t delay)
+{
+    struct timespec ts, now;
+    int64_t ns = delay * 1000000000LL / pb->tb_den;
+    int64_t late;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns        += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+
+    if (pthread_cond_timedwait(&pb->cond, &pb->mutex, &ts) != ETIMEDOUT)
+        return;
+
+    // how long the thread took to run again, the scheduling jitter
+    clock_gettime(CLOCK_REALTIME, &now);
+    late = (now.tv_sec - ts.tv_sec) * 1000000000LL +
+           now.tv_nsec - ts.tv_nsec;
+    if (late < 0)
+        return;
+    pb->wake_sum += late;
+    pb->wakeups++;
+    if (late > pb->stats.wake_max)
+        pb->stats.wake_max = late;
+}
+
+/**
+ * Called by the watchdog, the mutex may be what everybody is stuck on
+ * so the counters are read without it.
+ */
+static void playback_dump(void *opaque)
+{
+    DecklinkPlayback *pb = (DecklinkPlayback *)opaque;
+    int busy = pthread_mutex_trylock(&pb->mutex);
+
+    decklink_log(DECKLINK_LOG_WARNING,
+                 "Playback %d pending, %d free, %d on the card, %s%s",
+                 pb->nb_pending, pb->nb_free, pb->stats.buffered,
+                 pb->playing ? "playing" : "not playing",
+                 busy ? ", lock held" : "");
+    if (!busy)
+        pthread_mutex_unlock(&pb->mutex);
+}
+
+/**
+ * Wait for the delegate to give back every frame on the card, for a
+ * second at most.
+ */
+static void playback_drain(DecklinkPlayback *pb)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+
+    pthread_mutex_lock(&pb->mutex);
+    while (pb->stats.buffered > 0) {
+        if (pthread_cond_timedwait(&pb->cond, &pb->mutex, &ts) == ETIMEDOUT) {
+            decklink_log(DECKLINK_LOG_WARNING,
+                         "%d frames not given back by the card",
+                         pb->stats.buffered);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pb->mutex);
+}
+
+static void playback_pop(DecklinkPlayback *pb)
+{
+    pb->rindex = (pb->rindex + 1) % pb->pool_size;
+    pb->nb_pending--;
+}
+
+/**
+ * Hand the pending frames to the card once they are within preroll
+ * frames of the hardware clock. Frames whose time has already passed
+ * go back to the pool.
+ */
+static void *playback_thread(void *priv)
+{
+    DecklinkPlayback *pb = (DecklinkPlayback *)priv;
+    int64_t lead         = pb->preroll * pb->tb_num;
+
+    pthread_mutex_lock(&pb->mutex);
+    while (pb->running) {
+        PlaybackEntry e;
+        BMDTimeValue now;
+        double speed;
+        HRESULT ret;
+
+        if (!pb->nb_pending) {
+            pthread_cond_wait(&pb->cond, &pb->mutex);
+            continue;
+        }
+
+        e = pb->pending[pb->rindex];
+
+        if (pb->playing) {
+            pthread_mutex_unlock(&pb->mutex);
+            ret = pb->out->GetScheduledStreamTime(pb->tb_den, &now, &speed);
+            pthread_mutex_lock(&pb->mutex);
+
+            if (ret == S_OK && e.pts + e.duration <= now) {
+                playback_pop(pb);
+                pb->stats.skipped++;
+                pb->free_frames[pb->nb_free++] = e.frame;
+                pthread_cond_broadcast(&pb->cond);
+                continue;
+            }
+
+            if (ret == S_OK && e.pts > now + lead) {
+                playback_wait(pb, e.pts - now - lead);
+                continue;
+            }
+        }
+
+        playback_pop(pb);
+        if (!pb->playing && !pb->stats.buffered)
+            pb->start_pts = e.pts;
+        pb->stats.buffered++;
+        BMD_PROBE(libbmd, schedule_frame, pb->stats.scheduled, e.pts,
+                  pb->nb_pending);
+        pthread_mutex_unlock(&pb->mutex);
+
+        decklink_trace_begin(DECKLINK_TRACE_SCHEDULE,
+                             e.duration ? e.pts / e.duration : -1);
+        ret = pb->out->ScheduleVideoFrame(e.frame, e.pts, e.duration,
+                                          pb->tb_den);
+        decklink_trace_end(DECKLINK_TRACE_SCHEDULE, -1);
+
+        pthread_mutex_lock(&pb->mutex);
+        if (ret != S_OK) {
+            pb->stats.buffered--;
+            pb->stats.skipped++;
+            pb->free_frames[pb->nb_free++] = e.frame;
+            pthread_cond_broadcast(&pb->cond);
+            continue;
+        }
+
+        // only once on the card, with the frames there so far
+        BMD_PROBE(libbmd, schedule_frame_done, pb->stats.scheduled, e.pts,
+                  pb->stats.buffered);
+        pb->stats.scheduled++;
+
+        if (!pb->playing && !pb->hold && pb->stats.buffered >= pb->preroll) {
+            pthread_mutex_unlock(&pb->mutex);
+            ret = pb->out->StartScheduledPlayback(pb->start_pts, pb->tb_den,
+                                                  1.0);
+            pthread_mutex_lock(&pb->mutex);
+            pb->playing = ret == S_OK;
+        }
+    }
+    pthread_mutex_unlock(&pb->mutex);
+
+    return NULL;
+}
+
+void decklink_playback_free(DecklinkPlayback *playback)
+{
+    if (!playback)
+        return;
+
+    if (playback->running)
+        decklink_playback_stop(playback);
+
+    // stop waited for the frames on the card, nothing completes anymore
+    if (playback->out) {
+        playback->out->SetScheduledFrameCompletionCallback(NULL);
+        playback->out->DisableVideoOutput();
+        playback->out->DisableAudioOutput();
+    }
+
+    if (playback->pool) {
+        for (int i = 0; i < playback->pool_size; i++)
+            if (playback->pool[i])
+                playback->pool[i]->Release();
+        free(playback->pool);
+    }
+    free(playback->free_frames);
+    free(playback->pending);
+    free(playback->drawn_by);
+    free(playback->drawn);
+    free(playback->cpus);
+
+    if (playback->dm) {
+        playback->dm->Release();
+        playback->dm = NULL;
+    }
+
+    if (playback->dm_it) {
+        playback->dm_it->Release();
+        playback->dm_it = NULL;
+    }
+
+    if (playback->conf) {
+        playback->conf->Release();
+        playback->conf = NULL;
+    }
+
+    if (playback->out) {
+        playback->out->Release();
+        playback->out = NULL;
+    }
+
+    if (playback->dl) {
+        playback->dl->Release();
+        playback->dl = NULL;
+    }
+
+    if (playback->it)
+        playback->it->Release();
+
+    decklink_watchdog_free(playback->wd);
+
+    pthread_mutex_destroy(&playback->mutex);
+    pthread_cond_destroy(&playback->cond);
+
+    free(playback);
+}
+
+DecklinkPlayback *decklink_playback_alloc(DecklinkConf *c)
+{
+    DecklinkPlayback *playback = (DecklinkPlayback *)calloc(1, sizeof(*playback));
+    BMDPixelFormat    pix[]    = { bmdFormat8BitYUV, bmdFormat10BitYUV,
+                                   bmdFormat8BitARGB, bmdFormat10BitRGB,
+                                   bmdFormat8BitBGRA };
+    PlaybackDelegate  *delegate;
+    BMDTimeValue      frame_duration;
+    HRESULT           ret;
+    int               err;
+    int               i        = 0;
+
+    if (!playback)
+        return NULL;
+
+    pthread_mutex_init(&playback->mutex, NULL);
+    pthread_cond_init(&playback->cond, NULL);
+
+    playback->it = CreateDeckLinkIteratorInstance();
+
+    if (!playback->it)
+        goto fail;
+
+    switch (c->audio_channels) {
+    case  0:
+        c->audio_channels = 2;
+    case  2:
+    case  8:
+    case 16:
+        break;
+    default:
+        goto fail;
+    }
+
+    switch (c->audio_sample_depth) {
+    case  0:
+        c->audio_sample_depth = 16;
+    case 16:
+    case 32:
+        break;
+    default:
+        goto fail;
+    }
+
+    if (c->pixel_format < 0 ||
+        c->pixel_format >= (int)(sizeof(pix) / sizeof(*pix)))
+        goto fail;
+
+    // before the pool is created, so it is locked along
+    if (c->lock_memory && (err = decklink_sched_lock_memory()) < 0)
+        decklink_log(DECKLINK_LOG_WARNING, "Cannot lock the memory: %s",
+                     strerror(-err));
+
+    if (c->preroll <= 0)
+        c->preroll = 5;
+    if (c->pool_size <= c->preroll)
+        c->pool_size = c->preroll * 2;
+
+    do {
+        ret = playback->it->Next(&playback->dl);
+    } while (i++ < c->instance);
+
+    if (ret != S_OK)
+        goto fail;
+
+    ret = playback->dl->QueryInterface(IID_IDeckLinkOutput,
+                                       (void**)&playback->out);
+    if (ret != S_OK)
+        goto fail;
+
+    ret = playback->dl->QueryInterface(IID_IDeckLinkConfiguration,
+                                       (void**)&playback->conf);
+    if (ret != S_OK)
+        goto fail;
+
+    switch (c->video_connection) {
+    case 1:
+        ret = playback->conf->SetInt(bmdDeckLinkConfigVideoOutputConnection,
+                                     bmdVideoConnectionComposite);
+        break;
+    case 2:
+        ret = playback->conf->SetInt(bmdDeckLinkConfigVideoOutputConnection,
+                                     bmdVideoConnectionComponent);
+        break;
+    case 3:
+        ret = playback->conf->SetInt(bmdDeckLinkConfigVideoOutputConnection,
+                                     bmdVideoConnectionHDMI);
+        break;
+    case 4:
+        ret = playback->conf->SetInt(bmdDeckLinkConfigVideoOutputConnection,
+                                     bmdVideoConnectionSDI);
+        break;
+    default:
+        // do not change it
+        break;
+    }
+
+    if (ret != S_OK) {
+        goto fail;
+    }
+
+    ret = playback->out->GetDisplayModeIterator(&playback->dm_it);
+
+    if (ret != S_OK) {
+        goto fail;
+    }
+
+    i = 0;
+    while (playback->dm_it->Next(&playback->dm) == S_OK) {
+        if (c->video_mode != i) {
+            playback->dm->Release();
+            playback->dm = NULL;
+            i++;
+        } else
+            break;
+    }
+
+    if (!playback->dm)
+        goto fail;
+
+    c->width  = playback->dm->GetWidth();
+    c->height = playback->dm->GetHeight();
+    playback->dm->GetFrameRate(&frame_duration, &c->tb_den);
+    c->tb_num = frame_duration;
+
+    playback->width     = c->width;
+    playback->height    = c->height;
+    playback->row_bytes      = decklink_row_bytes(pix[c->pixel_format],
+                                                  c->width);
+    playback->tb_num         = c->tb_num;
+    playback->tb_den         = c->tb_den;
+    playback->frame_duration = frame_duration;
+    playback->preroll        = c->preroll;
+    playback->hold           = c->hold;
+    playback->pool_size      = c->pool_size;
+
+    playback->sched_policy   = c->sched_policy;
+    playback->sched_priority = c->sched_priority;
+    if (c->cpus && !(playback->cpus = strdup(c->cpus)))
+        goto fail;
+
+    if (c->watchdog > 0) {
+        playback->wd = decklink_watchdog_alloc(1, c->tb_num * 1000000000LL /
+                                                  c->tb_den,
+                                               c->watchdog, c->watchdog_dump,
+                                               c->stall_cb, c->priv);
+        if (!playback->wd)
+            goto fail;
+        decklink_watchdog_set_dump(playback->wd, playback_dump, playback);
+        if ((err = decklink_watchdog_sched(playback->wd, c->sched_policy,
+                                           c->sched_priority, c->cpus)) < 0)
+            decklink_log(DECKLINK_LOG_WARNING,
+                         "Cannot set the watchdog thread scheduling: %s",
+                         strerror(-err));
+    }
+
+    playback->pool        = (IDeckLinkMutableVideoFrame **)
+        calloc(c->pool_size, sizeof(*playback->pool));
+    playback->free_frames = (IDeckLinkMutableVideoFrame **)
+        calloc(c->pool_size, sizeof(*playback->free_frames));
+    playback->pending     = (PlaybackEntry *)
+        calloc(c->pool_size, sizeof(*playback->pending));
+    playback->drawn_by    = (uint64_t *)
+        calloc(c->pool_size, sizeof(*playback->drawn_by));
+    playback->drawn       = (int64_t *)
+        calloc(c->pool_size, sizeof(*playback->drawn));
+
+    if (!playback->pool || !playback->free_frames || !playback->pending ||
+        !playback->drawn_by || !playback->drawn)
+        goto fail;
+
+    for (i = 0; i < c->pool_size; i++) {
+        ret = playback->out->CreateVideoFrame(playback->width,
+                                              playback->height,
+                                              playback->row_bytes,
+                                              pix[c->pixel_format],
+                                              bmdFrameFlagDefault,
+                                              &playback->pool[i]);
+        if (ret != S_OK)
+            goto fail;
+        playback->free_frames[playback->nb_free++] = playback->pool[i];
+
+        if (c->lock_memory) {
+            uint8_t *bytes;
+
+            playback->pool[i]->GetBytes((void **)&bytes);
+            decklink_sched_prefault(bytes, playback->row_bytes *
+                                           playback->height);
+        }
+    }
+
+    delegate = new PlaybackDelegate(playback);
+
+    if (!delegate)
+        goto fail;
+
+    playback->out->SetScheduledFrameCompletionCallback(delegate);
+
+    ret = playback->out->EnableVideoOutput(playback->dm->GetDisplayMode(),
+                                           bmdVideoOutputFlagDefault);
+    if (ret != S_OK)
+        goto fail;
+
+    ret = playback->out->EnableAudioOutput(bmdAudioSampleRate48kHz,
+                                           c->audio_sample_depth,
+                                           c->audio_channels,
+                                           bmdAudioOutputStreamTimestamped);
+    if (ret != S_OK)
+        goto fail;
+
+    return playback;
+fail:
+    decklink_playback_free(playback);
+    return NULL;
+}
+
+int decklink_playback_start(DecklinkPlayback *playback)
+{
+    pthread_mutex_lock(&playback->mutex);
+    memset(&playback->stats, 0, sizeof(playback->stats));
+    playback->wake_sum = 0;
+    playback->wakeups  = 0;
+    playback->running  = 1;
+    playback->playing  = 0;
+    pthread_mutex_unlock(&playback->mutex);
+
+    // nothing completes before preroll, the watchdog waits for a frame
+    if (playback->wd) {
+        playback->stalls_base = decklink_watchdog_stalls(playback->wd);
+        decklink_watchdog_arm(playback->wd, 1);
+    }
+
+    if (pthread_create(&playback->thread, NULL, playback_thread, playback)) {
+        playback->running = 0;
+        return -1;
+    }
+    playback->threaded = 1;
+
+    if (playback->sched_policy || playback->cpus) {
+        int ret = decklink_sched_thread(playback->thread,
+                                        playback->sched_policy,
+                                        playback->sched_priority,
+                                        playback->cpus);
+        if (ret < 0)
+            decklink_log(DECKLINK_LOG_WARNING,
+                         "Cannot set the playback thread scheduling: %s",
+                         strerror(-ret));
+    }
+
+    return 0;
+}
+
+// wait for a free frame, NULL once stopped
+static IDeckLinkMutableVideoFrame *playback_get(DecklinkPlayback *pb)
+{
+    IDeckLinkMutableVideoFrame *frame = NULL;
+
+    pthread_mutex_lock(&pb->mutex);
+    while (pb->running && !pb->nb_free)
+        pthread_cond_wait(&pb->cond, &pb->mutex);
+
+    if (pb->running)
+        frame = pb->free_frames[--pb->nb_free];
+    pthread_mutex_unlock(&pb->mutex);
+
+    return frame;
+}
+
+static void playback_put(DecklinkPlayback *pb,
+                         IDeckLinkMutableVideoFrame *frame,
+                         int64_t timestamp, int64_t duration)
+{
+    pthread_mutex_lock(&pb->mutex);
+    pb->pending[pb->windex].frame    = frame;
+    pb->pending[pb->windex].pts      = timestamp;
+    pb->pending[pb->windex].duration = duration;
+    pb->windex = (pb->windex + 1) % pb->pool_size;
+    pb->nb_pending++;
+    pb->stats.submitted++;
+    pthread_cond_broadcast(&pb->cond);
+    pthread_mutex_unlock(&pb->mutex);
+}
+
+static int pool_index(DecklinkPlayback *pb, IDeckLinkMutableVideoFrame *frame)
+{
+    int i;
+
+    for (i = 0; i < pb->pool_size - 1; i++)
+        if (pb->pool[i] == frame)
+            break;
+
+    return i;
+}
+
+int decklink_playback_submit_video(DecklinkPlayback *playback,
+                                   const uint8_t *frame, int stride,
+                                   int64_t timestamp, int64_t duration)
+{
+    IDeckLinkMutableVideoFrame *dst_frame;
+    uint8_t *dst;
+    int size = stride < playback->row_bytes ? stride : playback->row_bytes;
+
+    dst_frame = playback_get(playback);
+    if (!dst_frame)
+        return -1;
+
+    // the copy happens outside the lock, the frame is ours now
+    playback->drawn_by[pool_index(playback, dst_frame)] = 0;
+    dst_frame->GetBytes((void **)&dst);
+    for (int y = 0; y < playback->height; y++)
+        memcpy(dst + y * playback->row_bytes, frame + y * stride, size);
+
+    playback_put(playback, dst_frame, timestamp, duration);
+
+    return 0;
+}
+
+int decklink_playback_submit_pattern(DecklinkPlayback *playback,
+                                     DecklinkGenerator *gen,
+                                     int64_t timestamp, int64_t duration)
+{
+    IDeckLinkMutableVideoFrame *dst_frame;
+    uint64_t generation = decklink_generator_generation(gen);
+    // the frame of the mode shown at the timestamp
+    int64_t number      = (timestamp + playback->frame_duration / 2) /
+                          playback->frame_duration;
+    uint8_t *dst;
+    int i;
+
+    dst_frame = playback_get(playback);
+    if (!dst_frame)
+        return -1;
+
+    i = pool_index(playback, dst_frame);
+    dst_frame->GetBytes((void **)&dst);
+    decklink_generator_draw(gen, dst, playback->row_bytes,
+                            playback->drawn_by[i] == generation ?
+                            playback->drawn[i] : -1, number);
+    playback->drawn_by[i] = generation;
+    playback->drawn[i]    = number;
+
+    playback_put(playback, dst_frame, timestamp, duration);
+
+    return 0;
+}
+
+int decklink_playback_submit_audio(DecklinkPlayback *playback,
+                                   const uint8_t *samples, int nb_samples,
+                                   int64_t timestamp)
+{
+    uint32_t written = 0;
+    HRESULT ret;
+
+    ret = playback->out->ScheduleAudioSamples((void *)samples, nb_samples,
+                                              timestamp, 48000, &written);
+    if (ret != S_OK)
+        return -1;
+
+    pthread_mutex_lock(&playback->mutex);
+    playback->stats.audio_samples += written;
+    pthread_mutex_unlock(&playback->mutex);
+
+    return written;
+}
+
+int decklink_playback_start_at(DecklinkPlayback *playback,
+                               int64_t hardware_time)
+{
+    BMDTimeValue now, in_frame, per_frame, boundary;
+    int64_t start_pts;
+    HRESULT ret;
+
+    pthread_mutex_lock(&playback->mutex);
+    if (playback->playing || !playback->stats.buffered) {
+        pthread_mutex_unlock(&playback->mutex);
+        return -1;
+    }
+    start_pts = playback->start_pts;
+    pthread_mutex_unlock(&playback->mutex);
+
+    ret = playback->out->GetHardwareReferenceClock(playback->tb_den, &now,
+                                                   &in_frame, &per_frame);
+    if (ret != S_OK || !per_frame)
+        return -1;
+
+    // the first boundary past both now and the requested time
+    boundary = now - in_frame + per_frame;
+    if (hardware_time > boundary)
+        boundary += (hardware_time - boundary + per_frame - 1) /
+                    per_frame * per_frame;
+
+    // the stream starts now, early enough to be half a frame into
+    // start_pts at the boundary, which leaves the call that long
+    ret = playback->out->StartScheduledPlayback(start_pts - (boundary - now) +
+                                                per_frame / 2,
+                                                playback->tb_den, 1.0);
+
+    pthread_mutex_lock(&playback->mutex);
+    playback->playing = ret == S_OK;
+    playback->hold    = 0;
+    pthread_mutex_unlock(&playback->mutex);
+
+    return ret == S_OK ? 0 : -1;
+}
+
+void decklink_playback_stats(DecklinkPlayback *playback,
+                             DecklinkPlaybackStats *stats)
+{
+    pthread_mutex_lock(&playback->mutex);
+    *stats = playback->stats;
+    if (playback->wakeups)
+        stats->wake_late = playback->wake_sum / (int64_t)playback->wakeups;
+    pthread_mutex_unlock(&playback->mutex);
+
+    if (playback->wd)
+        stats->stalls = decklink_watchdog_stalls(playback->wd) -
+                        playback->stalls_base;
+}
+
+int decklink_playback_stop(DecklinkPlayback *playback)
+{
+    HRESULT ret = S_OK;
+    int buffered;
+
+    if (playback->wd)
+        decklink_watchdog_arm(playback->wd, 0);
+
+    pthread_mutex_lock(&playback->mutex);
+    playback->running = 0;
+    pthread_cond_broadcast(&playback->cond);
+    pthread_mutex_unlock(&playback->mutex);
+
+    if (playback->threaded) {
+        pthread_join(playback->thread, NULL);
+        playback->threaded = 0;
+    }
+
+    pthread_mutex_lock(&playback->mutex);
+    buffered = playback->stats.buffered;
+    pthread_mutex_unlock(&playback->mutex);
+
+    // the frames on the card come back through the delegate as flushed,
+    // held ones too, and no completion may run past this point
+    if (playback->playing || buffered) {
+        ret = playback->out->StopScheduledPlayback(0, NULL, 0);
+        playback->playing = 0;
+    }
+    playback->out->FlushBufferedAudioSamples();
+    playback_drain(playback);
+
+    pthread_mutex_lock(&playback->mutex);
+    while (playback->nb_pending) {
+        playback->free_frames[playback->nb_free++] =
+            playback->pending[playback->rindex].frame;
+        playback_pop(playback);
+        playback->stats.flushed++;
+    }
+    pthread_mutex_unlock(&playback->mutex);
+
+    return ret;
+}
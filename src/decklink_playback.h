@@ -0,0 +1,111 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_PLAYBACK_H
+#define DECKLINK_PLAYBACK_H
+
+#include <stdint.h>
+
+#include "decklink_capture.h"
+#include "decklink_generator.h"
+
+/**
+ * Playback statistics, the counters start at decklink_playback_start().
+ */
+typedef struct {
+    uint64_t submitted;   // frames accepted by submit_video
+    uint64_t scheduled;   // frames handed to the card
+    uint64_t skipped;     // frames submitted after their display time
+    uint64_t completed;   // frames displayed on time
+    uint64_t late;        // frames displayed late
+    uint64_t dropped;     // frames dropped by the card
+    uint64_t flushed;     // frames discarded by stop
+    uint64_t underruns;   // times the card ran out of frames
+    uint64_t stalls;      // completions late by DecklinkConf.watchdog frames
+    int64_t  wake_late;   // mean ns the scheduling thread woke past its timer
+    int64_t  wake_max;    // the worst of them
+    uint64_t audio_samples;
+    int      buffered;    // frames scheduled but not yet completed
+} DecklinkPlaybackStats;
+
+typedef struct DecklinkPlayback DecklinkPlayback;
+
+/**
+ * Open the output, the conf fields are the same used for capture,
+ * width, height, tb_num and tb_den are filled from the video mode.
+ */
+DecklinkPlayback *decklink_playback_alloc(DecklinkConf *conf);
+
+int decklink_playback_start(DecklinkPlayback *playback);
+
+/**
+ * Copy a frame in the pixel format and size of the output mode,
+ * timestamp and duration are in 1/tb_den units, a frame lasts tb_num.
+ * It blocks while all the pool frames are in use.
+ *
+ * @return 0 on success, a negative value once stopped.
+ */
+int decklink_playback_submit_video(DecklinkPlayback *playback,
+                                   const uint8_t *frame, int stride,
+                                   int64_t timestamp, int64_t duration);
+
+/**
+ * Like submit_video for a generated pattern, drawn straight in the
+ * pool frames. The generator must match the output size and pixel
+ * format, only what changed since a pool frame last held the pattern
+ * is redrawn, so a still pattern costs next to nothing.
+ */
+int decklink_playback_submit_pattern(DecklinkPlayback *playback,
+                                     DecklinkGenerator *gen,
+                                     int64_t timestamp, int64_t duration);
+
+/**
+ * Schedule interleaved samples, the timestamp is in 1/48000 units.
+ *
+ * @return the number of samples accepted, a negative value on error.
+ */
+int decklink_playback_submit_audio(DecklinkPlayback *playback,
+                                   const uint8_t *samples, int nb_samples,
+                                   int64_t timestamp);
+
+/**
+ * Start a playback opened with hold set, on the first frame boundary of
+ * the card clock at or after hardware_time, in 1/tb_den units. The frames
+ * submitted so far are already on the card, the first one goes out on
+ * that boundary with nothing before it. It returns right away, the card
+ * starts on its own.
+ *
+ * @return 0 on success, a negative value if nothing was submitted yet.
+ */
+int decklink_playback_start_at(DecklinkPlayback *playback,
+                               int64_t hardware_time);
+
+void decklink_playback_stats(DecklinkPlayback *playback,
+                             DecklinkPlaybackStats *stats);
+
+/**
+ * Stop the output, the frames on the card are flushed and waited for,
+ * no completion runs once it returns.
+ */
+int decklink_playback_stop(DecklinkPlayback *playback);
+
+void decklink_playback_free(DecklinkPlayback *playback);
+
+#endif // DECKLINK_PLAYBACK_H
@@ -0,0 +1,56 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_PROBE_H
+#define DECKLINK_PROBE_H
+
+/**
+ * Static probes for perf and bpftrace, e.g.
+ *
+ *     bpftrace -e 'usdt:./bmdplay:bmdplay:schedule_frame { ... }'
+ *
+ * Each one is a nop in place until a tracer attaches. Every probe
+ * carries a frame number, -1 for the packets that are not frames, a
+ * timestamp and the depth of the queue it is about. Without sys/sdt.h
+ * or with --disable-probes they are compiled out.
+ */
+/**
+ * An argument that costs something to get is fetched only while a
+ * tracer is attached: the file defines _SDT_HAS_SEMAPHORES before
+ * including this header, declares a BMD_PROBE_SEMAPHORE() for each of
+ * its probes and checks BMD_PROBE_ENABLED() around the fetch.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define BMD_PROBE(provider, name, frame, timestamp, depth) \
+    STAP_PROBE3(provider, name, frame, timestamp, depth)
+#define BMD_PROBE_SEMAPHORE(provider, name) \
+    volatile unsigned short provider##_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes")))
+#define BMD_PROBE_ENABLED(provider, name) \
+    __builtin_expect(provider##_##name##_semaphore, 0)
+#else
+#define BMD_PROBE(provider, name, frame, timestamp, depth) do { } while (0)
+#define BMD_PROBE_SEMAPHORE(provider, name) \
+    struct bmd_probe_##provider##_##name
+#define BMD_PROBE_ENABLED(provider, name) 0
+#endif
+
+#endif // DECKLINK_PROBE_H
@@ -0,0 +1,412 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <DeckLinkAPI.h>
+
+#include "decklink_util.h"
+
+extern "C" {
+#include "decklink_generator.h"
+#include "decklink_phase.h"
+#include "decklink_reference.h"
+}
+
+#define MEASURE_PREROLL 3
+
+struct DecklinkReference {
+    IDeckLinkIterator      *it;
+    IDeckLink              *dl;
+    IDeckLinkOutput        *out;
+    IDeckLinkInput         *in;
+    IDeckLinkConfiguration *conf;
+};
+
+/* Samples on the hardware clock the output frame start at completion
+ * and the start of the frames coming from the reference locked input */
+class MeasureDelegate : public IDeckLinkVideoOutputCallback,
+                        public IDeckLinkInputCallback
+{
+public:
+    MeasureDelegate(IDeckLinkOutput *output, BMDTimeScale timescale,
+                    int nb_samples);
+    ~MeasureDelegate();
+
+    virtual HRESULT STDMETHODCALLTYPE
+        QueryInterface(REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE
+        AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE
+        Release(void);
+    virtual HRESULT STDMETHODCALLTYPE
+        ScheduledFrameCompleted(IDeckLinkVideoFrame*,
+                                BMDOutputFrameCompletionResult);
+    virtual HRESULT STDMETHODCALLTYPE
+        ScheduledPlaybackHasStopped(void) { return S_OK; }
+    virtual HRESULT STDMETHODCALLTYPE
+        VideoInputFormatChanged(BMDVideoInputFormatChangedEvents,
+                                IDeckLinkDisplayMode*,
+                                BMDDetectedVideoInputFormatFlags)
+        { return S_OK; }
+    virtual HRESULT STDMETHODCALLTYPE
+        VideoInputFrameArrived(IDeckLinkVideoInputFrame*,
+                               IDeckLinkAudioInputPacket*);
+
+    // wait for the samples, 0 once all are taken
+    int Wait(int timeout);
+
+    BMDTimeValue   *samples;
+    BMDTimeValue   *input_samples;
+    int             nb_samples;
+    int             count;
+    int             input_count;
+
+private:
+    ULONG ref_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    IDeckLinkOutput *out;
+    BMDTimeScale     scale;
+};
+
+MeasureDelegate::MeasureDelegate(IDeckLinkOutput *output,
+                                 BMDTimeScale timescale, int nb)
+    : nb_samples(nb), count(0), input_count(0), ref_count(0),
+      out(output), scale(timescale)
+{
+    samples       = (BMDTimeValue *)calloc(nb, sizeof(*samples));
+    input_samples = (BMDTimeValue *)calloc(nb, sizeof(*input_samples));
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+MeasureDelegate::~MeasureDelegate()
+{
+    free(samples);
+    free(input_samples);
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+ULONG MeasureDelegate::AddRef(void)
+{
+    pthread_mutex_lock(&mutex);
+    ref_count++;
+    pthread_mutex_unlock(&mutex);
+
+    return (ULONG)ref_count;
+}
+
+ULONG MeasureDelegate::Release(void)
+{
+    pthread_mutex_lock(&mutex);
+    ref_count--;
+    pthread_mutex_unlock(&mutex);
+
+    if (!ref_count) {
+        delete this;
+        return 0;
+    }
+
+    return (ULONG)ref_count;
+}
+
+HRESULT
+MeasureDelegate::ScheduledFrameCompleted(IDeckLinkVideoFrame *frame,
+                                         BMDOutputFrameCompletionResult result)
+{
+    BMDTimeValue now, in_frame, per_frame;
+
+    if (result == bmdOutputFrameFlushed ||
+        out->GetHardwareReferenceClock(scale, &now, &in_frame,
+                                       &per_frame) != S_OK)
+        return S_OK;
+
+    pthread_mutex_lock(&mutex);
+    if (count < nb_samples) {
+        samples[count++] = now - in_frame;
+        if (count == nb_samples && input_count == nb_samples)
+            pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return S_OK;
+}
+
+HRESULT
+MeasureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame *frame,
+                                        IDeckLinkAudioInputPacket *audio)
+{
+    BMDTimeValue time, duration;
+
+    if (!frame || frame->GetFlags() & bmdFrameHasNoInputSource ||
+        frame->GetHardwareReferenceTimestamp(scale, &time,
+                                             &duration) != S_OK)
+        return S_OK;
+
+    pthread_mutex_lock(&mutex);
+    if (input_count < nb_samples) {
+        input_samples[input_count++] = time;
+        if (count == nb_samples && input_count == nb_samples)
+            pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return S_OK;
+}
+
+int MeasureDelegate::Wait(int timeout)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout;
+
+    pthread_mutex_lock(&mutex);
+    while ((count < nb_samples || input_count < nb_samples) && !ret)
+        ret = pthread_cond_timedwait(&cond, &mutex, &ts);
+    ret = count < nb_samples || input_count < nb_samples ? -1 : 0;
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+void decklink_reference_free(DecklinkReference *ref)
+{
+    if (!ref)
+        return;
+
+    if (ref->conf)
+        ref->conf->Release();
+    if (ref->in)
+        ref->in->Release();
+    if (ref->out)
+        ref->out->Release();
+    if (ref->dl)
+        ref->dl->Release();
+    if (ref->it)
+        ref->it->Release();
+
+    free(ref);
+}
+
+DecklinkReference *decklink_reference_alloc(int instance)
+{
+    DecklinkReference *ref = (DecklinkReference *)calloc(1, sizeof(*ref));
+    HRESULT ret;
+    int i = 0;
+
+    if (!ref)
+        return NULL;
+
+    ref->it = CreateDeckLinkIteratorInstance();
+    if (!ref->it)
+        goto fail;
+
+    while ((ret = ref->it->Next(&ref->dl)) == S_OK && i++ < instance) {
+        ref->dl->Release();
+        ref->dl = NULL;
+    }
+
+    if (ret != S_OK) {
+        ref->dl = NULL;
+        goto fail;
+    }
+
+    ret = ref->dl->QueryInterface(IID_IDeckLinkOutput, (void **)&ref->out);
+    if (ret != S_OK)
+        goto fail;
+
+    // only the measure needs it
+    if (ref->dl->QueryInterface(IID_IDeckLinkInput,
+                                (void **)&ref->in) != S_OK)
+        ref->in = NULL;
+
+    ret = ref->dl->QueryInterface(IID_IDeckLinkConfiguration,
+                                  (void **)&ref->conf);
+    if (ret != S_OK)
+        goto fail;
+
+    return ref;
+fail:
+    decklink_reference_free(ref);
+    return NULL;
+}
+
+int decklink_reference_status(DecklinkReference *ref)
+{
+    BMDReferenceStatus status;
+
+    if (ref->out->GetReferenceStatus(&status) != S_OK)
+        return -1;
+
+    if (status & bmdReferenceNotSupportedByHardware)
+        return DECKLINK_REFERENCE_NONE;
+    if (status & bmdReferenceLocked)
+        return DECKLINK_REFERENCE_LOCKED;
+    return DECKLINK_REFERENCE_UNLOCKED;
+}
+
+int decklink_reference_set_offset(DecklinkReference *ref, int offset)
+{
+    HRESULT ret;
+
+    if (offset < -511 || offset > 511)
+        return -1;
+
+    ret = ref->conf->SetInt(bmdDeckLinkConfigReferenceInputTimingOffset,
+                            offset);
+
+    return ret == S_OK ? 0 : -1;
+}
+
+int decklink_reference_save(DecklinkReference *ref)
+{
+    return ref->conf->WriteConfigurationToPreferences() == S_OK ? 0 : -1;
+}
+
+static IDeckLinkDisplayMode *find_mode(IDeckLinkOutput *out, int video_mode)
+{
+    IDeckLinkDisplayModeIterator *it;
+    IDeckLinkDisplayMode *mode = NULL;
+    int i = 0;
+
+    if (out->GetDisplayModeIterator(&it) != S_OK)
+        return NULL;
+
+    while (it->Next(&mode) == S_OK && i++ < video_mode) {
+        mode->Release();
+        mode = NULL;
+    }
+    it->Release();
+
+    return mode;
+}
+
+int decklink_reference_measure(DecklinkReference *ref, int video_mode,
+                               int nb_frames, int64_t *phase,
+                               int64_t *period)
+{
+    IDeckLinkDisplayMode *mode = find_mode(ref->out, video_mode);
+    IDeckLinkMutableVideoFrame *frame = NULL;
+    DecklinkGenerator *gen = NULL;
+    MeasureDelegate *delegate = NULL;
+    BMDTimeValue tb_num;
+    BMDTimeScale tb_den, scale;
+    int width, height, row_bytes;
+    int ret = -1;
+    uint8_t *data;
+
+    if (!mode)
+        return -1;
+    if (!ref->in || nb_frames < 1)
+        goto end;
+
+    width     = mode->GetWidth();
+    height    = mode->GetHeight();
+    row_bytes = decklink_row_bytes(bmdFormat8BitYUV, width);
+    mode->GetFrameRate(&tb_num, &tb_den);
+    // the frame duration is a whole number of ticks
+    scale     = tb_den * 1000;
+
+    if (ref->out->EnableVideoOutput(mode->GetDisplayMode(),
+                                    bmdVideoOutputFlagDefault) != S_OK)
+        goto end;
+    if (ref->in->EnableVideoInput(mode->GetDisplayMode(), bmdFormat8BitYUV,
+                                  bmdVideoInputFlagDefault) != S_OK)
+        goto disable_output;
+
+    gen = decklink_generator_alloc(width, height, 0, DECKLINK_PATTERN_BLACK);
+    if (!gen ||
+        ref->out->CreateVideoFrame(width, height, row_bytes, bmdFormat8BitYUV,
+                                   bmdFrameFlagDefault, &frame) != S_OK)
+        goto disable;
+    frame->GetBytes((void **)&data);
+    decklink_generator_draw(gen, data, row_bytes, -1, 0);
+
+    delegate = new MeasureDelegate(ref->out, scale, nb_frames);
+    delegate->AddRef();
+    if (!delegate->samples || !delegate->input_samples)
+        goto disable;
+    ref->out->SetScheduledFrameCompletionCallback(delegate);
+    ref->in->SetCallback(delegate);
+
+    // the first completions may come before the output settles
+    for (int i = 0; i < nb_frames + MEASURE_PREROLL; i++)
+        ref->out->ScheduleVideoFrame(frame, i * tb_num, tb_num, tb_den);
+    if (ref->in->StartStreams() != S_OK)
+        goto disable;
+    if (ref->out->StartScheduledPlayback(0, tb_den, 1.0) != S_OK)
+        goto stop_input;
+
+    if (!delegate->Wait(nb_frames / 10 + 5)) {
+        int64_t p = tb_num * 1000;
+        int64_t out_phase = decklink_mean_phase(delegate->samples,
+                                                nb_frames, p);
+        int64_t in_phase  = decklink_mean_phase(delegate->input_samples,
+                                                nb_frames, p);
+        int64_t d = out_phase - in_phase;
+
+        *phase  = (d + p) % p * 1000000000LL / scale;
+        *period = p * 1000000000LL / scale;
+        ret     = 0;
+    }
+
+    ref->out->StopScheduledPlayback(0, NULL, 0);
+
+stop_input:
+    ref->in->StopStreams();
+disable:
+    ref->in->SetCallback(NULL);
+    ref->in->DisableVideoInput();
+disable_output:
+    ref->out->SetScheduledFrameCompletionCallback(NULL);
+    ref->out->DisableVideoOutput();
+    if (delegate)
+        delegate->Release();
+    if (frame)
+        frame->Release();
+    decklink_generator_free(gen);
+end:
+    mode->Release();
+
+    return ret;
+}
+
+int decklink_reference_get_offset(DecklinkReference *ref, int *offset)
+{
+    int64_t value;
+
+    if (ref->conf->GetInt(bmdDeckLinkConfigReferenceInputTimingOffset,
+                          &value) != S_OK)
+        return -1;
+
+    *offset = value;
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_REFERENCE_H
+#define DECKLINK_REFERENCE_H
+
+#include <stdint.h>
+
+typedef enum {
+    DECKLINK_REFERENCE_NONE,     // the card has no reference input
+    DECKLINK_REFERENCE_UNLOCKED,
+    DECKLINK_REFERENCE_LOCKED,
+} DecklinkReferenceStatus;
+
+typedef struct DecklinkReference DecklinkReference;
+
+/**
+ * Access the reference input of a card, NULL if there is no such card.
+ */
+DecklinkReference *decklink_reference_alloc(int instance);
+
+/**
+ * @return a DecklinkReferenceStatus, a negative value on error.
+ */
+int decklink_reference_status(DecklinkReference *ref);
+
+/**
+ * Set the output timing offset to the reference, from -511 to 511.
+ */
+int decklink_reference_set_offset(DecklinkReference *ref, int offset);
+
+int decklink_reference_get_offset(DecklinkReference *ref, int *offset);
+
+/**
+ * Store the current offset in the driver preferences.
+ */
+int decklink_reference_save(DecklinkReference *ref);
+
+/**
+ * Measure the phase of the output against the reference. The card input
+ * has to carry a signal locked to the reference, in the same video mode.
+ * nb_frames black frames are played and both the output frame starts and
+ * the input frame starts are sampled on the hardware clock of the card.
+ * phase and period are in nanoseconds, the phase is how far the output
+ * frames start after the input ones, from 0 to period.
+ *
+ * @return 0 on success, a negative value if nb_frames is less than 1,
+ *         the card has no input or no signal arrives on it.
+ */
+int decklink_reference_measure(DecklinkReference *ref, int video_mode,
+                               int nb_frames, int64_t *phase,
+                               int64_t *period);
+
+void decklink_reference_free(DecklinkReference *ref);
+
+#endif // DECKLINK_REFERENCE_H
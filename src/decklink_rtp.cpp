@@ -0,0 +1,393 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+extern "C" {
+#include "decklink_rtp.h"
+}
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#define RTP_PAYLOAD_TYPE 96
+// RTP header, extended sequence number and one sample row data header
+#define RTP_HEADER       20
+// IPv4 and UDP headers
+#define RTP_OVERHEAD     28
+// packets handed to a single sendmmsg()
+#define RTP_BATCH        64
+
+struct DecklinkRtp {
+    int       sock;
+    int       width, height;
+    int       pixel_format;
+    int64_t   timebase;
+
+    int       line_bytes;   // RFC 4175 bytes in a line
+    int       pgroup;       // bytes for 2 pixels
+    int       payload;      // largest payload, whole pixel groups
+    int       per_line;     // packets in a line
+    int       nb_packets;   // packets in a frame
+    int       gso;
+
+    uint8_t        *headers;  // RTP_HEADER bytes for each packet
+    struct iovec   *iov;      // header and payload for each packet
+    struct mmsghdr *msgs;     // a packet each, or a line each with gso
+    int             nb_msgs;
+    uint8_t        *packed;   // the frame in pixel groups, when copied
+
+    uint32_t  seq;
+    uint32_t  ssrc;
+
+    DecklinkRtpStats stats;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR);
+}
+
+static void write16(uint8_t *p, unsigned v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void write32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t read32le(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * v210 keeps 3 components in each little endian 32 bit word, in the
+ * same Cb Y Cr Y order as the RFC 4175 pixel groups that pack 4 of
+ * them in 5 bytes, most significant bits first.
+ */
+static void pack_v210_line(uint8_t *dst, const uint8_t *src, int width)
+{
+    unsigned c[12];
+    int x, i, j, nb;
+
+    for (x = 0; x < width - 1; x += 6, src += 16) {
+        for (i = 0; i < 4; i++) {
+            uint32_t v = read32le(src + 4 * i);
+
+            c[3 * i]     = v & 0x3ff;
+            c[3 * i + 1] = v >> 10 & 0x3ff;
+            c[3 * i + 2] = v >> 20 & 0x3ff;
+        }
+
+        // the last group of a line may hold less than 6 pixels
+        nb = width - x < 6 ? (width - x) / 2 : 3;
+        for (j = 0; j < nb; j++, dst += 5) {
+            const unsigned *p = c + 4 * j;
+
+            dst[0] = p[0] >> 2;
+            dst[1] = p[0] << 6 | p[1] >> 4;
+            dst[2] = p[1] << 4 | p[2] >> 6;
+            dst[3] = p[2] << 2 | p[3] >> 8;
+            dst[4] = p[3];
+        }
+    }
+}
+
+static int open_socket(const char *host, int port)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                      ai->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (!connect(sock, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(res);
+    return sock;
+}
+
+DecklinkRtp *decklink_rtp_alloc(const char *host, int port,
+                                int width, int height, int pixel_format,
+                                int64_t timebase, int mtu, int gso)
+{
+    DecklinkRtp *rtp = (DecklinkRtp *)calloc(1, sizeof(*rtp));
+    int i, p, size;
+
+    if (!rtp)
+        return NULL;
+
+    rtp->sock = -1;
+    if (width < 2 || height < 1 || timebase <= 0)
+        goto fail;
+
+    rtp->width        = width;
+    rtp->height       = height;
+    rtp->pixel_format = pixel_format;
+    rtp->timebase     = timebase;
+    rtp->pgroup       = pixel_format ? 5 : 4;
+    rtp->line_bytes   = width / 2 * rtp->pgroup;
+
+    if (!mtu)
+        mtu = 1500;
+    rtp->payload = (mtu - RTP_OVERHEAD - RTP_HEADER) / rtp->pgroup *
+                   rtp->pgroup;
+    if (rtp->payload <= 0)
+        goto fail;
+
+    rtp->per_line   = (rtp->line_bytes + rtp->payload - 1) / rtp->payload;
+    rtp->nb_packets = rtp->per_line * height;
+
+    rtp->sock = open_socket(host, port);
+    if (rtp->sock < 0)
+        goto fail;
+
+    // the kernel cuts a line in segments as large as the first packet
+    size = RTP_HEADER + rtp->payload;
+    if (gso && rtp->per_line > 1 &&
+        !setsockopt(rtp->sock, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)))
+        rtp->gso = 1;
+
+    rtp->headers = (uint8_t *)calloc(rtp->nb_packets, RTP_HEADER);
+    rtp->iov     = (struct iovec *)calloc(rtp->nb_packets * 2,
+                                          sizeof(*rtp->iov));
+    rtp->nb_msgs = rtp->gso ? height : rtp->nb_packets;
+    rtp->msgs    = (struct mmsghdr *)calloc(rtp->nb_msgs, sizeof(*rtp->msgs));
+    if (!rtp->headers || !rtp->iov || !rtp->msgs)
+        goto fail;
+
+    rtp->packed = (uint8_t *)malloc(rtp->line_bytes * height);
+    if (!rtp->packed)
+        goto fail;
+
+    // the layout is the same for every frame, only the bases change
+    for (p = 0; p < rtp->nb_packets; p++) {
+        int offset = p % rtp->per_line * rtp->payload;
+        int len    = rtp->line_bytes - offset;
+
+        if (len > rtp->payload)
+            len = rtp->payload;
+
+        rtp->iov[2 * p].iov_base     = rtp->headers + p * RTP_HEADER;
+        rtp->iov[2 * p].iov_len      = RTP_HEADER;
+        rtp->iov[2 * p + 1].iov_len  = len;
+    }
+
+    for (i = 0; i < rtp->nb_msgs; i++) {
+        int n = rtp->gso ? rtp->per_line : 1;
+
+        rtp->msgs[i].msg_hdr.msg_iov    = rtp->iov + 2 * i * n;
+        rtp->msgs[i].msg_hdr.msg_iovlen = 2 * n;
+    }
+
+    rtp->ssrc = getpid() ^ (uint32_t)now_ns();
+
+    return rtp;
+fail:
+    decklink_rtp_free(rtp);
+    return NULL;
+}
+
+static void fill_packets(DecklinkRtp *rtp, const uint8_t *frame, int stride,
+                         uint32_t timestamp)
+{
+    int line, i, p = 0;
+
+    for (line = 0; line < rtp->height; line++) {
+        const uint8_t *src = frame + (size_t)line * stride;
+
+        for (i = 0; i < rtp->per_line; i++, p++) {
+            uint8_t *h  = rtp->headers + p * RTP_HEADER;
+            int offset  = i * rtp->payload;
+            int len     = rtp->iov[2 * p + 1].iov_len;
+            uint32_t seq = rtp->seq++;
+
+            h[0] = 0x80;
+            h[1] = RTP_PAYLOAD_TYPE | (p == rtp->nb_packets - 1 ? 0x80 : 0);
+            write16(h + 2, seq & 0xffff);
+            write32(h + 4, timestamp);
+            write32(h + 8, rtp->ssrc);
+            write16(h + 12, seq >> 16);
+            // progressive only: field bit, continuation bit clear
+            write16(h + 14, len);
+            write16(h + 16, line & 0x7fff);
+            write16(h + 18, offset / rtp->pgroup * 2 & 0x7fff);
+
+            rtp->iov[2 * p + 1].iov_base = (void *)(src + offset);
+        }
+    }
+}
+
+// copy makes the packets independent from the frame, the 10 bit ones
+// are repacked anyway
+static void packetize(DecklinkRtp *rtp, const uint8_t *frame, int stride,
+                      int64_t timestamp, int copy)
+{
+    int line;
+
+    if (rtp->pixel_format || copy) {
+        for (line = 0; line < rtp->height; line++) {
+            uint8_t *dst = rtp->packed + (size_t)line * rtp->line_bytes;
+            const uint8_t *src = frame + (size_t)line * stride;
+
+            if (rtp->pixel_format)
+                pack_v210_line(dst, src, rtp->width);
+            else
+                memcpy(dst, src, rtp->line_bytes);
+        }
+        frame  = rtp->packed;
+        stride = rtp->line_bytes;
+    }
+
+    fill_packets(rtp, frame, stride, timestamp * 90000 / rtp->timebase);
+}
+
+int decklink_rtp_send(DecklinkRtp *rtp, const uint8_t *frame, int stride,
+                      int64_t timestamp, int64_t duration)
+{
+    packetize(rtp, frame, stride, timestamp, 0);
+
+    return decklink_rtp_transmit(rtp, duration);
+}
+
+int decklink_rtp_prepare(DecklinkRtp *rtp, const uint8_t *frame, int stride,
+                         int64_t timestamp)
+{
+    packetize(rtp, frame, stride, timestamp, 1);
+
+    return 0;
+}
+
+int decklink_rtp_transmit(DecklinkRtp *rtp, int64_t duration)
+{
+    int per_batch = RTP_BATCH;
+    int nb_batches, batch, sent, ret;
+    int64_t start, period, slot;
+    int errors = 0;
+
+    if (rtp->gso) {
+        per_batch /= rtp->per_line;
+        if (per_batch < 1)
+            per_batch = 1;
+    }
+
+    // leave a tenth of the frame as slack for the next one
+    nb_batches = (rtp->nb_msgs + per_batch - 1) / per_batch;
+    period     = duration * 1000000000LL / rtp->timebase * 9 / 10;
+    slot       = period / nb_batches;
+    start      = now_ns();
+
+    for (batch = 0; batch < nb_batches; batch++) {
+        struct mmsghdr *msgs = rtp->msgs + batch * per_batch;
+        int nb  = rtp->nb_msgs - batch * per_batch;
+        int64_t target = start + batch * slot;
+
+        if (nb > per_batch)
+            nb = per_batch;
+
+        if (now_ns() > target + slot)
+            rtp->stats.late++;
+        else
+            sleep_until(target);
+
+        // on error skip the message that failed and go on
+        for (sent = 0; sent < nb; sent += ret) {
+            ret = sendmmsg(rtp->sock, msgs + sent, nb - sent, 0);
+            if (ret < 0) {
+                ret = errno != EINTR;
+                errors += ret * (rtp->gso ? rtp->per_line : 1);
+            }
+        }
+    }
+
+    rtp->stats.frames++;
+    rtp->stats.errors  += errors;
+    rtp->stats.packets += rtp->nb_packets - errors;
+    rtp->stats.bytes   += (uint64_t)rtp->line_bytes * rtp->height;
+
+    return 0;
+}
+
+void decklink_rtp_stats(DecklinkRtp *rtp, DecklinkRtpStats *stats)
+{
+    *stats = rtp->stats;
+}
+
+void decklink_rtp_free(DecklinkRtp *rtp)
+{
+    if (!rtp)
+        return;
+
+    if (rtp->sock >= 0)
+        close(rtp->sock);
+    free(rtp->headers);
+    free(rtp->iov);
+    free(rtp->msgs);
+    free(rtp->packed);
+    free(rtp);
+}
@@ -0,0 +1,77 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_RTP_H
+#define DECKLINK_RTP_H
+
+#include <stdint.h>
+
+/**
+ * Send uncompressed video as RTP over UDP, following RFC 4175.
+ *
+ * Every line is split in packets of whole pixel groups, sent in
+ * batches with sendmmsg() and spread over the frame duration. The 8 bit
+ * frames given to decklink_rtp_send() are sent straight from the frame
+ * buffer, the 10 bit ones are repacked from v210 to the RFC 4175 big
+ * endian pixel groups first.
+ * With gso set the packets of a line go out as one UDP_SEGMENT send,
+ * if the kernel does not support it they are sent one by one.
+ */
+typedef struct DecklinkRtp DecklinkRtp;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t packets;
+    uint64_t bytes;       // payload bytes
+    uint64_t late;        // batches sent past their time
+    uint64_t errors;      // packets the kernel refused
+} DecklinkRtpStats;
+
+/**
+ * host and port are the destination, timebase the units per second of
+ * the timestamps given to decklink_rtp_send(), mtu bounds the packet
+ * size, 0 uses 1500.
+ */
+DecklinkRtp *decklink_rtp_alloc(const char *host, int port,
+                                int width, int height, int pixel_format,
+                                int64_t timebase, int mtu, int gso);
+
+/**
+ * Send a frame, returning once its last packet is out, about 9/10 of
+ * duration later.
+ */
+int decklink_rtp_send(DecklinkRtp *rtp, const uint8_t *frame, int stride,
+                      int64_t timestamp, int64_t duration);
+
+/**
+ * The same in two steps, for frames that may be overwritten while in
+ * use: prepare copies the frame in the packets, then the caller checks
+ * the source was not torn meanwhile and either transmits or drops it.
+ */
+int decklink_rtp_prepare(DecklinkRtp *rtp, const uint8_t *frame, int stride,
+                         int64_t timestamp);
+
+int decklink_rtp_transmit(DecklinkRtp *rtp, int64_t duration);
+
+void decklink_rtp_stats(DecklinkRtp *rtp, DecklinkRtpStats *stats);
+
+void decklink_rtp_free(DecklinkRtp *rtp);
+
+#endif // DECKLINK_RTP_H
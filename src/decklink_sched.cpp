@@ -0,0 +1,155 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+extern "C" {
+#include "decklink_sched.h"
+}
+
+static const char *const policy_names[] = { "other", "fifo", "rr" };
+
+int decklink_sched_parse(const char *arg, int *policy, int *priority)
+{
+    const char *colon = strchr(arg, ':');
+    char *end;
+    long prio;
+    int i = DECKLINK_SCHED_FIFO;
+
+    if (colon) {
+        for (i = 0; i < 3; i++)
+            if (strlen(policy_names[i]) == (size_t)(colon - arg) &&
+                !strncmp(arg, policy_names[i], colon - arg))
+                break;
+        if (i == 3)
+            return -1;
+        arg = colon + 1;
+    }
+
+    // the realtime policies take 1 to 99, the others 0
+    prio = strtol(arg, &end, 10);
+    if (end == arg || *end || prio > 99 ||
+        prio < (i == DECKLINK_SCHED_OTHER ? 0 : 1))
+        return -1;
+    *policy   = i;
+    *priority = prio;
+
+    return 0;
+}
+
+// "0,2-3" to a set, the CPUs past CPU_SETSIZE are refused
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+
+    CPU_ZERO(set);
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            p    = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+int decklink_sched_thread(pthread_t thread, int policy, int priority,
+                          const char *cpus)
+{
+    struct sched_param param = { 0 };
+    int ret;
+
+    if (cpus) {
+        cpu_set_t set;
+
+        if (parse_cpus(cpus, &set) < 0)
+            return -EINVAL;
+        ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (ret)
+            return -ret;
+    }
+
+    switch (policy) {
+    case DECKLINK_SCHED_OTHER:
+        return 0;
+    case DECKLINK_SCHED_FIFO:
+        policy = SCHED_FIFO;
+        break;
+    case DECKLINK_SCHED_RR:
+        policy = SCHED_RR;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    param.sched_priority = priority;
+    ret = pthread_setschedparam(thread, policy, &param);
+
+    return -ret;
+}
+
+int decklink_sched_lock_memory(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        return -errno;
+
+    return 0;
+}
+
+void decklink_sched_prefault(void *buf, size_t size)
+{
+    volatile uint8_t *p = (volatile uint8_t *)buf;
+    size_t page         = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    if (!size)
+        return;
+
+    // a read alone would map the zero page
+    for (i = 0; i < size; i += page)
+        p[i] = p[i];
+    p[size - 1] = p[size - 1];
+}
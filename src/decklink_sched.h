@@ -0,0 +1,68 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_SCHED_H
+#define DECKLINK_SCHED_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Scheduling of the threads moving frames around: a realtime policy,
+ * the CPUs they may run on and memory that never pages out.
+ */
+typedef enum {
+    DECKLINK_SCHED_OTHER,     // leave the thread alone
+    DECKLINK_SCHED_FIFO,
+    DECKLINK_SCHED_RR,
+} DecklinkSchedPolicy;
+
+/**
+ * Parse "fifo:<priority>", "rr:<priority>" or a bare priority, taken
+ * as fifo.
+ *
+ * @return 0 on success, a negative value if arg makes no sense.
+ */
+int decklink_sched_parse(const char *arg, int *policy, int *priority);
+
+/**
+ * Apply a policy and priority (1-99) to a thread and bind it to the
+ * CPUs in list, as "0,2-3". DECKLINK_SCHED_OTHER keeps the current
+ * policy and a NULL list the current CPUs.
+ *
+ * @return 0 on success, a negative errno value otherwise.
+ */
+int decklink_sched_thread(pthread_t thread, int policy, int priority,
+                          const char *cpus);
+
+/**
+ * Lock the current and future mappings of the process in memory.
+ *
+ * @return 0 on success, a negative errno value otherwise.
+ */
+int decklink_sched_lock_memory(void);
+
+/**
+ * Touch every page of a buffer, without changing its content, so the
+ * first frame through it does not pay for the page faults.
+ */
+void decklink_sched_prefault(void *buf, size_t size);
+
+#endif // DECKLINK_SCHED_H
@@ -0,0 +1,363 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+extern "C" {
+#include "decklink_log.h"
+#include "decklink_trace.h"
+}
+
+typedef struct {
+    uint64_t seq;      // the record number plus one, 0 while written
+    int64_t  ts;       // CLOCK_MONOTONIC nanoseconds
+    int64_t  frame;
+    uint16_t event;
+    char     phase;    // as in the trace format: B, E or i
+} TraceRecord;
+
+/**
+ * Written only by its thread, the dump reads behind head. The rings
+ * outlive their threads and stay around for the next session, once
+ * on the list they never change place, so the list can be walked
+ * without the lock from a head taken under it.
+ */
+typedef struct TraceRing {
+    struct TraceRing *next;
+    pid_t             tid;
+    char              name[16];
+    int               size;
+    uint64_t          head;
+    TraceRecord       records[1];
+} TraceRing;
+
+static const char *const event_names[DECKLINK_TRACE_NB] = {
+    "capture",
+    "enqueue",
+    "dequeue",
+    "write",
+    "decode",
+    "convert",
+    "schedule",
+    "audio",
+};
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int             trace_enabled;
+static int             trace_size;
+static char           *trace_path;
+static TraceRing      *trace_rings;
+static int             trace_fd = -1;
+static pthread_t       trace_dumper;
+static __thread TraceRing *thread_ring;
+
+static TraceRing *new_ring(void)
+{
+    TraceRing *ring;
+
+    pthread_mutex_lock(&trace_mutex);
+    ring = (TraceRing *)calloc(1, sizeof(*ring) +
+                                  (trace_size - 1) * sizeof(TraceRecord));
+    if (ring) {
+        ring->size = trace_size;
+        ring->tid  = syscall(SYS_gettid);
+        pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+        ring->next  = trace_rings;
+        trace_rings = ring;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    return ring;
+}
+
+static void record(DecklinkTraceEvent event, char phase, int64_t frame)
+{
+    TraceRing *ring = thread_ring;
+    TraceRecord *r;
+    struct timespec ts;
+    uint64_t head;
+
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+        return;
+
+    if (!ring) {
+        ring = thread_ring = new_ring();
+        if (!ring)
+            return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    head = ring->head;
+    r    = &ring->records[head % ring->size];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->ts    = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    r->frame = frame;
+    r->event = event;
+    r->phase = phase;
+    __atomic_store_n(&r->seq, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void decklink_trace_begin(DecklinkTraceEvent event, int64_t frame)
+{
+    record(event, 'B', frame);
+}
+
+void decklink_trace_end(DecklinkTraceEvent event, int64_t frame)
+{
+    record(event, 'E', frame);
+}
+
+void decklink_trace_mark(DecklinkTraceEvent event, int64_t frame)
+{
+    record(event, 'i', frame);
+}
+
+static TraceRing *rings_snapshot(int *size)
+{
+    TraceRing *rings;
+
+    pthread_mutex_lock(&trace_mutex);
+    rings = trace_rings;
+    *size = trace_size;
+    pthread_mutex_unlock(&trace_mutex);
+
+    return rings;
+}
+
+/**
+ * Copy the last nb records of a ring while its thread goes on writing,
+ * a record whose sequence changed meanwhile was being overwritten and
+ * is left out. Return the number of records copied.
+ */
+static int copy_ring(TraceRing *ring, TraceRecord *dst, int nb,
+                     uint64_t *head)
+{
+    uint64_t i;
+    int n = 0;
+
+    *head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    i     = *head;
+    if (i > (uint64_t)ring->size)
+        i = ring->size;
+    if (i > (uint64_t)nb)
+        i = nb;
+
+    for (i = *head - i; i < *head; i++) {
+        TraceRecord *src = &ring->records[i % ring->size];
+        uint64_t seq     = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+
+        dst[n] = *src;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != i + 1 ||
+            __atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq ||
+            dst[n].event >= DECKLINK_TRACE_NB)
+            continue;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Only the list head is taken under the lock, a thread recording its
+ * first event does not wait for the file to be written.
+ */
+static int dump(void)
+{
+    TraceRing *ring;
+    TraceRecord *records;
+    FILE *f;
+    int pid = getpid();
+    const char *sep = "";
+    char *path;
+    uint64_t head;
+    int size, i, nb;
+
+    pthread_mutex_lock(&trace_mutex);
+    path = trace_path ? strdup(trace_path) : NULL;
+    pthread_mutex_unlock(&trace_mutex);
+    ring = rings_snapshot(&size);
+
+    records = (TraceRecord *)malloc(size * sizeof(*records));
+    f       = path ? fopen(path, "w") : NULL;
+    free(path);
+    if (!records || !f) {
+        free(records);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+
+    fprintf(f, "{\"traceEvents\":[");
+    for (; ring; ring = ring->next) {
+        nb = copy_ring(ring, records, size, &head);
+
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                sep, pid, ring->tid, ring->name);
+        sep = ",";
+
+        for (i = 0; i < nb; i++) {
+            TraceRecord *r = &records[i];
+
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"libbmd\",\"ph\":\"%c\","
+                    "\"ts\":%lld.%03d,\"pid\":%d,\"tid\":%d",
+                    event_names[r->event], r->phase,
+                    (long long)(r->ts / 1000), (int)(r->ts % 1000),
+                    pid, ring->tid);
+            if (r->phase == 'i')
+                fprintf(f, ",\"s\":\"t\"");
+            if (r->frame >= 0)
+                fprintf(f, ",\"args\":{\"frame\":%lld}", (long long)r->frame);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    free(records);
+
+    return fclose(f) ? -1 : 0;
+}
+
+void decklink_trace_log(int nb_events)
+{
+    TraceRing *ring;
+    TraceRecord *records;
+    struct timespec ts;
+    uint64_t head;
+    int64_t now;
+    int size, i, nb;
+
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+        return;
+
+    ring = rings_snapshot(&size);
+    if (nb_events > size)
+        nb_events = size;
+    if (nb_events < 1)
+        return;
+
+    records = (TraceRecord *)malloc(nb_events * sizeof(*records));
+    if (!records)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    for (; ring; ring = ring->next) {
+        nb = copy_ring(ring, records, nb_events, &head);
+
+        decklink_log(DECKLINK_LOG_WARNING, "Thread %s (%d), %llu events",
+                     ring->name, ring->tid, (unsigned long long)head);
+
+        for (i = 0; i < nb; i++) {
+            TraceRecord *r = &records[i];
+
+            decklink_log(DECKLINK_LOG_WARNING, "  %s %s, frame %lld, "
+                         "%.1f ms ago", event_names[r->event],
+                         r->phase == 'B' ? "begin" :
+                         r->phase == 'E' ? "end" : "mark",
+                         (long long)r->frame, (now - r->ts) / 1e6);
+        }
+    }
+    free(records);
+}
+
+static void *dump_thread(void *priv)
+{
+    uint64_t count;
+
+    while (read(trace_fd, &count, sizeof(count)) == sizeof(count) &&
+           __atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+        dump();
+
+    return NULL;
+}
+
+int decklink_trace_start(const char *path, int nb_events)
+{
+    TraceRing *ring;
+
+    if (trace_enabled || nb_events < 1)
+        return -1;
+
+    pthread_mutex_lock(&trace_mutex);
+    // the rings are kept, a later session goes on with their size
+    if (!trace_size)
+        trace_size = nb_events;
+    for (ring = trace_rings; ring; ring = ring->next) {
+        for (int i = 0; i < ring->size; i++)
+            ring->records[i].seq = 0;
+        ring->head = 0;
+    }
+    free(trace_path);
+    trace_path = strdup(path);
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (!trace_path)
+        return -1;
+
+    trace_fd = eventfd(0, EFD_CLOEXEC);
+    if (trace_fd < 0)
+        return -1;
+
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+    if (pthread_create(&trace_dumper, NULL, dump_thread, NULL)) {
+        trace_enabled = 0;
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void decklink_trace_request(void)
+{
+    uint64_t one = 1;
+
+    if (trace_fd >= 0 && write(trace_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+int decklink_trace_stop(void)
+{
+    if (!trace_enabled)
+        return -1;
+
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    decklink_trace_request();
+    pthread_join(trace_dumper, NULL);
+    close(trace_fd);
+    trace_fd = -1;
+
+    return dump();
+}
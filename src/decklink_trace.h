@@ -0,0 +1,77 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_TRACE_H
+#define DECKLINK_TRACE_H
+
+#include <stdint.h>
+
+/**
+ * In memory event recorder, dumped as Chrome trace-event JSON
+ * (chrome://tracing, ui.perfetto.dev).
+ *
+ * Every thread records in its own ring, without locks, the last
+ * nb_events (timestamp, event, frame) records. Until
+ * decklink_trace_start() recording is a single flag check.
+ */
+typedef enum {
+    DECKLINK_TRACE_CAPTURE,   // capture callback
+    DECKLINK_TRACE_ENQUEUE,
+    DECKLINK_TRACE_DEQUEUE,
+    DECKLINK_TRACE_WRITE,     // mux write
+    DECKLINK_TRACE_DECODE,
+    DECKLINK_TRACE_CONVERT,
+    DECKLINK_TRACE_SCHEDULE,
+    DECKLINK_TRACE_AUDIO,     // audio refill
+    DECKLINK_TRACE_NB
+} DecklinkTraceEvent;
+
+/**
+ * Start recording, the trace is written to path by
+ * decklink_trace_stop() and on decklink_trace_request().
+ */
+int decklink_trace_start(const char *path, int nb_events);
+
+/**
+ * Frame is an id to follow a frame across the threads, -1 if there is
+ * none at hand.
+ */
+void decklink_trace_begin(DecklinkTraceEvent event, int64_t frame);
+void decklink_trace_end(DecklinkTraceEvent event, int64_t frame);
+void decklink_trace_mark(DecklinkTraceEvent event, int64_t frame);
+
+/**
+ * Ask for a dump of what has been recorded so far, safe to call from
+ * a signal handler.
+ */
+void decklink_trace_request(void);
+
+/**
+ * Log the last nb_events records of every thread, an event begun and
+ * not ended yet tells where a thread is stuck.
+ */
+void decklink_trace_log(int nb_events);
+
+/**
+ * Stop recording and write the trace.
+ */
+int decklink_trace_stop(void);
+
+#endif // DECKLINK_TRACE_H
@@ -0,0 +1,118 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_UTIL_H
+#define DECKLINK_UTIL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <DeckLinkAPI.h>
+
+/* Internal helpers shared by the wrappers */
+
+struct DecklinkGenerator;
+
+/**
+ * A number no other generator of the process gets, unlike the pointer
+ * it is never reused once the generator is freed.
+ */
+uint64_t decklink_generator_generation(const struct DecklinkGenerator *gen);
+
+static inline int decklink_row_bytes(BMDPixelFormat pix, int width)
+{
+    switch (pix) {
+    case bmdFormat8BitYUV:
+        return width * 2;
+    case bmdFormat10BitYUV:
+        return ((width + 47) / 48) * 128;
+    case bmdFormat10BitRGB:
+        return ((width + 63) / 64) * 256;
+    default:
+        return width * 4;
+    }
+}
+
+/**
+ * Send a message over a unix socket along with a file descriptor,
+ * fd < 0 sends the message alone.
+ */
+static inline ssize_t decklink_send_fd(int sock, const void *buf, size_t size,
+                                       int fd, int flags)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { (void *)buf, size };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg             = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, flags | MSG_NOSIGNAL);
+}
+
+/**
+ * Receive a message and the file descriptor coming with it, *fd is
+ * set to -1 if there is none.
+ */
+static inline ssize_t decklink_recv_fd(int sock, void *buf, size_t size,
+                                       int *fd, int flags)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { buf, size };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ret = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (ret < 0)
+        return ret;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return ret;
+}
+
+#endif // DECKLINK_UTIL_H
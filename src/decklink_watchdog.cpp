@@ -0,0 +1,266 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+extern "C" {
+#include "decklink_capture.h"
+#include "decklink_log.h"
+#include "decklink_sched.h"
+#include "decklink_trace.h"
+#include "decklink_watchdog.h"
+}
+
+// the events shown per thread on a dump
+#define WATCHDOG_TRACE_EVENTS 8
+
+typedef struct Watchdog {
+    DecklinkWatchdog wd;
+
+    int     output;
+    int64_t frame;
+    int     multiple;
+    int     dump;
+
+    decklink_stall_cb      cb;
+    void                  *priv;
+    decklink_watchdog_dump dump_cb;
+    void                  *opaque;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+    int             running;
+    int             armed;
+
+    // what the thread saw last, reset by arm
+    uint64_t last;
+    int64_t  last_time;
+    int      moved;
+    int      stalled;
+
+    uint64_t stalls;
+} Watchdog;
+
+static const char *const source_names[] = { "Capture", "Playback" };
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// called without the mutex, the callbacks may take their time
+static void report(Watchdog *w, int64_t elapsed, int recovered)
+{
+    decklink_watchdog_dump dump_cb;
+    void *opaque;
+    DecklinkStall stall;
+
+    pthread_mutex_lock(&w->mutex);
+    dump_cb = w->dump_cb;
+    opaque  = w->opaque;
+    pthread_mutex_unlock(&w->mutex);
+
+    stall.output    = w->output;
+    stall.elapsed   = elapsed;
+    stall.frame     = w->frame;
+    stall.stalls    = __atomic_load_n(&w->stalls, __ATOMIC_RELAXED);
+    stall.recovered = recovered;
+
+    if (recovered) {
+        decklink_log(DECKLINK_LOG_WARNING, "%s resumed after %.1f ms",
+                     source_names[w->output], elapsed / 1e6);
+    } else {
+        decklink_log(DECKLINK_LOG_WARNING,
+                     "%s stalled, no frame for %.1f ms (%.1f frames)",
+                     source_names[w->output], elapsed / 1e6,
+                     (double)elapsed / w->frame);
+        if (w->dump) {
+            if (dump_cb)
+                dump_cb(opaque);
+            decklink_trace_log(WATCHDOG_TRACE_EVENTS);
+        }
+    }
+
+    if (w->cb)
+        w->cb(w->priv, &stall);
+}
+
+static void *watchdog_thread(void *priv)
+{
+    Watchdog *w    = (Watchdog *)priv;
+    int64_t period = w->frame / 2;
+    int64_t limit  = w->frame * w->multiple;
+
+    pthread_mutex_lock(&w->mutex);
+    while (w->running) {
+        struct timespec ts;
+        uint64_t frames;
+        int64_t now, ns;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ns         = ts.tv_nsec + period;
+        ts.tv_sec += ns / 1000000000LL;
+        ts.tv_nsec = ns % 1000000000LL;
+        pthread_cond_timedwait(&w->cond, &w->mutex, &ts);
+
+        if (!w->running || !w->armed)
+            continue;
+
+        frames = __atomic_load_n(&w->wd.frames, __ATOMIC_RELAXED);
+        now    = monotonic_ns();
+
+        if (frames != w->last) {
+            int64_t elapsed = now - w->last_time;
+            int stalled     = w->stalled;
+
+            w->last      = frames;
+            w->last_time = now;
+            w->moved     = 1;
+            w->stalled   = 0;
+            if (stalled) {
+                pthread_mutex_unlock(&w->mutex);
+                report(w, elapsed, 1);
+                pthread_mutex_lock(&w->mutex);
+            }
+            continue;
+        }
+
+        if (w->moved && !w->stalled && now - w->last_time > limit) {
+            w->stalled = 1;
+            __atomic_add_fetch(&w->stalls, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&w->mutex);
+            report(w, now - w->last_time, 0);
+            pthread_mutex_lock(&w->mutex);
+        }
+    }
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+void decklink_watchdog_free(DecklinkWatchdog *wd)
+{
+    Watchdog *w = (Watchdog *)wd;
+
+    if (!w)
+        return;
+
+    if (w->running) {
+        pthread_mutex_lock(&w->mutex);
+        w->running = 0;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        pthread_join(w->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+
+    free(w);
+}
+
+DecklinkWatchdog *decklink_watchdog_alloc(int output, int64_t frame,
+                                          int multiple, int dump,
+                                          decklink_stall_cb cb, void *priv)
+{
+    Watchdog *w = (Watchdog *)calloc(1, sizeof(*w));
+    pthread_condattr_t attr;
+
+    if (!w)
+        return NULL;
+
+    w->output   = output;
+    w->frame    = frame;
+    w->multiple = multiple;
+    w->dump     = dump;
+    w->cb       = cb;
+    w->priv     = priv;
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (frame <= 0 || multiple <= 0)
+        goto fail;
+
+    w->running = 1;
+    if (pthread_create(&w->thread, NULL, watchdog_thread, w)) {
+        w->running = 0;
+        goto fail;
+    }
+
+    return &w->wd;
+fail:
+    decklink_watchdog_free(&w->wd);
+    return NULL;
+}
+
+void decklink_watchdog_set_dump(DecklinkWatchdog *wd,
+                                decklink_watchdog_dump dump, void *opaque)
+{
+    Watchdog *w = (Watchdog *)wd;
+
+    pthread_mutex_lock(&w->mutex);
+    w->dump_cb = dump;
+    w->opaque  = opaque;
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int decklink_watchdog_sched(DecklinkWatchdog *wd, int policy, int priority,
+                            const char *cpus)
+{
+    Watchdog *w = (Watchdog *)wd;
+
+    if (!policy && !cpus)
+        return 0;
+
+    return decklink_sched_thread(w->thread, policy, priority, cpus);
+}
+
+void decklink_watchdog_arm(DecklinkWatchdog *wd, int armed)
+{
+    Watchdog *w = (Watchdog *)wd;
+
+    pthread_mutex_lock(&w->mutex);
+    w->armed     = armed;
+    w->last      = __atomic_load_n(&w->wd.frames, __ATOMIC_RELAXED);
+    w->last_time = monotonic_ns();
+    w->moved     = 0;
+    w->stalled   = 0;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+uint64_t decklink_watchdog_stalls(DecklinkWatchdog *wd)
+{
+    Watchdog *w = (Watchdog *)wd;
+
+    return __atomic_load_n(&w->stalls, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,82 @@
+/*
+ * Blackmagic Devices Decklink C wrapper
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef DECKLINK_WATCHDOG_H
+#define DECKLINK_WATCHDOG_H
+
+#include <stdint.h>
+
+#include "decklink_capture.h"
+
+/**
+ * Reports the card callbacks going quiet for more than a number of
+ * frame durations. The callback only bumps a counter, a thread of its
+ * own checks it twice per frame.
+ *
+ * Nothing is reported until a frame came after decklink_watchdog_arm(),
+ * so startup, preroll and hold do not count as stalls.
+ *
+ * Capture and playback use it through DecklinkConf.watchdog, an
+ * application driving the DeckLink API itself can watch its own
+ * callbacks with it.
+ */
+typedef struct DecklinkWatchdog {
+    uint64_t frames;    // written by the callback thread alone
+} DecklinkWatchdog;
+
+/**
+ * Logs the state of the queues behind the watched callback.
+ */
+typedef void (*decklink_watchdog_dump)(void *opaque);
+
+/**
+ * @param output   0 for capture, 1 for playback, as in DecklinkStall
+ * @param frame    frame duration in nanoseconds
+ * @param multiple frame durations without frames to report a stall
+ */
+DecklinkWatchdog *decklink_watchdog_alloc(int output, int64_t frame,
+                                          int multiple, int dump,
+                                          decklink_stall_cb cb, void *priv);
+
+void decklink_watchdog_set_dump(DecklinkWatchdog *wd,
+                                decklink_watchdog_dump dump, void *opaque);
+
+/**
+ * Run the watchdog thread as decklink_sched_thread() would, it should
+ * not be starved by the threads it watches.
+ */
+int decklink_watchdog_sched(DecklinkWatchdog *wd, int policy, int priority,
+                            const char *cpus);
+
+static inline void decklink_watchdog_kick(DecklinkWatchdog *wd)
+{
+    __atomic_store_n(&wd->frames, wd->frames + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start or stop watching, call it with the streams.
+ */
+void decklink_watchdog_arm(DecklinkWatchdog *wd, int armed);
+
+uint64_t decklink_watchdog_stalls(DecklinkWatchdog *wd);
+
+void decklink_watchdog_free(DecklinkWatchdog *wd);
+
+#endif // DECKLINK_WATCHDOG_H
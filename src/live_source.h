@@ -0,0 +1,38 @@
+/*
+ * Blackmagic Devices Decklink playout
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef LIVE_SOURCE_H
+#define LIVE_SOURCE_H
+
+#include <libavutil/dict.h>
+
+/**
+ * Open options for a live source, a pipe or a network stream from a
+ * local encoder: it is probed just enough to find the streams and
+ * nothing is buffered on the way to the decoder.
+ */
+static inline void live_source_options(AVDictionary **opts)
+{
+    av_dict_set(opts, "probesize", "32768", 0);
+    av_dict_set(opts, "analyzeduration", "100000", 0);
+    av_dict_set(opts, "fflags", "nobuffer", 0);
+}
+
+#endif // LIVE_SOURCE_H
@@ -0,0 +1,261 @@
+/*
+ * Frame export over a local socket test
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A reader connects over the unix socket and gets the frames published,
+ * one holding max_held frames misses the next ones until it releases
+ * them, and it is forgotten once it disconnects. The buffers cannot be
+ * written by a reader, not even reopened through /proc. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "decklink_export.h"
+
+#define WIDTH    64
+#define HEIGHT   16
+#define STRIDE   (WIDTH * 2)
+#define BUFFERS  4
+#define MAX_HELD 2
+
+static int fail(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    return 1;
+}
+
+static int wait_readers(DecklinkExport *exp, int nb)
+{
+    DecklinkExportStats stats;
+
+    for (int i = 0; i < 1000; i++) {
+        decklink_export_stats(exp, &stats);
+        if (stats.readers == nb)
+            return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+static int publish(DecklinkExport *exp, uint8_t *frame, int n)
+{
+    memset(frame, n + 1, STRIDE * HEIGHT);
+
+    return decklink_export_publish(exp, frame, WIDTH, HEIGHT, STRIDE, 0,
+                                   n * 1000, 1000);
+}
+
+static int connect_export(const char *path)
+{
+    struct sockaddr_un addr = { AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    strcpy(addr.sun_path, path);
+    if (sock >= 0 &&
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* The descriptor sent along a frame, received by hand */
+static int receive_buffer(int sock)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    char msg_buf[256];
+    struct iovec iov = { msg_buf, sizeof(msg_buf) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    int fd = -1;
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, 0) <= 0)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
+
+static int check_sealed(DecklinkExport *exp, const char *path,
+                        uint8_t *frame, int n)
+{
+    int sock = connect_export(path);
+    char proc[64];
+    int fd, rw, ret = 1;
+    void *p;
+
+    if (sock < 0)
+        return fail("cannot connect");
+    if (wait_readers(exp, 1) < 0 || publish(exp, frame, n) < 0) {
+        fail("the raw reader gets no frame");
+        goto end;
+    }
+
+    fd = receive_buffer(sock);
+    if (fd < 0) {
+        fail("no descriptor along the frame");
+        goto end;
+    }
+
+    p = mmap(NULL, sizeof(frame[0]), PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+    if (p != MAP_FAILED) {
+        fail("a reader can map the buffer for writing");
+        goto end;
+    }
+
+    // the same file, reopened
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    rw = open(proc, O_RDWR);
+    if (rw >= 0) {
+        p = mmap(NULL, 1, PROT_READ | PROT_WRITE, MAP_SHARED, rw, 0);
+        if (p != MAP_FAILED || write(rw, frame, 1) == 1) {
+            close(rw);
+            fail("a reader can reopen the buffer for writing");
+            goto end;
+        }
+        close(rw);
+    }
+    close(fd);
+
+    ret = 0;
+end:
+    close(sock);
+    wait_readers(exp, 0);
+    return ret;
+}
+
+static int check_frame(const DecklinkExportFrame *f, int n)
+{
+    return f->sequence == n && f->timestamp == n * 1000 &&
+           f->duration == 1000 && f->width == WIDTH &&
+           f->height == HEIGHT && f->stride == STRIDE &&
+           f->size == STRIDE * HEIGHT &&
+           f->data[0] == n + 1 && f->data[f->size - 1] == n + 1;
+}
+
+int main(void)
+{
+    uint8_t frame[STRIDE * HEIGHT];
+    DecklinkExportFrame held[MAX_HELD], f;
+    DecklinkExportReader *reader = NULL;
+    DecklinkExportStats stats;
+    DecklinkExport *exp;
+    char path[64];
+    int n, ret = 1;
+
+    snprintf(path, sizeof(path), "/tmp/libbmd-export-%d", (int)getpid());
+
+    // a hung server fails the test instead of hanging it
+    alarm(10);
+
+    exp = decklink_export_alloc(path, BUFFERS, sizeof(frame), MAX_HELD);
+    if (!exp)
+        return fail("cannot create the export");
+
+    reader = decklink_export_connect(path);
+    if (!reader) {
+        fail("cannot connect");
+        goto end;
+    }
+    if (wait_readers(exp, 1) < 0) {
+        fail("the reader is not counted");
+        goto end;
+    }
+
+    // one more than the reader may hold
+    for (n = 0; n <= MAX_HELD; n++)
+        if (publish(exp, frame, n) < 0) {
+            fail("cannot publish");
+            goto end;
+        }
+
+    decklink_export_stats(exp, &stats);
+    if (stats.published != MAX_HELD + 1 || stats.sent != MAX_HELD ||
+        stats.skipped != 1) {
+        fail("a reader holding max_held frames is not skipped");
+        goto end;
+    }
+
+    for (n = 0; n < MAX_HELD; n++)
+        if (decklink_export_next(reader, &held[n], 1000) != 1 ||
+            !check_frame(&held[n], n)) {
+            fail("the frame read is not the one published");
+            goto end;
+        }
+    if (decklink_export_next(reader, &f, 100) != 0) {
+        fail("the skipped frame reached the reader");
+        goto end;
+    }
+
+    for (n = 0; n < MAX_HELD; n++)
+        if (decklink_export_release(reader, &held[n]) < 0) {
+            fail("cannot release");
+            goto end;
+        }
+
+    // the releases are read by the server thread, keep publishing
+    // until the reader gets frames again
+    for (n = MAX_HELD + 1; n < 1000; n++) {
+        if (publish(exp, frame, n) < 0) {
+            fail("the released buffers are not reused");
+            goto end;
+        }
+        if (decklink_export_next(reader, &f, 10) == 1)
+            break;
+    }
+    if (n == 1000 || !check_frame(&f, n)) {
+        fail("the reader gets nothing once it released its frames");
+        goto end;
+    }
+    decklink_export_release(reader, &f);
+
+    decklink_export_disconnect(reader);
+    reader = NULL;
+    if (wait_readers(exp, 0) < 0) {
+        fail("the disconnected reader is still counted");
+        goto end;
+    }
+
+    if (check_sealed(exp, path, frame, n + 1))
+        goto end;
+
+    ret = 0;
+end:
+    decklink_export_disconnect(reader);
+    decklink_export_free(exp);
+
+    return ret;
+}
@@ -0,0 +1,211 @@
+/*
+ * Framebus attach and detach test
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Readers attach and detach over the unix socket, a client that never
+ * completes the handshake holds nobody up, the frames go through and
+ * the shared memory cannot be mapped for writing by a reader. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "decklink_framebus.h"
+
+#define WIDTH  64
+#define HEIGHT 16
+#define STRIDE (WIDTH * 2)
+
+static int fail(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    return 1;
+}
+
+static int wait_readers(DecklinkFramebus *bus, int nb)
+{
+    for (int i = 0; i < 1000; i++) {
+        if (decklink_framebus_readers(bus) == nb)
+            return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+static int connect_bus(const char *path)
+{
+    struct sockaddr_un addr = { AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    strcpy(addr.sun_path, path);
+    if (sock >= 0 &&
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* The handshake done by hand, to get at the memfd itself */
+static int receive_memfd(const char *path)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    int sock = connect_bus(path);
+    int efd  = eventfd(0, EFD_CLOEXEC);
+    int fd   = -1;
+    char c   = 0;
+    struct iovec iov = { &c, 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    if (sock < 0 || efd < 0)
+        goto end;
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg               = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level   = SOL_SOCKET;
+    cmsg->cmsg_type    = SCM_RIGHTS;
+    cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &efd, sizeof(int));
+    if (sendmsg(sock, &msg, 0) != 1)
+        goto end;
+
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, 0) != 1)
+        goto end;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+end:
+    if (efd >= 0)
+        close(efd);
+    if (sock >= 0)
+        close(sock);
+    return fd;
+}
+
+static int check_sealed(const char *path)
+{
+    char proc[64];
+    int fd = receive_memfd(path);
+    int rw;
+    void *p;
+
+    if (fd < 0)
+        return fail("no memfd from the handshake");
+
+    p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED)
+        return fail("a reader can map the bus for writing");
+
+    // the same file, reopened
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    rw = open(proc, O_RDWR);
+    if (rw >= 0) {
+        p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, rw, 0);
+        close(rw);
+        if (p != MAP_FAILED)
+            return fail("a reader can reopen the bus for writing");
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(void)
+{
+    uint8_t frame[STRIDE * HEIGHT];
+    DecklinkFramebusReader *reader;
+    DecklinkFramebusFrame f;
+    DecklinkFramebus *bus;
+    char path[64];
+    int silent, ret = 1;
+
+    snprintf(path, sizeof(path), "/tmp/libbmd-framebus-%d", (int)getpid());
+
+    // a hung server fails the test instead of hanging it
+    alarm(10);
+
+    bus = decklink_framebus_alloc(path, 4, sizeof(frame));
+    if (!bus)
+        return fail("cannot create the bus");
+
+    silent = connect_bus(path);
+    if (silent < 0) {
+        fail("cannot connect");
+        goto end;
+    }
+
+    reader = decklink_framebus_attach(path);
+    if (!reader) {
+        fail("cannot attach while another client sits in the handshake");
+        goto end;
+    }
+    if (wait_readers(bus, 1) < 0) {
+        fail("the reader is not counted");
+        goto end;
+    }
+
+    for (int n = 0; n < 3; n++) {
+        memset(frame, n + 1, sizeof(frame));
+        if (decklink_framebus_publish(bus, frame, WIDTH, HEIGHT, STRIDE, 0,
+                                      n * 1000, 1000) < 0 ||
+            decklink_framebus_next(reader, &f, 1000) != 1) {
+            fail("the frame did not go through");
+            goto end;
+        }
+        if (f.sequence != n || f.dropped || f.timestamp != n * 1000 ||
+            f.size != sizeof(frame) || f.data[0] != n + 1 ||
+            !decklink_framebus_valid(reader, &f)) {
+            fail("the frame read is not the one published");
+            goto end;
+        }
+    }
+
+    if (check_sealed(path))
+        goto end;
+
+    decklink_framebus_detach(reader);
+    if (wait_readers(bus, 0) < 0) {
+        fail("the detached reader is still counted");
+        goto end;
+    }
+
+    ret = 0;
+end:
+    if (silent >= 0)
+        close(silent);
+    decklink_framebus_free(bus);
+
+    return ret;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Calibrate simulated cards, 37 ns per offset step with a few ns of
+# jitter: the offset found has to be the closest to the target, give or
+# take a step, and a target out of reach has to be reported.
+
+genlock=${GENLOCK:-./bmdgenlock}
+status=0
+
+# phase at offset 0, target, expected offset
+check() {
+    out=$($genlock -S $1 -T $2 2>&1)
+    got=$(echo "$out" | sed -n 's/^CALIBRATED //p')
+
+    if [ -z "$got" ] || [ $((got - $3)) -gt 1 ] || [ $(($3 - got)) -gt 1 ]; then
+        echo "phase $1 target $2: calibrated to '$got' instead of $3"
+        status=1
+    fi
+}
+
+check 1000 0 -27
+check 1000 5000 108
+# around the end of the period
+check 39990000 0 270
+check 0 0 0
+
+if ! $genlock -S 100000 -T 0 2>&1 | grep -q "OUT OF RANGE"; then
+    echo "phase 100000: the target out of reach is not reported"
+    status=1
+fi
+
+exit $status
@@ -0,0 +1,283 @@
+/*
+ * Live source loopback test
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A local encoder streams to a pipe and to udp://127.0.0.1, the source
+ * is opened the way bmdplay -I does and every frame has to decode, the
+ * first one soon after it has been sent. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/time.h>
+
+#include "live_source.h"
+
+#define WIDTH       320
+#define HEIGHT      240
+#define RATE        25
+#define NB_FRAMES   50
+#define MAX_LATENCY 1000000 // us from the first frame sent to it decoded
+#define TIMEOUT     10000000
+
+typedef struct Sender {
+    const char *url;
+    int fd;                 // the pipe end to close once done, or -1
+    int64_t first_sent;
+    int ret;
+} Sender;
+
+static int64_t deadline;
+
+static int interrupt_cb(void *opaque)
+{
+    return av_gettime() > deadline;
+}
+
+static int write_packet(AVFormatContext *oc, AVCodecContext *c, AVPacket *pkt)
+{
+    pkt->stream_index = 0;
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts, c->time_base,
+                                oc->streams[0]->time_base);
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q(pkt->dts, c->time_base,
+                                oc->streams[0]->time_base);
+
+    if (av_interleaved_write_frame(oc, pkt) < 0)
+        return -1;
+    avio_flush(oc->pb);
+
+    return 0;
+}
+
+/* Real time, like an encoder fed by a camera */
+static void *send_stream(void *priv)
+{
+    Sender *s           = priv;
+    AVFormatContext *oc = NULL;
+    AVCodec *codec      = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
+    AVFrame *frame      = avcodec_alloc_frame();
+    AVCodecContext *c;
+    AVPicture pic;
+    AVPacket pkt;
+    int n, y, got;
+
+    s->ret = -1;
+
+    // let the receiver bind first
+    usleep(200000);
+
+    if (!codec || !frame ||
+        avformat_alloc_output_context2(&oc, NULL, "mpegts", s->url) < 0)
+        goto end;
+
+    c = avformat_new_stream(oc, codec)->codec;
+    c->width        = WIDTH;
+    c->height       = HEIGHT;
+    c->pix_fmt      = PIX_FMT_YUV420P;
+    c->time_base    = (AVRational){ 1, RATE };
+    c->gop_size     = RATE / 2;
+    c->max_b_frames = 0;
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(c, codec, NULL) < 0 ||
+        avio_open(&oc->pb, s->url, AVIO_FLAG_WRITE) < 0 ||
+        avformat_write_header(oc, NULL) < 0 ||
+        avpicture_alloc(&pic, PIX_FMT_YUV420P, WIDTH, HEIGHT) < 0)
+        goto end;
+
+    for (n = 0; n < NB_FRAMES; n++) {
+        // a moving gradient, something for the encoder to chew on
+        for (y = 0; y < HEIGHT; y++)
+            memset(pic.data[0] + y * pic.linesize[0], (y + n * 4) & 0xff,
+                   WIDTH);
+        for (y = 0; y < HEIGHT / 2; y++) {
+            memset(pic.data[1] + y * pic.linesize[1], 128, WIDTH / 2);
+            memset(pic.data[2] + y * pic.linesize[2], 128, WIDTH / 2);
+        }
+        memcpy(frame->data, pic.data, sizeof(pic.data));
+        memcpy(frame->linesize, pic.linesize, sizeof(pic.linesize));
+        frame->pts = n;
+
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        if (avcodec_encode_video2(c, &pkt, frame, &got) < 0)
+            goto end;
+        if (got) {
+            if (!s->first_sent)
+                s->first_sent = av_gettime();
+            if (write_packet(oc, c, &pkt) < 0)
+                goto end;
+        }
+        usleep(1000000 / RATE);
+    }
+
+    do {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        if (avcodec_encode_video2(c, &pkt, NULL, &got) < 0)
+            goto end;
+        if (got && write_packet(oc, c, &pkt) < 0)
+            goto end;
+    } while (got);
+
+    av_write_trailer(oc);
+    avpicture_free(&pic);
+    s->ret = 0;
+end:
+    if (oc) {
+        if (oc->nb_streams)
+            avcodec_close(oc->streams[0]->codec);
+        if (oc->pb)
+            avio_close(oc->pb);
+        avformat_free_context(oc);
+    }
+    av_free(frame);
+    if (s->fd >= 0)
+        close(s->fd);
+    return NULL;
+}
+
+static int receive(const char *url, Sender *s)
+{
+    AVFormatContext *ic = avformat_alloc_context();
+    AVDictionary *opts  = NULL;
+    AVFrame *frame      = avcodec_alloc_frame();
+    AVCodecContext *c   = NULL;
+    AVCodec *codec;
+    AVPacket pkt;
+    int64_t first = 0;
+    int decoded   = 0;
+    int idx, got;
+
+    deadline                          = av_gettime() + TIMEOUT;
+    ic->interrupt_callback.callback = interrupt_cb;
+
+    live_source_options(&opts);
+    if (avformat_open_input(&ic, url, NULL, &opts) < 0) {
+        fprintf(stderr, "%s: cannot open\n", url);
+        av_dict_free(&opts);
+        av_free(frame);
+        return -1;
+    }
+    av_dict_free(&opts);
+    avformat_find_stream_info(ic, NULL);
+
+    idx = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (idx < 0 || avcodec_open2(ic->streams[idx]->codec, codec, NULL) < 0) {
+        fprintf(stderr, "%s: no video to decode\n", url);
+        goto end;
+    }
+    c = ic->streams[idx]->codec;
+
+    while (decoded < NB_FRAMES && av_read_frame(ic, &pkt) >= 0) {
+        if (pkt.stream_index == idx &&
+            avcodec_decode_video2(c, frame, &got, &pkt) >= 0 && got) {
+            if (!decoded++)
+                first = av_gettime();
+        }
+        av_free_packet(&pkt);
+    }
+
+    // what the decoder still holds
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    while (decoded < NB_FRAMES &&
+           avcodec_decode_video2(c, frame, &got, &pkt) >= 0 && got)
+        decoded++;
+
+end:
+    if (c)
+        avcodec_close(c);
+    avformat_close_input(&ic);
+    av_free(frame);
+
+    fprintf(stderr, "%s: %d/%d frames, first one decoded %d ms after "
+            "it was sent\n", url, decoded, NB_FRAMES,
+            first ? (int)((first - s->first_sent) / 1000) : -1);
+
+    if (decoded < NB_FRAMES || !first)
+        return -1;
+    if (first - s->first_sent > MAX_LATENCY) {
+        fprintf(stderr, "%s: the live source took too long to start\n", url);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run(const char *send_url, const char *recv_url, int fd)
+{
+    Sender s = { send_url, fd, 0, -1 };
+    pthread_t thread;
+    int ret;
+
+    if (pthread_create(&thread, NULL, send_stream, &s))
+        return -1;
+    ret = receive(recv_url, &s);
+    pthread_join(thread, NULL);
+
+    if (s.ret < 0) {
+        fprintf(stderr, "%s: cannot encode the stream\n", send_url);
+        return -1;
+    }
+
+    return ret;
+}
+
+int main(void)
+{
+    char send_url[32], recv_url[32];
+    int fds[2];
+    int ret = 0;
+
+    av_register_all();
+    avformat_network_init();
+
+    // no encoder to feed the test with
+    if (!avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO) ||
+        !av_guess_format("mpegts", NULL, NULL))
+        return 77;
+
+    if (pipe(fds) < 0)
+        return 1;
+    snprintf(send_url, sizeof(send_url), "pipe:%d", fds[1]);
+    snprintf(recv_url, sizeof(recv_url), "pipe:%d", fds[0]);
+    ret |= run(send_url, recv_url, fds[1]);
+    close(fds[0]);
+
+    ret |= run("udp://127.0.0.1:45678?pkt_size=1316",
+               "udp://127.0.0.1:45678", -1);
+
+    avformat_network_deinit();
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Reference phase averaging test
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The samples the measure averages may sit on both sides of the period
+ * boundary, the mean has to be unwrapped around it instead of landing
+ * half a period away. */
+
+#include <stdio.h>
+
+#include "decklink_phase.h"
+
+#define PERIOD 40000
+
+static int fail(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    return 1;
+}
+
+int main(void)
+{
+    // frame starts a few periods apart, jittering around the boundary
+    const int64_t straddle[] = {
+        3 * PERIOD - 20, 4 * PERIOD + 10, 5 * PERIOD - 10, 6 * PERIOD + 20,
+        7 * PERIOD - 30, 8 * PERIOD + 30,
+    };
+    const int64_t late[] = {
+        4 * PERIOD - 10, 5 * PERIOD - 20, 6 * PERIOD - 30, 7 * PERIOD + 20,
+    };
+    const int64_t early[] = {
+        4 * PERIOD + 10, 5 * PERIOD + 20, 6 * PERIOD + 30, 7 * PERIOD - 20,
+    };
+    const int64_t middle[] = {
+        PERIOD + 1000, 2 * PERIOD + 1010, 3 * PERIOD + 990,
+    };
+
+    if (decklink_mean_phase(straddle, 6, PERIOD) != 0)
+        return fail("samples around the boundary do not average to it");
+    if (decklink_mean_phase(late, 4, PERIOD) != PERIOD - 10)
+        return fail("samples mostly before the boundary averaged wrong");
+    if (decklink_mean_phase(early, 4, PERIOD) != 10)
+        return fail("samples mostly after the boundary averaged wrong");
+    if (decklink_mean_phase(middle, 3, PERIOD) != 1000)
+        return fail("samples away from the boundary averaged wrong");
+
+    return 0;
+}
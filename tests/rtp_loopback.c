@@ -0,0 +1,252 @@
+/*
+ * RTP over the loopback test
+ * Copyright (c) 2013 Luca Barbato.
+ *
+ * This file is part of libbmd.
+ *
+ * libbmd is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * libbmd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libbmd; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A receiver on 127.0.0.1 gets every packet of the frames sent, in
+ * sequence, with the marker on the last one of each frame and the
+ * lines where the headers say. The frames take about the time they
+ * last, as paced, and a prepared frame does not change if its source
+ * is overwritten before it is transmitted. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "decklink_rtp.h"
+
+#define WIDTH     256
+#define HEIGHT    64
+#define STRIDE    (WIDTH * 2)
+#define MTU       300
+#define TIMEBASE  1000
+#define DURATION  20        // ms a frame lasts
+#define NB_FRAMES 10
+
+typedef struct Receiver {
+    int      sock;
+    uint8_t  frame[STRIDE * HEIGHT];
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t frames;        // marker bits seen
+    uint32_t seq;           // the extended one expected next
+    uint32_t timestamp;     // of the frame being received
+    int      errors;
+} Receiver;
+
+static int fail(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    return 1;
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static unsigned read16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void check_packet(Receiver *r, const uint8_t *p, int size)
+{
+    uint32_t seq = read16(p + 12) << 16 | read16(p + 2);
+    int len      = read16(p + 14);
+    int line     = read16(p + 16) & 0x7fff;
+    int offset   = (read16(p + 18) & 0x7fff) * 2;
+
+    if (seq != r->seq) {
+        fprintf(stderr, "packet %u instead of %u\n", seq, r->seq);
+        r->errors++;
+    }
+    r->seq = seq + 1;
+
+    if (size < 20 || p[0] != 0x80 || (p[1] & 0x7f) != 96 ||
+        len != size - 20 || line >= HEIGHT || offset + len > STRIDE) {
+        r->errors++;
+        return;
+    }
+
+    if (read32(p + 4) != r->timestamp) {
+        r->errors++;
+        return;
+    }
+
+    memcpy(r->frame + line * STRIDE + offset, p + 20, len);
+    r->packets++;
+    r->bytes += len;
+
+    if (p[1] & 0x80) {
+        if (line != HEIGHT - 1 || offset + len != STRIDE)
+            r->errors++;
+        r->frames++;
+    }
+}
+
+/* Until a poll times out, the sender is done with the frame by then */
+static int receive_frame(Receiver *r, uint32_t timestamp)
+{
+    struct pollfd pfd = { r->sock, POLLIN, 0 };
+    uint64_t frames   = r->frames;
+    uint8_t buf[MTU];
+    ssize_t size;
+
+    r->timestamp = timestamp;
+    while (r->frames == frames) {
+        if (poll(&pfd, 1, 1000) != 1)
+            return -1;
+        size = recv(r->sock, buf, sizeof(buf), 0);
+        if (size < 0 && errno != EINTR)
+            return -1;
+        if (size > 0)
+            check_packet(r, buf, size);
+    }
+
+    return 0;
+}
+
+typedef struct Sender {
+    DecklinkRtp *rtp;
+    uint8_t frame[STRIDE * HEIGHT];
+    int prepare;            // prepare and transmit instead of send
+} Sender;
+
+static void *send_frames(void *priv)
+{
+    Sender *s = priv;
+
+    for (int n = 0; n < NB_FRAMES; n++) {
+        memset(s->frame, n + 1, sizeof(s->frame));
+        if (s->prepare) {
+            decklink_rtp_prepare(s->rtp, s->frame, STRIDE, n * DURATION);
+            // a capture lapping the slot, after the copy
+            memset(s->frame, 0xff, sizeof(s->frame));
+            decklink_rtp_transmit(s->rtp, DURATION);
+        } else {
+            decklink_rtp_send(s->rtp, s->frame, STRIDE, n * DURATION,
+                              DURATION);
+        }
+    }
+
+    return NULL;
+}
+
+static int run(Receiver *r, int port, int gso, int prepare)
+{
+    static Sender s;
+    DecklinkRtpStats stats;
+    pthread_t thread;
+    int64_t start, elapsed;
+    int n, ret = 0;
+
+    s.prepare = prepare;
+    s.rtp     = decklink_rtp_alloc("127.0.0.1", port, WIDTH, HEIGHT, 0,
+                                   TIMEBASE, MTU, gso);
+    if (!s.rtp)
+        return fail("cannot open the sender");
+
+    r->seq = r->packets = r->bytes = r->frames = 0;
+
+    start = now_ms();
+    if (pthread_create(&thread, NULL, send_frames, &s)) {
+        decklink_rtp_free(s.rtp);
+        return fail("cannot start the sender");
+    }
+
+    for (n = 0; n < NB_FRAMES && !ret; n++) {
+        if (receive_frame(r, n * DURATION * 90000 / TIMEBASE) < 0)
+            ret = fail("a frame did not arrive whole");
+        else if (r->frame[0] != n + 1 ||
+                 r->frame[sizeof(r->frame) - 1] != n + 1 ||
+                 memchr(r->frame, 0xff, sizeof(r->frame)))
+            ret = fail("the frame received is not the one sent");
+    }
+
+    pthread_join(thread, NULL);
+    elapsed = now_ms() - start;
+    decklink_rtp_stats(s.rtp, &stats);
+    decklink_rtp_free(s.rtp);
+
+    if (ret)
+        return ret;
+    if (r->errors)
+        return fail("packets out of sequence or malformed");
+    if (stats.frames != NB_FRAMES || stats.errors ||
+        stats.packets != r->packets || stats.bytes != r->bytes ||
+        r->bytes != (uint64_t)NB_FRAMES * STRIDE * HEIGHT)
+        return fail("the packets received are not the ones sent");
+
+    // the last batch goes out at least 2/3 of 9/10 of a frame late
+    if (elapsed < NB_FRAMES * DURATION * 6 / 10 ||
+        elapsed > NB_FRAMES * DURATION * 3) {
+        fprintf(stderr, "%d frames sent in %d ms\n", NB_FRAMES,
+                (int)elapsed);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    struct sockaddr_in addr = { AF_INET };
+    socklen_t len = sizeof(addr);
+    static Receiver r;
+    int ret = 1;
+
+    // a lost packet fails the test instead of hanging it
+    alarm(20);
+
+    r.sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (r.sock < 0 ||
+        bind(r.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(r.sock, (struct sockaddr *)&addr, &len) < 0)
+        return 77;
+
+    if (run(&r, ntohs(addr.sin_port), 0, 0) ||
+        run(&r, ntohs(addr.sin_port), 0, 1) ||
+        run(&r, ntohs(addr.sin_port), 1, 0))
+        goto end;
+
+    ret = 0;
+end:
+    close(r.sock);
+
+    return ret;
+}